@@ -0,0 +1,731 @@
+/*
+ * bench - throughput and latency of raid5 and the BUSE core, without an
+ * nbd device
+ *
+ * The BUSE core is measured by serving a memory disk with buse_serve() to
+ * a synthetic NBD client on the other end of a socketpair.
+ *
+ * raid5 is measured with its own main() against member files in a scratch
+ * directory. This program links a copy of raid5.c whose main() is
+ * raid5_main() and whose buse_main() is bench_buse_main() below: every
+ * array configuration and phase (healthy, one member missing, rebuilding
+ * one) runs in a child process, which sets the array up as usual and then,
+ * instead of serving the kernel, runs the workloads of that phase against
+ * the callbacks, calling them directly and/or through buse_serve().
+ *
+ * Member files go to /dev/shm by default, so the numbers are those of the
+ * parity and I/O paths rather than of a disk.
+ */
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <err.h>
+#include <fcntl.h>
+#include <linux/nbd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "buse.h"
+#include "histogram.h"
+
+#define MAX_LIST 8          /* entries of --block-sizes and --disks */
+#define MAX_DISKS 16
+#define MAX_DEPTH 256
+#define CORE_SIZE (64 << 20)
+#define CORE_WORKERS 4
+
+/* raid5.c, compiled with -Dmain=raid5_main -Dbuse_main=bench_buse_main */
+int raid5_main(int argc, char *argv[]);
+extern uint64_t rebuild_watermark;
+
+enum { MODE_DIRECT = 1, MODE_NBD = 2 };
+enum phase { PHASE_HEALTHY, PHASE_DEGRADED, PHASE_REBUILD };
+
+static const char *phase_names[] = { "healthy", "degraded", "rebuild" };
+
+/* Request sizes in bytes, or relative to the array at hand: raid5 only
+   takes requests in whole blocks. */
+enum unit { UNIT_BYTES, UNIT_BLOCK, UNIT_STRIPE };
+
+struct workload {
+    const char *name;
+    int write;
+    int random;
+    enum unit unit;
+    uint32_t len;
+};
+
+static const struct workload core_tests[] = {
+    { "seq-read", 0, 0, UNIT_BYTES, 128 * 1024 },
+    { "seq-write", 1, 0, UNIT_BYTES, 128 * 1024 },
+    { "rand-read", 0, 1, UNIT_BYTES, 4096 },
+    { "rand-write", 1, 1, UNIT_BYTES, 4096 },
+    { NULL, 0, 0, 0, 0 },
+};
+
+static const struct workload healthy_tests[] = {
+    { "seq-write", 1, 0, UNIT_BYTES, 1024 * 1024 },
+    { "seq-read", 0, 0, UNIT_BYTES, 1024 * 1024 },
+    { "rand-read", 0, 1, UNIT_BLOCK, 0 },
+    { "partial-write", 1, 1, UNIT_BLOCK, 0 },
+    { "stripe-write", 1, 1, UNIT_STRIPE, 0 },
+    { NULL, 0, 0, 0, 0 },
+};
+
+static const struct workload degraded_tests[] = {
+    { "seq-read", 0, 0, UNIT_BYTES, 1024 * 1024 },
+    { "seq-read-block", 0, 0, UNIT_BLOCK, 0 },
+    { "rand-read", 0, 1, UNIT_BLOCK, 0 },
+    { "partial-write", 1, 1, UNIT_BLOCK, 0 },
+    { NULL, 0, 0, 0, 0 },
+};
+
+static const struct workload *phase_tests[] = { healthy_tests, degraded_tests, NULL };
+
+static struct {
+    uint32_t block_sizes[MAX_LIST];
+    int num_block_sizes;
+    uint32_t chunk_sizes[MAX_LIST];
+    int num_chunk_sizes;        /* 0: chunks of one block */
+    int disks[MAX_LIST];
+    int num_disks;
+    int levels[MAX_LIST];
+    int num_levels;
+    uint64_t member_size;
+    const char *dir;
+    const char *io_engine;
+    double seconds;
+    uint32_t depth;
+    int modes;
+    int verbose;
+    int core;
+    int raid5;
+} opts = {
+    .block_sizes = { 4096, 65536 },
+    .num_block_sizes = 2,
+    .disks = { 3, 5 },
+    .num_disks = 2,
+    .levels = { 5 },
+    .num_levels = 1,
+    .member_size = 64 << 20,
+    .dir = "/dev/shm",
+    .io_engine = "threads",
+    .seconds = 1,
+    .depth = 16,
+    .modes = MODE_DIRECT | MODE_NBD,
+};
+
+struct array {
+    int level;
+    int disks;
+    uint32_t block_size, chunk_size;
+};
+
+static int data_disks(const struct array *a)
+{
+    return a->disks - (a->level == 6 ? 2 : 1);
+}
+
+/* The array a raid5 child runs, set before the fork. */
+static struct array cur;
+static enum phase cur_phase;
+
+static char *core_disk;
+
+struct result {
+    uint64_t ops, bytes, errors;
+    double secs;
+    struct histogram lat;
+};
+
+/* Offsets of one run of a workload: sequential from 0, wrapping around,
+   or uniformly random and aligned to the request size. */
+struct cursor {
+    uint64_t size, next, rng;
+    uint32_t len;
+    int random;
+};
+
+static void cursor_init(struct cursor *c, const struct workload *w, uint32_t len, uint64_t size)
+{
+    c->size = size;
+    c->next = 0;
+    c->rng = 0x9e3779b97f4a7c15ULL;
+    c->len = len;
+    c->random = w->random;
+}
+
+static uint64_t cursor_next(struct cursor *c)
+{
+    uint64_t offset;
+
+    if (c->random) {
+        c->rng ^= c->rng << 13;
+        c->rng ^= c->rng >> 7;
+        c->rng ^= c->rng << 17;
+        return (c->rng % (c->size / c->len)) * c->len;
+    }
+    if (c->next + c->len > c->size)
+        c->next = 0;
+    offset = c->next;
+    c->next += c->len;
+    return offset;
+}
+
+static void report(const char *target, const char *mode, const char *test, uint32_t len,
+                   const struct result *r)
+{
+    const struct histogram *h = &r->lat;
+
+    printf("%-38s %-10s %-14s %8u %9.1f MB/s %9.0f IOPS %9.1f avg %9.1f p99 us",
+           target, mode, test, len, r->bytes / 1e6 / r->secs, r->ops / r->secs,
+           h->count ? h->sum / 1e3 / h->count : 0.0, histogram_percentile(h, 0.99) / 1e3);
+    if (r->errors)
+        printf("  %lu errors", r->errors);
+    printf("\n");
+    fflush(stdout);
+}
+
+/* Call the synchronous callbacks one request at a time. */
+static void run_direct(const struct buse_operations *aop, const struct workload *w, uint32_t len,
+                       char *buf, struct result *r)
+{
+    struct cursor c;
+    uint64_t start = histogram_now_ns(), deadline = start + opts.seconds * 1e9, now = start;
+
+    cursor_init(&c, w, len, aop->size);
+    memset(r, 0, sizeof(*r));
+    while (now < deadline) {
+        uint64_t offset = cursor_next(&c);
+        int ret = w->write ? aop->write(buf, len, offset, NULL) : aop->read(buf, len, offset, NULL);
+        uint64_t end = histogram_now_ns();
+
+        histogram_record(&r->lat, end - now);
+        r->ops++;
+        r->bytes += len;
+        if (ret != 0)
+            r->errors++;
+        now = end;
+    }
+    r->secs = (now - start) / 1e9;
+}
+
+/* A synthetic NBD client keeping up to depth requests in flight: one
+   thread sends them, the calling one collects the replies. The handle of
+   a request is its slot; slot depth marks the flush that ends the run. */
+struct client {
+    int sk;
+    const struct workload *w;
+    uint32_t len, depth;
+    uint64_t size;
+    char *buf;
+    sem_t slots;
+    pthread_mutex_t lock;
+    uint32_t free_slots[MAX_DEPTH];
+    uint32_t num_free;
+    uint64_t sent_ns[MAX_DEPTH];
+    uint64_t sent;
+};
+
+static void send_request(int sk, uint32_t type, uint32_t slot, uint64_t offset, uint32_t len,
+                         const char *payload)
+{
+    struct nbd_request request;
+    size_t done = 0;
+
+    memset(&request, 0, sizeof(request));
+    request.magic = htonl(NBD_REQUEST_MAGIC);
+    request.type = htonl(type);
+    request.from = htobe64(offset);
+    request.len = htonl(len);
+    memcpy(request.handle, &slot, sizeof(slot));
+    if (write(sk, &request, sizeof(request)) != sizeof(request))
+        err(EXIT_FAILURE, "bench: send request");
+    while (payload && done < len) {
+        ssize_t n = write(sk, payload + done, len - done);
+        if (n <= 0)
+            err(EXIT_FAILURE, "bench: send payload");
+        done += n;
+    }
+}
+
+static void recv_exact(int sk, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = read(sk, (char *)buf + done, len - done);
+        if (n <= 0)
+            errx(EXIT_FAILURE, "bench: server closed the connection");
+        done += n;
+    }
+}
+
+static void *client_send_main(void *arg)
+{
+    struct client *cl = arg;
+    struct cursor c;
+    uint64_t deadline = histogram_now_ns() + opts.seconds * 1e9;
+
+    cursor_init(&c, cl->w, cl->len, cl->size);
+    while (histogram_now_ns() < deadline) {
+        uint32_t slot;
+
+        sem_wait(&cl->slots);
+        pthread_mutex_lock(&cl->lock);
+        slot = cl->free_slots[--cl->num_free];
+        cl->sent++;
+        pthread_mutex_unlock(&cl->lock);
+        cl->sent_ns[slot] = histogram_now_ns();
+        send_request(cl->sk, cl->w->write ? NBD_CMD_WRITE : NBD_CMD_READ, slot, cursor_next(&c),
+                     cl->len, cl->w->write ? cl->buf : NULL);
+    }
+    send_request(cl->sk, NBD_CMD_FLUSH, cl->depth, 0, 0, NULL);
+    return NULL;
+}
+
+struct server {
+    int sk;
+    const struct buse_operations *aop;
+    int status;
+};
+
+static void *server_main(void *arg)
+{
+    struct server *s = arg;
+
+    s->status = buse_serve(s->sk, s->aop, NULL);
+    return NULL;
+}
+
+static void run_nbd(const struct buse_operations *aop, const struct workload *w, uint32_t len,
+                    uint32_t depth, char *buf, struct result *r)
+{
+    struct client cl = { .w = w, .len = len, .depth = depth, .size = aop->size, .buf = buf };
+    struct server srv = { .aop = aop };
+    pthread_t server_thread, send_thread;
+    uint64_t start = histogram_now_ns(), received = 0;
+    int sp[2], flushed = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0)
+        err(EXIT_FAILURE, "bench: socketpair");
+    cl.sk = sp[0];
+    srv.sk = sp[1];
+    sem_init(&cl.slots, 0, depth);
+    pthread_mutex_init(&cl.lock, NULL);
+    for (uint32_t i = 0; i < depth; i++)
+        cl.free_slots[cl.num_free++] = i;
+    memset(r, 0, sizeof(*r));
+    if (pthread_create(&server_thread, NULL, server_main, &srv) != 0 ||
+        pthread_create(&send_thread, NULL, client_send_main, &cl) != 0)
+        errx(EXIT_FAILURE, "bench: cannot start threads");
+
+    /* with workers the flush may overtake requests sent before it */
+    for (;;) {
+        struct nbd_reply reply;
+        uint32_t slot;
+
+        pthread_mutex_lock(&cl.lock);
+        if (flushed && received == cl.sent) {
+            pthread_mutex_unlock(&cl.lock);
+            break;
+        }
+        pthread_mutex_unlock(&cl.lock);
+        recv_exact(cl.sk, &reply, sizeof(reply));
+        if (reply.magic != htonl(NBD_REPLY_MAGIC))
+            errx(EXIT_FAILURE, "bench: bad reply magic");
+        memcpy(&slot, reply.handle, sizeof(slot));
+        if (slot == depth) {
+            flushed = 1;
+            continue;
+        }
+        if (!w->write && reply.error == 0)
+            recv_exact(cl.sk, buf, len);
+        histogram_record(&r->lat, histogram_now_ns() - cl.sent_ns[slot]);
+        r->ops++;
+        r->bytes += len;
+        if (reply.error != 0)
+            r->errors++;
+        received++;
+        pthread_mutex_lock(&cl.lock);
+        cl.free_slots[cl.num_free++] = slot;
+        pthread_mutex_unlock(&cl.lock);
+        sem_post(&cl.slots);
+    }
+    r->secs = (histogram_now_ns() - start) / 1e9;
+    pthread_join(send_thread, NULL);
+    send_request(cl.sk, NBD_CMD_DISC, 0, 0, 0, NULL);
+    pthread_join(server_thread, NULL);
+    if (srv.status != 0)
+        warnx("bench: buse_serve failed");
+    close(sp[0]);
+    close(sp[1]);
+    sem_destroy(&cl.slots);
+    pthread_mutex_destroy(&cl.lock);
+}
+
+static char *alloc_buffer(size_t len)
+{
+    char *buf;
+
+    if (posix_memalign((void **)&buf, 4096, len) != 0)
+        errx(EXIT_FAILURE, "bench: out of memory");
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(i * 7 + 1);
+    return buf;
+}
+
+static int core_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    (void)userdata;
+    memcpy(buf, core_disk + offset, len);
+    return 0;
+}
+
+static int core_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    (void)userdata;
+    memcpy(core_disk + offset, buf, len);
+    return 0;
+}
+
+/* BUSE overhead: a memory disk served with and without workers, at depth
+   1 and at --depth. */
+static void run_core(void)
+{
+    uint32_t depths[2] = { 1, opts.depth };
+    char *buf = alloc_buffer(1024 * 1024);
+
+    core_disk = calloc(1, CORE_SIZE);
+    if (!core_disk)
+        errx(EXIT_FAILURE, "bench: out of memory");
+    for (int workers = 0; workers <= CORE_WORKERS; workers += CORE_WORKERS) {
+        struct buse_operations bop = {
+            .read = core_read,
+            .write = core_write,
+            .size = CORE_SIZE,
+            .num_workers = workers,
+        };
+
+        for (int d = 0; d < 2; d++) {
+            char target[64], mode[32];
+
+            snprintf(target, sizeof(target), "core workers=%d", workers);
+            snprintf(mode, sizeof(mode), "nbd qd=%u", depths[d]);
+            for (const struct workload *w = core_tests; w->name; w++) {
+                struct result r;
+
+                run_nbd(&bop, w, w->len, depths[d], buf, &r);
+                report(target, mode, w->name, w->len, &r);
+            }
+        }
+    }
+    free(core_disk);
+    free(buf);
+}
+
+static void wait_rebuild(const struct buse_operations *aop, const char *target)
+{
+    uint64_t num_stripes = aop->size / (data_disks(&cur) * (uint64_t)cur.block_size);
+    uint64_t start = histogram_now_ns(), seen = 0, progress_ns = start, now;
+    double secs;
+
+    while (__atomic_load_n(&rebuild_watermark, __ATOMIC_RELAXED) < num_stripes) {
+        uint64_t watermark = __atomic_load_n(&rebuild_watermark, __ATOMIC_RELAXED);
+
+        now = histogram_now_ns();
+        if (watermark != seen) {
+            seen = watermark;
+            progress_ns = now;
+        } else if (now - progress_ns > 10 * 1000000000ULL) {
+            printf("%-38s %-10s %-14s stuck at stripe %lu of %lu\n", target, "-", "rebuild",
+                   watermark, num_stripes);
+            return;
+        }
+        usleep(1000);
+    }
+    secs = (histogram_now_ns() - start) / 1e9;
+    printf("%-38s %-10s %-14s %8u %9.1f MB/s %9.2f s\n", target, "-", "rebuild", cur.block_size,
+           num_stripes * cur.block_size / 1e6 / secs, secs);
+    fflush(stdout);
+}
+
+static void array_name(char *name, size_t size, const struct array *a, enum phase phase)
+{
+    if (a->chunk_size == a->block_size)
+        snprintf(name, size, "raid%d n=%d bs=%u %s", a->level, a->disks, a->block_size,
+                 phase_names[phase]);
+    else
+        snprintf(name, size, "raid%d n=%d bs=%u c=%u %s", a->level, a->disks, a->block_size,
+                 a->chunk_size, phase_names[phase]);
+}
+
+int bench_buse_main(const char *dev_file, const struct buse_operations *aop, void *userdata)
+{
+    uint32_t stripe_len = data_disks(&cur) * cur.chunk_size;
+    char *buf = alloc_buffer(stripe_len > 1024 * 1024 ? stripe_len : 1024 * 1024);
+    char target[64], mode[32];
+
+    (void)dev_file;
+    (void)userdata;
+    array_name(target, sizeof(target), &cur, cur_phase);
+    snprintf(mode, sizeof(mode), "nbd qd=%u", opts.depth);
+    if (cur_phase == PHASE_REBUILD)
+        wait_rebuild(aop, target);
+    for (const struct workload *w = phase_tests[cur_phase]; w && w->name; w++) {
+        uint32_t len = w->unit == UNIT_STRIPE ? stripe_len :
+                       w->unit == UNIT_BLOCK ? cur.block_size : w->len;
+        struct result r;
+
+        if (opts.modes & MODE_DIRECT) {
+            run_direct(aop, w, len, buf, &r);
+            report(target, "callbacks", w->name, len, &r);
+        }
+        if (opts.modes & MODE_NBD) {
+            run_nbd(aop, w, len, opts.depth, buf, &r);
+            report(target, mode, w->name, len, &r);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/* Run one phase of an array in a child, raid5 being good for one array
+   per process. Member paths come with a leading "+", which asks raid5 to
+   rebuild that member. */
+static int run_raid5_phase(char paths[][4096], const struct array *a, enum phase phase)
+{
+    char bs[16], chunk[16], level[4], name[64], *argv[MAX_DISKS + 10];
+    int argc = 0, status;
+    pid_t pid;
+
+    snprintf(bs, sizeof(bs), "%u", a->block_size);
+    snprintf(chunk, sizeof(chunk), "%u", a->chunk_size);
+    snprintf(level, sizeof(level), "%d", a->level);
+    argv[argc++] = "raid5";
+    argv[argc++] = "-L";
+    argv[argc++] = level;
+    argv[argc++] = "-e";
+    argv[argc++] = (char *)opts.io_engine;
+    argv[argc++] = "-C";
+    argv[argc++] = chunk;
+    argv[argc++] = bs;
+    argv[argc++] = "bench";
+    for (int i = 0; i < a->disks; i++) {
+        /* member 1 is the one missing or rebuilt */
+        if (i == 1 && phase == PHASE_DEGRADED)
+            argv[argc++] = "MISSING";
+        else
+            argv[argc++] = i == 1 && phase == PHASE_REBUILD ? paths[i] : paths[i] + 1;
+    }
+    argv[argc] = NULL;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+        err(EXIT_FAILURE, "bench: fork");
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        if (!opts.verbose && null >= 0)
+            dup2(null, STDERR_FILENO);
+        cur = *a;
+        cur_phase = phase;
+        exit(raid5_main(argc, argv));
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        array_name(name, sizeof(name), a, phase);
+        warnx("%s failed%s", name, opts.verbose ? "" : ", run with -v to see why");
+        return -1;
+    }
+    return 0;
+}
+
+static int run_raid5(void)
+{
+    int failed = 0;
+
+    for (int l = 0; l < opts.num_levels; l++) {
+      for (int d = 0; d < opts.num_disks; d++) {
+        for (int b = 0; b < opts.num_block_sizes; b++) {
+          for (int c = 0; c < (opts.num_chunk_sizes ? opts.num_chunk_sizes : 1); c++) {
+            struct array a = { opts.levels[l], opts.disks[d], opts.block_sizes[b], opts.block_sizes[b] };
+            char paths[MAX_DISKS][4096];
+
+            if (opts.num_chunk_sizes)
+                a.chunk_size = opts.chunk_sizes[c];
+            if (a.chunk_size % a.block_size != 0 || data_disks(&a) < 2)
+                continue;
+            for (int i = 0; i < a.disks; i++) {
+                int fd;
+
+                snprintf(paths[i], sizeof(paths[i]), "+%s/buse-bench.%d.%d", opts.dir, (int)getpid(), i);
+                fd = open(paths[i] + 1, O_RDWR | O_CREAT | O_TRUNC, 0600);
+                if (fd < 0 || ftruncate(fd, opts.member_size) != 0)
+                    err(EXIT_FAILURE, "bench: %s", paths[i] + 1);
+                close(fd);
+            }
+            for (enum phase p = PHASE_HEALTHY; p <= PHASE_REBUILD; p++) {
+                if (run_raid5_phase(paths, &a, p) != 0)
+                    failed = 1;
+            }
+            for (int i = 0; i < a.disks; i++)
+                unlink(paths[i] + 1);
+          }
+        }
+      }
+    }
+    return failed;
+}
+
+/* argument parsing using argp */
+
+static struct argp_option options[] = {
+    {"block-sizes", 'b', "LIST", 0, "raid5 block sizes to measure, comma separated (default 4096,65536)", 0},
+    {"chunk-sizes", 'c', "LIST", 0, "raid5 chunk sizes to measure with every block size they are a multiple of (default: chunks of one block)", 0},
+    {"disks", 'n', "LIST", 0, "raid5 member counts to measure, comma separated (default 3,5)", 0},
+    {"levels", 'L', "LIST", 0, "RAID levels to measure, 5 and/or 6 (default 5); RAID6 needs at least 4 disks", 0},
+    {"size", 's', "MIB", 0, "Size of every raid5 member file in MiB (default 64)", 0},
+    {"dir", 'd', "DIR", 0, "Directory for the member files (default /dev/shm)", 0},
+    {"io-engine", 'e', "ENGINE", 0, "raid5 member I/O engine: sync, threads (default) or uring", 0},
+    {"time", 't', "SECS", 0, "Run every test for SECS seconds (default 1)", 0},
+    {"depth", 'q', "N", 0, "Requests the NBD client keeps in flight (default 16)", 0},
+    {"mode", 'm', "MODE", 0, "callbacks to call raid5 directly, nbd to go through buse_serve, or all (default)", 0},
+    {"verbose", 'v', 0, 0, "Show what raid5 prints", 0},
+    {0},
+};
+
+static int parse_list(const char *arg, long *values, int max)
+{
+    char *end;
+    int n = 0;
+
+    do {
+        if (n == max)
+            return -1;
+        values[n] = strtol(arg, &end, 10);
+        if (end == arg || values[n] <= 0)
+            return -1;
+        n++;
+        arg = end + 1;
+    } while (*end == ',');
+    return *end ? -1 : n;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    long values[MAX_LIST];
+    int n;
+
+    switch (key) {
+        case 'b':
+            if ((n = parse_list(arg, values, MAX_LIST)) < 0)
+                argp_error(state, "bad block size list '%s'", arg);
+            for (int i = 0; i < n; i++)
+                opts.block_sizes[i] = values[i];
+            opts.num_block_sizes = n;
+            break;
+        case 'c':
+            if ((n = parse_list(arg, values, MAX_LIST)) < 0)
+                argp_error(state, "bad chunk size list '%s'", arg);
+            for (int i = 0; i < n; i++)
+                opts.chunk_sizes[i] = values[i];
+            opts.num_chunk_sizes = n;
+            break;
+        case 'n':
+            if ((n = parse_list(arg, values, MAX_LIST)) < 0)
+                argp_error(state, "bad disk count list '%s'", arg);
+            for (int i = 0; i < n; i++) {
+                if (values[i] < 3 || values[i] > MAX_DISKS)
+                    argp_error(state, "raid5 takes 3 to %d disks", MAX_DISKS);
+                opts.disks[i] = values[i];
+            }
+            opts.num_disks = n;
+            break;
+        case 'L':
+            if ((n = parse_list(arg, values, MAX_LIST)) < 0)
+                argp_error(state, "bad level list '%s'", arg);
+            for (int i = 0; i < n; i++) {
+                if (values[i] != 5 && values[i] != 6)
+                    argp_error(state, "raid5 runs RAID levels 5 and 6");
+                opts.levels[i] = values[i];
+            }
+            opts.num_levels = n;
+            break;
+        case 's':
+            opts.member_size = strtoull(arg, NULL, 10) << 20;
+            break;
+        case 'd':
+            opts.dir = arg;
+            break;
+        case 'e':
+            opts.io_engine = arg;
+            break;
+        case 't':
+            opts.seconds = strtod(arg, NULL);
+            break;
+        case 'q':
+            opts.depth = strtoul(arg, NULL, 10);
+            if (opts.depth < 1 || opts.depth > MAX_DEPTH)
+                argp_error(state, "depth must be 1 to %d", MAX_DEPTH);
+            break;
+        case 'm':
+            if (strcmp(arg, "callbacks") == 0)
+                opts.modes = MODE_DIRECT;
+            else if (strcmp(arg, "nbd") == 0)
+                opts.modes = MODE_NBD;
+            else if (strcmp(arg, "all") == 0)
+                opts.modes = MODE_DIRECT | MODE_NBD;
+            else
+                argp_error(state, "unknown mode '%s'", arg);
+            break;
+        case 'v':
+            opts.verbose = 1;
+            break;
+        case ARGP_KEY_ARG:
+            if (strcmp(arg, "core") == 0)
+                opts.core = 1;
+            else if (strcmp(arg, "raid5") == 0)
+                opts.raid5 = 1;
+            else
+                argp_error(state, "unknown suite '%s'", arg);
+            break;
+        case ARGP_KEY_END:
+            if (!opts.core && !opts.raid5)
+                opts.core = opts.raid5 = 1;
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = {
+    .options = options,
+    .parser = parse_opt,
+    .args_doc = "[core] [raid5]",
+    .doc = "Measure the BUSE core and raid5 without an nbd device.",
+};
+
+int main(int argc, char *argv[])
+{
+    int failed = 0;
+
+    argp_parse(&argp, argc, argv, 0, 0, NULL);
+    printf("%-38s %-10s %-14s %8s\n", "target", "mode", "test", "bytes");
+    if (opts.core)
+        run_core();
+    if (opts.raid5)
+        failed = run_raid5();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "raid_io.h"
+
+#define BITMAP_MAGIC "BR5WIBMP"
+#define BITMAP_VERSION 1
+
+struct bitmap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t region_stripes;
+    uint64_t nregions;
+    uint64_t data_blocks;
+};
+
+static uint64_t region_stripes_for(int block_size) {
+    uint64_t stripes = BITMAP_REGION_BYTES / block_size;
+    return stripes ? stripes : 1;
+}
+
+static size_t image_len_for(uint64_t nregions, int block_size) {
+    size_t bytes = (nregions + 7) / 8;
+    return (1 + (bytes + block_size - 1) / block_size) * (size_t)block_size;
+}
+
+uint64_t bitmap_blocks(uint64_t member_blocks, int block_size) {
+    uint64_t region_stripes = region_stripes_for(block_size);
+    return image_len_for((member_blocks + region_stripes - 1) / region_stripes, block_size) / block_size;
+}
+
+static unsigned char *bits(const struct intent_bitmap *bm) {
+    return bm->image + bm->block_size;
+}
+
+/* Write image bytes [from, from+len) to every present member. */
+static int write_image(struct intent_bitmap *bm, size_t from, size_t len, bool sync) {
+    struct raid_io ios[bm->nfds];
+    int nios = 0, ret;
+
+    for (int i = 0; i < bm->nfds; i++) {
+        if (bm->fds[i] < 0)
+            continue;
+        ios[nios++] = (struct raid_io){ .disk = i, .write = 1, .buf = bm->image + from,
+                                        .len = len, .offset = bm->offset + from };
+    }
+    ret = raid_io_submit(ios, nios);
+    for (int i = 0; i < nios; i++) {
+        if (ios[i].result != (ssize_t)len)
+            fprintf(stderr, "bitmap write (device %d): %s\n", ios[i].disk,
+                    ios[i].result < 0 ? strerror(-ios[i].result) : "short transfer");
+        else if (sync && fdatasync(bm->fds[ios[i].disk]) != 0) {
+            perror("bitmap fdatasync");
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* Write out the bitmap blocks touched since the last write. */
+static int write_changed(struct intent_bitmap *bm, bool sync) {
+    int ret = 0;
+    if (bm->lo <= bm->hi) {
+        size_t from = (1 + bm->lo) * (size_t)bm->block_size;
+        ret = write_image(bm, from, (bm->hi - bm->lo + 1) * (size_t)bm->block_size, sync);
+    }
+    bm->lo = UINT64_MAX;
+    bm->hi = 0;
+    return ret;
+}
+
+static void touch(struct intent_bitmap *bm, uint64_t region) {
+    uint64_t block = region / 8 / bm->block_size;
+    if (block < bm->lo)
+        bm->lo = block;
+    if (block > bm->hi)
+        bm->hi = block;
+}
+
+int bitmap_load(struct intent_bitmap *bm, const int *fds, int nfds,
+                uint64_t data_blocks, int block_size) {
+    struct bitmap_header *hdr;
+    unsigned char *copy;
+    bool found = false;
+    int used = -1;          /* a member without a bitmap but with data there */
+
+    memset(bm, 0, sizeof(*bm));
+    bm->fds = fds;
+    bm->nfds = nfds;
+    bm->block_size = block_size;
+    bm->region_stripes = region_stripes_for(block_size);
+    bm->nregions = (data_blocks + bm->region_stripes - 1) / bm->region_stripes;
+    bm->offset = data_blocks * block_size;
+    bm->image_len = image_len_for(bm->nregions, block_size);
+    bm->lo = UINT64_MAX;
+    bm->written = calloc((bm->nregions + 7) / 8, 1);
+    copy = malloc(bm->image_len);
+    if (posix_memalign((void **)&bm->image, 4096, bm->image_len) != 0)
+        bm->image = NULL;
+    if (!bm->image || !bm->written || !copy) {
+        perror("malloc");
+        free(copy);
+        bitmap_free(bm);
+        return -1;
+    }
+    memset(bm->image, 0, bm->image_len);
+
+    for (int i = 0; i < nfds; i++) {
+        if (fds[i] < 0)
+            continue;
+        if (pread(fds[i], copy, bm->image_len, bm->offset) != (ssize_t)bm->image_len)
+            continue;
+        hdr = (struct bitmap_header *)copy;
+        if (memcmp(hdr->magic, BITMAP_MAGIC, sizeof(hdr->magic)) != 0) {
+            for (size_t j = 0; j < bm->image_len && used == -1; j++) {
+                if (copy[j])
+                    used = i;
+            }
+            continue;
+        }
+        if (hdr->version != BITMAP_VERSION || hdr->block_size != (uint32_t)block_size ||
+            hdr->region_stripes != bm->region_stripes || hdr->nregions != bm->nregions ||
+            hdr->data_blocks != data_blocks) {
+            fprintf(stderr, "ERROR: the bitmap on device %d does not match this array\n", i);
+            free(copy);
+            bitmap_free(bm);
+            return -1;
+        }
+        for (size_t j = block_size; j < bm->image_len; j++)
+            bm->image[j] |= copy[j];
+        found = true;
+    }
+    free(copy);
+    /* a new bitmap goes on blank space only; a member replaced in an
+       array that has one gets its copy whatever it held */
+    if (!found && used != -1) {
+        fprintf(stderr, "ERROR: device %d holds data in its last %lu blocks, where the "
+                "write-intent bitmap goes; clear them first\n", used, bm->image_len / block_size);
+        bitmap_free(bm);
+        return -1;
+    }
+    if (!found)
+        fprintf(stderr, "Creating a write-intent bitmap of %lu regions.\n", bm->nregions);
+
+    /* members that were replaced get their copy too */
+    hdr = (struct bitmap_header *)bm->image;
+    memcpy(hdr->magic, BITMAP_MAGIC, sizeof(hdr->magic));
+    hdr->version = BITMAP_VERSION;
+    hdr->block_size = block_size;
+    hdr->region_stripes = bm->region_stripes;
+    hdr->nregions = bm->nregions;
+    hdr->data_blocks = data_blocks;
+    if (write_image(bm, 0, bm->image_len, true) != 0) {
+        bitmap_free(bm);
+        return -1;
+    }
+    return 0;
+}
+
+void bitmap_free(struct intent_bitmap *bm) {
+    free(bm->image);
+    free(bm->written);
+    bm->image = NULL;
+    bm->written = NULL;
+}
+
+bool bitmap_test(const struct intent_bitmap *bm, uint64_t region) {
+    return bits(bm)[region / 8] & (1 << (region % 8));
+}
+
+void bitmap_set(struct intent_bitmap *bm, uint64_t stripe) {
+    uint64_t region = stripe / bm->region_stripes;
+    unsigned char bit = 1 << (region % 8);
+
+    bm->written[region / 8] |= bit;
+    if (bits(bm)[region / 8] & bit)
+        return;
+    bits(bm)[region / 8] |= bit;
+    touch(bm, region);
+    bm->need_sync = true;
+}
+
+int bitmap_sync(struct intent_bitmap *bm) {
+    if (!bm->need_sync)
+        return 0;
+    bm->need_sync = false;
+    return write_changed(bm, true);
+}
+
+int bitmap_flushed(struct intent_bitmap *bm) {
+    for (uint64_t byte = 0; byte < (bm->nregions + 7) / 8; byte++) {
+        unsigned char idle = bits(bm)[byte] & ~bm->written[byte];
+        if (idle) {
+            bits(bm)[byte] &= ~idle;
+            touch(bm, byte * 8);
+        }
+    }
+    memset(bm->written, 0, (bm->nregions + 7) / 8);
+    /* a cleared bit that is lost only costs a needless resync */
+    return write_changed(bm, false);
+}
+
+int bitmap_clear(struct intent_bitmap *bm) {
+    memset(bits(bm), 0, bm->image_len - bm->block_size);
+    memset(bm->written, 0, (bm->nregions + 7) / 8);
+    bm->lo = UINT64_MAX;
+    bm->hi = 0;
+    bm->need_sync = false;
+    return write_image(bm, bm->block_size, bm->image_len - bm->block_size, true);
+}
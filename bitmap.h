@@ -0,0 +1,62 @@
+#ifndef BITMAP_H_INCLUDED
+#define BITMAP_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Write-intent bitmap. One bit per region of region_stripes stripes
+   tells that the region may have been written since its parity was
+   last known to be consistent. A copy lives in the last blocks of every
+   member: a header block followed by the bits. A bit reaches the
+   members before the first write to its region, and is cleared only
+   once a flush has found the region idle, so after a crash only regions
+   with a set bit need their parity resynced. */
+
+#define BITMAP_REGION_BYTES (8 * 1024 * 1024)   /* of each member per bit */
+
+struct intent_bitmap {
+    const int *fds;         /* members, -1 when missing */
+    int nfds;
+    int block_size;
+    uint64_t region_stripes;
+    uint64_t nregions;
+    uint64_t offset;        /* of the metadata region on every member */
+    unsigned char *image;   /* header block, then the bits */
+    size_t image_len;
+    unsigned char *written; /* regions written since the last flush */
+    uint64_t lo, hi;        /* range of bitmap blocks to write out */
+    bool need_sync;         /* bits were set that the members lack */
+};
+
+/* Blocks at the end of a member of member_blocks blocks that the bitmap
+   takes; the members hold data below that. */
+uint64_t bitmap_blocks(uint64_t member_blocks, int block_size);
+
+/* Read the bitmap of members holding data_blocks blocks of data, OR-ing
+   the copies of all present members, or write an empty one when there is
+   none yet, which needs the space of every member to be blank. Returns
+   0, or -1 with a message on stderr. */
+int bitmap_load(struct intent_bitmap *bm, const int *fds, int nfds,
+                uint64_t data_blocks, int block_size);
+void bitmap_free(struct intent_bitmap *bm);
+
+static inline bool bitmap_enabled(const struct intent_bitmap *bm) {
+    return bm->image != NULL;
+}
+
+bool bitmap_test(const struct intent_bitmap *bm, uint64_t region);
+
+/* Note a coming write to `stripe`. Call bitmap_sync() before issuing it. */
+void bitmap_set(struct intent_bitmap *bm, uint64_t stripe);
+
+/* Make the bits set since the last call durable on the members. */
+int bitmap_sync(struct intent_bitmap *bm);
+
+/* The members just completed a flush: clear the bits of regions that
+   saw no write since the previous one. */
+int bitmap_flushed(struct intent_bitmap *bm);
+
+/* Clear every bit, once the members are known to be consistent. */
+int bitmap_clear(struct intent_bitmap *bm);
+
+#endif /* BITMAP_H_INCLUDED */
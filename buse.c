@@ -17,7 +17,8 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-#define _POSIX_C_SOURCE (200809L)
+/* splice() and F_SETPIPE_SZ are Linux extensions */
+#define _GNU_SOURCE
 
 #include <assert.h>
 #include <errno.h>
@@ -25,6 +26,8 @@
 #include <fcntl.h>
 #include <linux/nbd.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,15 +35,31 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "histogram.h"
 
 #ifndef BUSE_DEBUG
   #define BUSE_DEBUG (0)
 #endif
 
+/* Request buffers are allocated in multiples of this, so that recycled
+ * ones fit most later requests. */
+#define BUSE_CHUNK_ALIGN (64 * 1024)
+
+/* Most pieces a spliced read may consist of. */
+#define BUSE_MAX_EXTENTS 1024
+
+/* Socket receive buffer, holding many pipelined request headers. */
+#define BUSE_RECV_BUF (64 * 1024)
+
+/* Request sizes are counted per power of two: below 1K, then from 1K up. */
+#define BUSE_SIZE_BUCKETS 24
+
 /*
  * These helper functions were taken from cliserv.h in the nbd distribution.
  */
@@ -89,6 +108,68 @@ static int write_all(int fd, char* buf, size_t count)
   return 0;
 }
 
+/* writev() all of iov[0..iovcnt-1], which it may modify. */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t bytes_written;
+
+  while (iovcnt > 0) {
+    bytes_written = writev(fd, iov, iovcnt);
+    assert(bytes_written > 0);
+    while (iovcnt > 0 && (size_t)bytes_written >= iov->iov_len) {
+      bytes_written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + bytes_written;
+      iov->iov_len -= bytes_written;
+    }
+  }
+
+  return 0;
+}
+
+/* Bytes read from the socket ahead of the request being parsed. */
+struct recv_buf {
+  char data[BUSE_RECV_BUF];
+  size_t start, end;
+};
+
+/* Make at least count bytes available at rb->data + rb->start, reading as
+ * much as the socket has at once. Returns 1, or what read() returned when
+ * the socket ended or failed first. */
+static ssize_t recv_fill(int fd, struct recv_buf *rb, size_t count)
+{
+  ssize_t bytes_read;
+
+  while (rb->end - rb->start < count) {
+    if (rb->start > 0) {
+      memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+      rb->end -= rb->start;
+      rb->start = 0;
+    }
+    bytes_read = read(fd, rb->data + rb->end, sizeof(rb->data) - rb->end);
+    if (bytes_read <= 0)
+      return bytes_read;
+    rb->end += bytes_read;
+  }
+  return 1;
+}
+
+/* Receive count bytes into buf, first from what is buffered, the rest
+ * straight from the socket. */
+static void recv_all(int fd, struct recv_buf *rb, char *buf, size_t count)
+{
+  size_t buffered = rb->end - rb->start;
+
+  if (buffered > count)
+    buffered = count;
+  memcpy(buf, rb->data + rb->start, buffered);
+  rb->start += buffered;
+  read_all(fd, buf + buffered, count - buffered);
+}
+
 /* Signal handler to gracefully disconnect from nbd kernel driver. */
 static int nbd_dev_to_disconnect = -1;
 static void disconnect_nbd(int signal) {
@@ -113,104 +194,678 @@ static int set_sigaction(int sig, const struct sigaction * act) {
   return r;
 }
 
-/* Serve userland side of nbd socket. If everything worked ok, return 0. */
-static int serve_nbd(int sk, const struct buse_operations * aop, void * userdata) {
+/* A single NBD request, owned by whoever executes it. */
+struct buse_job {
+  struct buse_job *next;
+  struct buse_conn *conn;
+  u_int32_t type;
   u_int64_t from;
   u_int32_t len;
-  ssize_t bytes_read;
-  struct nbd_request request;
-  struct nbd_reply reply;
+  char handle[8];
   void *chunk;
+  size_t chunk_size;          /* allocated, at least len */
+  u_int64_t recv_ns;          /* when the header arrived */
+  u_int64_t start_ns;         /* when execution began */
+};
+
+/* Counters of one request type, over all connections. */
+struct buse_op_stats {
+  u_int64_t requests;
+  u_int64_t bytes;
+  u_int64_t errors;
+  u_int64_t sizes[BUSE_SIZE_BUCKETS];
+  struct histogram wait;      /* from arrival to execution */
+  struct histogram service;   /* from execution to the reply */
+};
+
+static struct buse_op_stats op_stats[NBD_CMD_TRIM + 1];
+
+/* State shared between the socket reader and the workers of a connection. */
+struct buse_conn {
+  int sk;
+  const struct buse_operations *aop;
+  void *userdata;
+
+  pthread_mutex_t send_lock;    /* one reply at a time on sk */
+
+  pthread_mutex_t lock;         /* protects everything below */
+  pthread_cond_t job_ready;
+  pthread_cond_t job_space;
+  struct buse_job *head, *tail;
+  u_int32_t queued;
+  u_int32_t max_queued;
+  int closing;
+  struct buse_job *free_jobs;   /* recycled jobs with their buffers */
+  u_int32_t num_free;
+  u_int32_t max_free;
+  u_int32_t inflight;           /* jobs received and not yet finished */
+  u_int32_t max_inflight;
+};
+
+/* A job whose chunk holds at least len bytes, recycled when possible.
+ * Buffers are page aligned so that backends may use O_DIRECT on them. */
+static struct buse_job *get_job(struct buse_conn *conn, u_int32_t len)
+{
+  struct buse_job *job;
+
+  pthread_mutex_lock(&conn->lock);
+  job = conn->free_jobs;
+  if (job) {
+    conn->free_jobs = job->next;
+    conn->num_free--;
+  }
+  pthread_mutex_unlock(&conn->lock);
+  if (!job) {
+    job = calloc(1, sizeof(*job));
+    assert(job);
+  }
+  if (job->chunk_size < len) {
+    free(job->chunk);
+    job->chunk_size = (len + BUSE_CHUNK_ALIGN - 1) / BUSE_CHUNK_ALIGN * BUSE_CHUNK_ALIGN;
+    if (posix_memalign(&job->chunk, 4096, job->chunk_size) != 0)
+      job->chunk = NULL;
+    assert(job->chunk);
+  }
+  return job;
+}
+
+static void free_job(struct buse_job *job)
+{
+  free(job->chunk);
+  free(job);
+}
+
+static void put_job(struct buse_conn *conn, struct buse_job *job)
+{
+  pthread_mutex_lock(&conn->lock);
+  if (conn->num_free < conn->max_free) {
+    job->next = conn->free_jobs;
+    conn->free_jobs = job;
+    conn->num_free++;
+    job = NULL;
+  }
+  pthread_mutex_unlock(&conn->lock);
+  if (job)
+    free_job(job);
+}
+
+static void send_reply(struct buse_conn *conn, struct buse_job *job, u_int32_t error)
+{
+  struct nbd_reply reply;
+
+  reply.magic = htonl(NBD_REPLY_MAGIC);
+  reply.error = error;
+  memcpy(reply.handle, job->handle, sizeof(reply.handle));
+
+  struct iovec iov[2] = {
+    { .iov_base = &reply, .iov_len = sizeof(struct nbd_reply) },
+    { .iov_base = job->chunk, .iov_len = job->len },
+  };
+  /* The kernel only expects payload after a successful read. */
+  int iovcnt = (job->type == NBD_CMD_READ && error == 0) ? 2 : 1;
+
+  pthread_mutex_lock(&conn->send_lock);
+  writev_all(conn->sk, iov, iovcnt);
+  pthread_mutex_unlock(&conn->send_lock);
+}
+
+/* Pipe and extent list of the calling thread for spliced reads. */
+static __thread int splice_pipe[2] = { -1, -1 };
+static __thread int splice_pipe_size;
+static __thread struct buse_extent *splice_extents;
+
+/* Reply to a read with the extents the backend mapped it to, moving the
+ * data file -> pipe -> socket. Returns 0 once the reply is sent, or -1 if
+ * nothing was sent and the read has to be served by aop->read. */
+static int send_spliced_read(struct buse_conn *conn, struct buse_job *job)
+{
+  struct nbd_reply reply;
+  int n, i, sent_header = 0;
+  u_int32_t total = 0;
+
+  if (splice_pipe[0] < 0) {
+    if (pipe2(splice_pipe, O_CLOEXEC) != 0)
+      return -1;
+    /* a bigger pipe means fewer round trips; the default is fine too */
+    fcntl(splice_pipe[1], F_SETPIPE_SZ, 1024 * 1024);
+    splice_pipe_size = fcntl(splice_pipe[1], F_GETPIPE_SZ);
+  }
+  if (!splice_extents) {
+    splice_extents = malloc(BUSE_MAX_EXTENTS * sizeof(*splice_extents));
+    if (!splice_extents)
+      return -1;
+  }
+  n = conn->aop->read_map(splice_extents, BUSE_MAX_EXTENTS, job->len, job->from, conn->userdata);
+  if (n <= 0)
+    return -1;
+  for (i = 0; i < n; i++)
+    total += splice_extents[i].len;
+  assert(total == job->len);
 
   reply.magic = htonl(NBD_REPLY_MAGIC);
   reply.error = htonl(0);
+  memcpy(reply.handle, job->handle, sizeof(reply.handle));
+
+  pthread_mutex_lock(&conn->send_lock);
+  for (i = 0; i < n; i++) {
+    loff_t off = splice_extents[i].offset;
+    u_int32_t left = splice_extents[i].len;
+    while (left > 0) {
+      ssize_t filled = splice(splice_extents[i].fd, &off, splice_pipe[1], NULL,
+                              left < (u_int32_t)splice_pipe_size ? left : (u_int32_t)splice_pipe_size,
+                              SPLICE_F_MOVE);
+      if (filled <= 0) {
+        if (!sent_header) {
+          /* e.g. an fd that cannot splice: let read() do it */
+          pthread_mutex_unlock(&conn->send_lock);
+          return -1;
+        }
+        /* the reply is half sent, only a new connection can recover */
+        warn("splice from backend failed");
+        shutdown(conn->sk, SHUT_RDWR);
+        pthread_mutex_unlock(&conn->send_lock);
+        return 0;
+      }
+      if (!sent_header) {
+        write_all(conn->sk, (char*)&reply, sizeof(struct nbd_reply));
+        sent_header = 1;
+      }
+      left -= filled;
+      while (filled > 0) {
+        ssize_t moved = splice(splice_pipe[0], NULL, conn->sk, NULL, filled,
+                               SPLICE_F_MOVE | (left > 0 || i + 1 < n ? SPLICE_F_MORE : 0));
+        assert(moved > 0);
+        filled -= moved;
+      }
+    }
+  }
+  pthread_mutex_unlock(&conn->send_lock);
+  return 0;
+}
+
+static void record_job(const struct buse_job *job, int error)
+{
+  struct buse_op_stats *s;
+  int size = 0;
+
+  if (job->type == NBD_CMD_DISC || job->type >= sizeof(op_stats) / sizeof(op_stats[0]))
+    return;
+  s = &op_stats[job->type];
+  histogram_record(&s->wait, job->start_ns - job->recv_ns);
+  histogram_record(&s->service, histogram_now_ns() - job->start_ns);
+  __atomic_fetch_add(&s->requests, 1, __ATOMIC_RELAXED);
+  if (error)
+    __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+  if (job->type == NBD_CMD_FLUSH)
+    return;
+  __atomic_fetch_add(&s->bytes, job->len, __ATOMIC_RELAXED);
+  while (size + 1 < BUSE_SIZE_BUCKETS && job->len >= (u_int64_t)1024 << size)
+    size++;
+  __atomic_fetch_add(&s->sizes[size], 1, __ATOMIC_RELAXED);
+}
+
+void buse_print_stats(FILE *out, const struct buse_operations *aop, void *userdata)
+{
+  static const char *const names[] = { "read", "write", NULL, "flush", "trim" };
+  u_int32_t type;
+  int i;
+
+  for (type = 0; type < sizeof(op_stats) / sizeof(op_stats[0]); type++) {
+    const struct buse_op_stats *s = &op_stats[type];
+    u_int64_t requests = __atomic_load_n(&s->requests, __ATOMIC_RELAXED);
+    if (!names[type] || requests == 0)
+      continue;
+    fprintf(out, "%s: %lu requests, %lu bytes, %lu errors\n", names[type], requests,
+            __atomic_load_n(&s->bytes, __ATOMIC_RELAXED), __atomic_load_n(&s->errors, __ATOMIC_RELAXED));
+    if (type != NBD_CMD_FLUSH) {
+      fprintf(out, "  sizes:");
+      for (i = 0; i < BUSE_SIZE_BUCKETS; i++) {
+        u_int64_t n = __atomic_load_n(&s->sizes[i], __ATOMIC_RELAXED);
+        if (n && i == 0)
+          fprintf(out, " <1K %lu", n);
+        else if (n)
+          fprintf(out, " %uK %lu", 1u << (i - 1), n);
+      }
+      fprintf(out, "\n");
+    }
+    histogram_print_ns(out, "  queue wait", &s->wait);
+    histogram_print_ns(out, "  service", &s->service);
+  }
+  if (aop->stats)
+    aop->stats(out, userdata);
+}
 
-  while ((bytes_read = read(sk, &request, sizeof(request))) > 0) {
-    assert(bytes_read == sizeof(request));
-    memcpy(reply.handle, request.handle, sizeof(reply.handle));
-    reply.error = htonl(0);
+/* A replied job leaves the connection, which lets the reader go on. */
+static void finish_job(struct buse_conn *conn, struct buse_job *job, int error)
+{
+  record_job(job, error);
+  put_job(conn, job);
+  pthread_mutex_lock(&conn->lock);
+  conn->inflight--;
+  pthread_cond_broadcast(&conn->job_space);
+  pthread_mutex_unlock(&conn->lock);
+}
 
-    len = ntohl(request.len);
-    from = ntohll(request.from);
+void buse_complete(struct buse_request *req, int error)
+{
+  struct buse_job *job = (struct buse_job *)req;
+  struct buse_conn *conn = job->conn;
+
+  send_reply(conn, job, error);
+  finish_job(conn, job, error);
+}
+
+/* Execute a read, write, flush or trim request and send its reply, or
+ * start it asynchronously and leave the reply to buse_complete(). */
+static void handle_request(struct buse_conn *conn, struct buse_job *job)
+{
+  const struct buse_operations *aop = conn->aop;
+  struct buse_request *req = (struct buse_request *)job;
+  u_int32_t error = htonl(0);
+
+  job->start_ns = histogram_now_ns();
+  switch (job->type) {
+  case NBD_CMD_READ:
+    if (aop->read_map && send_spliced_read(conn, job) == 0) {
+      finish_job(conn, job, 0);
+      return;
+    }
+    if (aop->aread) {
+      if ((error = aop->aread(req, job->chunk, job->len, job->from, conn->userdata)) == 0)
+        return;
+    } else if (aop->read) {
+      error = aop->read(job->chunk, job->len, job->from, conn->userdata);
+    } else {
+      /* If user not specified read operation, return EPERM error */
+      error = htonl(EPERM);
+    }
+    break;
+  case NBD_CMD_WRITE:
+    if (aop->awrite) {
+      if ((error = aop->awrite(req, job->chunk, job->len, job->from, conn->userdata)) == 0)
+        return;
+    } else if (aop->write) {
+      error = aop->write(job->chunk, job->len, job->from, conn->userdata);
+    } else {
+      /* If user not specified write operation, return EPERM error */
+      error = htonl(EPERM);
+    }
+    break;
+#ifdef NBD_FLAG_SEND_FLUSH
+  case NBD_CMD_FLUSH:
+    if (aop->aflush) {
+      if ((error = aop->aflush(req, conn->userdata)) == 0)
+        return;
+    } else if (aop->flush) {
+      error = aop->flush(conn->userdata);
+    }
+    break;
+#endif
+#ifdef NBD_FLAG_SEND_TRIM
+  case NBD_CMD_TRIM:
+    if (aop->atrim) {
+      if ((error = aop->atrim(req, job->from, job->len, conn->userdata)) == 0)
+        return;
+    } else if (aop->trim) {
+      error = aop->trim(job->from, job->len, conn->userdata);
+    }
+    break;
+#endif
+  default:
+    assert(0);
+  }
+  buse_complete(req, error);
+}
+
+static void *worker_main(void *arg)
+{
+  struct buse_conn *conn = arg;
+  struct buse_job *job;
+
+  for (;;) {
+    pthread_mutex_lock(&conn->lock);
+    while (!conn->head && !conn->closing)
+      pthread_cond_wait(&conn->job_ready, &conn->lock);
+    job = conn->head;
+    if (!job) {
+      /* closing and nothing left to do */
+      pthread_mutex_unlock(&conn->lock);
+      return NULL;
+    }
+    conn->head = job->next;
+    if (!conn->head)
+      conn->tail = NULL;
+    conn->queued--;
+    pthread_cond_signal(&conn->job_space);
+    pthread_mutex_unlock(&conn->lock);
+
+    handle_request(conn, job);
+  }
+}
+
+/* Hand a job to the workers, waiting while the queue is full. */
+static void enqueue_job(struct buse_conn *conn, struct buse_job *job)
+{
+  job->next = NULL;
+  pthread_mutex_lock(&conn->lock);
+  while (conn->queued >= conn->max_queued)
+    pthread_cond_wait(&conn->job_space, &conn->lock);
+  if (conn->tail)
+    conn->tail->next = job;
+  else
+    conn->head = job;
+  conn->tail = job;
+  conn->queued++;
+  pthread_cond_signal(&conn->job_ready);
+  pthread_mutex_unlock(&conn->lock);
+}
+
+/* Serve userland side of nbd socket. If everything worked ok, return 0.
+ * *disconnected tells whether the kernel ended it with NBD_CMD_DISC. */
+static int serve_nbd(int sk, const struct buse_operations * aop, void * userdata, int *disconnected) {
+  ssize_t bytes_read;
+  struct nbd_request request;
+  struct buse_job *job;
+  struct buse_conn conn;
+  struct recv_buf *rb;
+  pthread_t *workers = NULL;
+  u_int32_t num_workers = 0, i, type;
+  int async = aop->aread || aop->awrite || aop->aflush || aop->atrim;
+  int status = EXIT_SUCCESS;
+
+  *disconnected = 0;
+  rb = calloc(1, sizeof(*rb));
+  if (!rb) {
+    warn("failed to allocate nbd receive buffer");
+    return EXIT_FAILURE;
+  }
+  memset(&conn, 0, sizeof(conn));
+  conn.sk = sk;
+  conn.aop = aop;
+  conn.userdata = userdata;
+  pthread_mutex_init(&conn.send_lock, NULL);
+  pthread_mutex_init(&conn.lock, NULL);
+  pthread_cond_init(&conn.job_ready, NULL);
+  pthread_cond_init(&conn.job_space, NULL);
+  conn.max_free = 1;
+  conn.max_inflight = aop->max_inflight ? aop->max_inflight : 64;
+
+  if (aop->num_workers > 1) {
+    /* Keep a couple of requests per worker queued so none of them idles
+     * while the reader is busy receiving write payloads. */
+    conn.max_queued = 2 * aop->num_workers;
+    conn.max_free = conn.max_queued + aop->num_workers;
+    workers = calloc(aop->num_workers, sizeof(*workers));
+    if (!workers) {
+      warn("failed to allocate nbd workers");
+      free(rb);
+      return EXIT_FAILURE;
+    }
+    for (; num_workers < aop->num_workers; num_workers++) {
+      if (pthread_create(&workers[num_workers], NULL, worker_main, &conn) != 0) {
+        warnx("failed to start nbd worker %u", num_workers);
+        break;
+      }
+    }
+  }
+  if (async && conn.max_free < conn.max_inflight)
+    conn.max_free = conn.max_inflight;
+
+  while ((bytes_read = recv_fill(sk, rb, sizeof(request))) > 0) {
+    memcpy(&request, rb->data + rb->start, sizeof(request));
+    rb->start += sizeof(request);
     assert(request.magic == htonl(NBD_REQUEST_MAGIC));
 
-    switch(ntohl(request.type)) {
+    type = ntohl(request.type);
+    /* Bound what the backend has outstanding before taking on more. */
+    pthread_mutex_lock(&conn.lock);
+    while (conn.inflight >= conn.max_inflight)
+      pthread_cond_wait(&conn.job_space, &conn.lock);
+    conn.inflight++;
+    pthread_mutex_unlock(&conn.lock);
+
+    job = get_job(&conn, type == NBD_CMD_READ || type == NBD_CMD_WRITE ? ntohl(request.len) : 0);
+    job->recv_ns = histogram_now_ns();
+    job->conn = &conn;
+    job->type = type;
+    job->len = ntohl(request.len);
+    job->from = ntohll(request.from);
+    memcpy(job->handle, request.handle, sizeof(job->handle));
+
+    switch(job->type) {
       /* I may at some point need to deal with the the fact that the
        * official nbd server has a maximum buffer size, and divides up
        * oversized requests into multiple pieces. This applies to reads
        * and writes.
        */
     case NBD_CMD_READ:
-      if (BUSE_DEBUG) fprintf(stderr, "Request for read of size %d\n", len);
-      /* Fill with zero in case actual read is not implemented */
-      chunk = malloc(len);
-      if (aop->read) {
-        reply.error = aop->read(chunk, len, from, userdata);
-      } else {
-        /* If user not specified read operation, return EPERM error */
-        reply.error = htonl(EPERM);
-      }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      write_all(sk, (char*)chunk, len);
-
-      free(chunk);
+      if (BUSE_DEBUG) fprintf(stderr, "Request for read of size %d\n", job->len);
       break;
     case NBD_CMD_WRITE:
-      if (BUSE_DEBUG) fprintf(stderr, "Request for write of size %d\n", len);
-      chunk = malloc(len);
-      read_all(sk, chunk, len);
-      if (aop->write) {
-        reply.error = aop->write(chunk, len, from, userdata);
-      } else {
-        /* If user not specified write operation, return EPERM error */
-        reply.error = htonl(EPERM);
-      }
-      free(chunk);
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      if (BUSE_DEBUG) fprintf(stderr, "Request for write of size %d\n", job->len);
+      /* The payload follows the header, so it has to be received here
+       * before the next request can be read. */
+      recv_all(sk, rb, job->chunk, job->len);
       break;
     case NBD_CMD_DISC:
       if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_DISC\n");
-      /* Handle a disconnect request. */
-      if (aop->disc) {
-        aop->disc(userdata);
-      }
-      return EXIT_SUCCESS;
+      finish_job(&conn, job, 0);
+      *disconnected = 1;
+      goto drain;
 #ifdef NBD_FLAG_SEND_FLUSH
     case NBD_CMD_FLUSH:
       if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_FLUSH\n");
-      if (aop->flush) {
-        reply.error = aop->flush(userdata);
-      }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
       break;
 #endif
 #ifdef NBD_FLAG_SEND_TRIM
     case NBD_CMD_TRIM:
       if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_TRIM\n");
-      if (aop->trim) {
-        reply.error = aop->trim(from, len, userdata);
-      }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
       break;
 #endif
     default:
       assert(0);
     }
+
+    if (num_workers > 0) {
+      enqueue_job(&conn, job);
+    } else {
+      handle_request(&conn, job);
+    }
   }
   if (bytes_read == -1) {
     warn("error reading userside of nbd socket");
-    return EXIT_FAILURE;
+    status = EXIT_FAILURE;
   }
-  return EXIT_SUCCESS;
+
+drain:
+  /* Let the workers finish whatever is still queued. */
+  pthread_mutex_lock(&conn.lock);
+  conn.closing = 1;
+  pthread_cond_broadcast(&conn.job_ready);
+  pthread_mutex_unlock(&conn.lock);
+  for (i = 0; i < num_workers; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+  /* and the backend complete what it started */
+  pthread_mutex_lock(&conn.lock);
+  while (conn.inflight > 0)
+    pthread_cond_wait(&conn.job_space, &conn.lock);
+  pthread_mutex_unlock(&conn.lock);
+  while ((job = conn.free_jobs) != NULL) {
+    conn.free_jobs = job->next;
+    free_job(job);
+  }
+  free(rb);
+
+  pthread_cond_destroy(&conn.job_space);
+  pthread_cond_destroy(&conn.job_ready);
+  pthread_mutex_destroy(&conn.lock);
+  pthread_mutex_destroy(&conn.send_lock);
+  return status;
 }
 
-int buse_main(const char* dev_file, const struct buse_operations *aop, void *userdata)
+int buse_serve(int sk, const struct buse_operations *aop, void *userdata)
 {
+  int disconnected, status = serve_nbd(sk, aop, userdata, &disconnected);
+
+  if (disconnected && aop->disc)
+    aop->disc(userdata);
+  return status;
+}
+
+/* One socket handed to the nbd driver, served by its own thread. */
+struct buse_connection {
+  pthread_t thread;
   int sp[2];
-  int nbd, sk, err, flags;
+  const struct buse_operations *aop;
+  void *userdata;
+  int status;
+  int disconnected;
+};
+
+static void *connection_main(void *arg)
+{
+  struct buse_connection *c = arg;
+
+  c->status = serve_nbd(c->sp[0], c->aop, c->userdata, &c->disconnected);
+  return NULL;
+}
+
+/* Thread answering the stats socket and printing periodic reports. */
+struct buse_stats_server {
+  pthread_t thread;
+  int listen_fd;                /* -1 without a socket */
+  int wake[2];                  /* written to stop the thread */
+  const struct buse_operations *aop;
+  void *userdata;
+};
+
+static void send_stats(struct buse_stats_server *srv, int fd)
+{
+  char *report = NULL;
+  size_t len = 0, done = 0;
+  FILE *out = open_memstream(&report, &len);
+
+  if (!out)
+    return;
+  buse_print_stats(out, srv->aop, srv->userdata);
+  fclose(out);
+  /* the reader may go away early, which must not raise SIGPIPE */
+  while (done < len) {
+    ssize_t n = send(fd, report + done, len - done, MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  free(report);
+}
+
+static void *stats_main(void *arg)
+{
+  struct buse_stats_server *srv = arg;
+  u_int64_t interval_ns = srv->aop->stats_interval * 1000000000ULL;
+  u_int64_t next = histogram_now_ns() + interval_ns;
+
+  for (;;) {
+    struct pollfd fds[2] = {
+      { .fd = srv->wake[0], .events = POLLIN },
+      { .fd = srv->listen_fd, .events = POLLIN },
+    };
+    int timeout = -1, fd;
+
+    if (interval_ns) {
+      u_int64_t now = histogram_now_ns();
+      timeout = next > now ? (next - now) / 1000000 + 1 : 0;
+    }
+    if (poll(fds, srv->listen_fd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR) {
+      warn("stats poll");
+      return NULL;
+    }
+    if (fds[0].revents)
+      return NULL;
+    if (interval_ns && histogram_now_ns() >= next) {
+      fprintf(stderr, "--- buse stats ---\n");
+      buse_print_stats(stderr, srv->aop, srv->userdata);
+      next += interval_ns;
+    }
+    if (srv->listen_fd >= 0 && (fds[1].revents & POLLIN) &&
+        (fd = accept(srv->listen_fd, NULL, NULL)) >= 0) {
+      send_stats(srv, fd);
+      close(fd);
+    }
+  }
+}
+
+/* Returns 1 once the thread runs, 0 when no statistics were asked for,
+ * or -1. */
+static int start_stats(struct buse_stats_server *srv, const struct buse_operations *aop, void *userdata)
+{
+  struct sockaddr_un addr;
+
+  srv->aop = aop;
+  srv->userdata = userdata;
+  srv->listen_fd = -1;
+  if (!aop->stats_socket && !aop->stats_interval)
+    return 0;
+  if (aop->stats_socket) {
+    if (strlen(aop->stats_socket) >= sizeof(addr.sun_path)) {
+      warnx("stats socket path too long: %s", aop->stats_socket);
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, aop->stats_socket);
+    unlink(aop->stats_socket);
+    srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (srv->listen_fd < 0 ||
+        bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(srv->listen_fd, 8) != 0) {
+      warn("failed to listen on %s", aop->stats_socket);
+      if (srv->listen_fd >= 0)
+        close(srv->listen_fd);
+      return -1;
+    }
+  }
+  if (pipe2(srv->wake, O_CLOEXEC) != 0 ||
+      pthread_create(&srv->thread, NULL, stats_main, srv) != 0) {
+    warn("failed to start the stats thread");
+    if (srv->listen_fd >= 0)
+      close(srv->listen_fd);
+    return -1;
+  }
+  return 1;
+}
+
+static void stop_stats(struct buse_stats_server *srv)
+{
+  char c = 0;
+
+  if (write(srv->wake[1], &c, 1) != 1)
+    warn("failed to stop the stats thread");
+  pthread_join(srv->thread, NULL);
+  close(srv->wake[0]);
+  close(srv->wake[1]);
+  if (srv->listen_fd >= 0) {
+    close(srv->listen_fd);
+    unlink(srv->aop->stats_socket);
+  }
+}
 
-  err = socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
-  assert(!err);
+int buse_main(const char* dev_file, const struct buse_operations *aop, void *userdata)
+{
+  struct buse_connection *conns;
+  u_int32_t num_conns, i;
+  int nbd, err, flags;
+
+  num_conns = aop->num_connections > 1 ? aop->num_connections : 1;
+  conns = calloc(num_conns, sizeof(*conns));
+  assert(conns);
+  for (i = 0; i < num_conns; i++) {
+    err = socketpair(AF_UNIX, SOCK_STREAM, 0, conns[i].sp);
+    assert(!err);
+    conns[i].aop = aop;
+    conns[i].userdata = userdata;
+  }
 
   nbd = open(dev_file, O_RDWR);
   if (nbd == -1) {
@@ -250,34 +905,38 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
       exit(EXIT_FAILURE);
     }
 
-    /* The child needs to continue setting things up. */
-    close(sp[0]);
-    sk = sp[1];
-
-    if(ioctl(nbd, NBD_SET_SOCK, sk) == -1){
-      fprintf(stderr, "ioctl(nbd, NBD_SET_SOCK, sk) failed.[%s]\n", strerror(errno));
-      exit(EXIT_FAILURE);
+    /* The child needs to continue setting things up. The kernel spreads
+     * its hardware queues over all sockets it is given. */
+    for (i = 0; i < num_conns; i++) {
+      close(conns[i].sp[0]);
+      if(ioctl(nbd, NBD_SET_SOCK, conns[i].sp[1]) == -1){
+        fprintf(stderr, "ioctl(nbd, NBD_SET_SOCK, sk) failed.[%s]\n", strerror(errno));
+        exit(EXIT_FAILURE);
+      }
     }
-    else{
 #if defined NBD_SET_FLAGS
-      flags = 0;
+    flags = 0;
 #if defined NBD_FLAG_SEND_TRIM
-      flags |= NBD_FLAG_SEND_TRIM;
+    flags |= NBD_FLAG_SEND_TRIM;
 #endif
 #if defined NBD_FLAG_SEND_FLUSH
-      flags |= NBD_FLAG_SEND_FLUSH;
+    flags |= NBD_FLAG_SEND_FLUSH;
 #endif
-      if (flags != 0 && ioctl(nbd, NBD_SET_FLAGS, flags) == -1){
-        fprintf(stderr, "ioctl(nbd, NBD_SET_FLAGS, %d) failed.[%s]\n", flags, strerror(errno));
-        exit(EXIT_FAILURE);
-      }
+#if defined NBD_FLAG_CAN_MULTI_CONN
+    /* Without it the kernel refuses to start with several sockets. */
+    if (num_conns > 1)
+      flags |= NBD_FLAG_CAN_MULTI_CONN;
 #endif
-      err = ioctl(nbd, NBD_DO_IT);
-      if (BUSE_DEBUG) fprintf(stderr, "nbd device terminated with code %d\n", err);
-      if (err == -1) {
-        warn("NBD_DO_IT terminated with error");
-        exit(EXIT_FAILURE);
-      }
+    if (flags != 0 && ioctl(nbd, NBD_SET_FLAGS, flags) == -1){
+      fprintf(stderr, "ioctl(nbd, NBD_SET_FLAGS, %d) failed.[%s]\n", flags, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+#endif
+    err = ioctl(nbd, NBD_DO_IT);
+    if (BUSE_DEBUG) fprintf(stderr, "nbd device terminated with code %d\n", err);
+    if (err == -1) {
+      warn("NBD_DO_IT terminated with error");
+      exit(EXIT_FAILURE);
     }
 
     if (
@@ -313,14 +972,40 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
     return EXIT_FAILURE;
   }
 
-  close(sp[1]);
+  for (i = 0; i < num_conns; i++)
+    close(conns[i].sp[1]);
 
-  /* serve NBD socket */
-  int status;
-  status = serve_nbd(sp[0], aop, userdata);
-  if (close(sp[0]) != 0) warn("problem closing server side nbd socket");
+  struct buse_stats_server stats;
+  int stats_running = start_stats(&stats, aop, userdata);
+  if (stats_running < 0)
+    warnx("continuing without statistics");
+
+  /* serve NBD sockets, the first one on this thread */
+  int status = EXIT_SUCCESS, disconnected = 0;
+  for (i = 1; i < num_conns; i++) {
+    err = pthread_create(&conns[i].thread, NULL, connection_main, &conns[i]);
+    assert(!err);
+  }
+  connection_main(&conns[0]);
+  for (i = 0; i < num_conns; i++) {
+    if (i > 0)
+      pthread_join(conns[i].thread, NULL);
+    if (close(conns[i].sp[0]) != 0) warn("problem closing server side nbd socket");
+    if (status == EXIT_SUCCESS)
+      status = conns[i].status;
+    disconnected |= conns[i].disconnected;
+  }
+  free(conns);
+  if (stats_running > 0)
+    stop_stats(&stats);
   if (status != 0) return status;
 
+  /* Every connection has drained by now, so the backend sees a single
+   * disconnect no matter how many sockets the kernel closed. */
+  if (disconnected && aop->disc) {
+    aop->disc(userdata);
+  }
+
   /* wait for subprocess */
   if (waitpid(pid, &status, 0) == -1) {
     warn("waitpid failed");
@@ -5,8 +5,19 @@
 extern "C" {
 #endif
 
+#include <stdio.h>
 #include <sys/types.h>
 
+  // a piece of a read that a backend can point at instead of copying it
+  struct buse_extent {
+    int fd;
+    u_int64_t offset;
+    u_int32_t len;
+  };
+
+  // token of an asynchronous request, completed with buse_complete()
+  struct buse_request;
+
   struct buse_operations {
     int (*read)(void *buf, u_int32_t len, u_int64_t offset, void *userdata);
     int (*write)(const void *buf, u_int32_t len, u_int64_t offset, void *userdata);
@@ -14,14 +25,69 @@ extern "C" {
     int (*flush)(void *userdata);
     int (*trim)(u_int64_t from, u_int32_t len, void *userdata);
 
+    // optional zero-copy reads: describe the len bytes at offset as up to
+    // max_extents pieces of files, in order, and return how many there are.
+    // They are then spliced to the socket without passing through user space.
+    // Return 0 to have this read served by read() as usual. The bytes must stay
+    // in place until the reply is sent, like a buffer handed to read() would.
+    int (*read_map)(struct buse_extent *extents, int max_extents, u_int32_t len,
+                    u_int64_t offset, void *userdata);
+
+    // asynchronous variants, used instead of the ones above when set: start
+    // the operation and return 0, then call buse_complete(req, error) exactly
+    // once when it is done, from any thread and possibly before returning. A
+    // nonzero return fails the request at once, and then buse_complete must
+    // not be called. buf stays valid until completion. As with workers, other
+    // callbacks may run while operations are outstanding.
+    int (*aread)(struct buse_request *req, void *buf, u_int32_t len, u_int64_t offset, void *userdata);
+    int (*awrite)(struct buse_request *req, const void *buf, u_int32_t len, u_int64_t offset, void *userdata);
+    int (*aflush)(struct buse_request *req, void *userdata);
+    int (*atrim)(struct buse_request *req, u_int64_t from, u_int32_t len, void *userdata);
+
     // either set size, OR set both blksize and size_blocks
     u_int64_t size;
     u_int32_t blksize;
     u_int64_t size_blocks;
+
+    // number of worker threads executing requests; 0 or 1 serves one request
+    // at a time. With more workers requests run concurrently, replies are sent
+    // as they finish and the callbacks above must be thread-safe.
+    u_int32_t num_workers;
+
+    // number of sockets handed to the nbd driver, each served by its own
+    // thread (and its own num_workers); 0 or 1 uses a single socket. Several
+    // connections imply concurrent callbacks, just like num_workers.
+    u_int32_t num_connections;
+
+    // most requests outstanding per connection, whether queued for workers,
+    // running or waiting for buse_complete(); 0 means 64
+    u_int32_t max_inflight;
+
+    // statistics of every request type: counts, sizes, and how long requests
+    // waited to be started and then took. Connecting to the unix socket at
+    // stats_socket reads a report; stats_interval > 0 prints one to stderr
+    // that often, in seconds. Reports end with what stats adds, if set.
+    const char *stats_socket;
+    u_int32_t stats_interval;
+    void (*stats)(FILE *out, void *userdata);
   };
 
+  // Print the report described above.
+  void buse_print_stats(FILE *out, const struct buse_operations *aop, void *userdata);
+
+  // Finish an asynchronous request with the same error a synchronous
+  // callback would have returned.
+  void buse_complete(struct buse_request *req, int error);
+
   int buse_main(const char* dev_file, const struct buse_operations *bop, void *userdata);
 
+  // Serve NBD requests arriving on the connected socket sk until the peer
+  // sends NBD_CMD_DISC (which calls disc) or closes it. This is what
+  // buse_main does with every socket it hands to the nbd driver; called
+  // directly it lets a userspace client, such as a benchmark, drive the
+  // callbacks without a kernel device. Returns 0 when everything worked.
+  int buse_serve(int sk, const struct buse_operations *bop, void *userdata);
+
 #ifdef __cplusplus
 }
 #endif
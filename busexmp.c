@@ -17,21 +17,163 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
+
 #include <argp.h>
 #include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
 
 #include "buse.h"
 
+/* Sparse mode keeps the device in pages that are allocated when first
+ * written, found through a two-level table: the directory has one leaf
+ * per SPARSE_LEAF_PAGES pages, allocated along with its first page.
+ * Pages are carved out of large anonymous mappings and their memory is
+ * given back to the kernel when they are trimmed. */
+#define SPARSE_PAGE_SIZE 4096
+#define SPARSE_LEAF_PAGES 512
+#define SPARSE_SLAB_SIZE (2 * 1024 * 1024)
+
+struct sparse_leaf {
+  unsigned used;
+  unsigned char *pages[SPARSE_LEAF_PAGES];
+};
+
+static struct {
+  unsigned char *slab;          /* current mapping, handed out in order */
+  size_t slab_used;
+  unsigned char **free;         /* trimmed pages, zero again */
+  size_t num_free, max_free;
+  u_int64_t pages;              /* in use */
+} arena;
+
+static int sparse;
+static struct sparse_leaf **sparse_dir;
+static pthread_mutex_t sparse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A zero-filled page. */
+static unsigned char *arena_alloc(void)
+{
+  unsigned char *page;
+
+  if (arena.num_free > 0) {
+    page = arena.free[--arena.num_free];
+  } else {
+    if (!arena.slab || arena.slab_used == SPARSE_SLAB_SIZE) {
+      void *slab = mmap(NULL, SPARSE_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (slab == MAP_FAILED)
+        return NULL;
+      arena.slab = slab;
+      arena.slab_used = 0;
+    }
+    page = arena.slab + arena.slab_used;
+    arena.slab_used += SPARSE_PAGE_SIZE;
+  }
+  arena.pages++;
+  return page;
+}
+
+static void arena_release(unsigned char *page)
+{
+  /* the page reads as zeros when it is next touched */
+  madvise(page, SPARSE_PAGE_SIZE, MADV_DONTNEED);
+  arena.pages--;
+  if (arena.num_free == arena.max_free) {
+    size_t max_free = arena.max_free ? 2 * arena.max_free : 1024;
+    unsigned char **free_pages = realloc(arena.free, max_free * sizeof(*free_pages));
+    if (!free_pages)
+      return; /* leaked, but it holds no memory */
+    arena.free = free_pages;
+    arena.max_free = max_free;
+  }
+  arena.free[arena.num_free++] = page;
+}
+
+/* The page of the device, or NULL when it has never been written. */
+static unsigned char *sparse_page(u_int64_t page, int alloc)
+{
+  struct sparse_leaf **leaf = &sparse_dir[page / SPARSE_LEAF_PAGES];
+  unsigned char **slot;
+
+  if (!*leaf) {
+    if (!alloc || !(*leaf = calloc(1, sizeof(**leaf))))
+      return NULL;
+  }
+  slot = &(*leaf)->pages[page % SPARSE_LEAF_PAGES];
+  if (!*slot && alloc && (*slot = arena_alloc()))
+    (*leaf)->used++;
+  return *slot;
+}
+
+static void sparse_free_page(u_int64_t page)
+{
+  struct sparse_leaf **leaf = &sparse_dir[page / SPARSE_LEAF_PAGES];
+  unsigned char **slot;
+
+  if (!*leaf)
+    return;
+  slot = &(*leaf)->pages[page % SPARSE_LEAF_PAGES];
+  if (!*slot)
+    return;
+  arena_release(*slot);
+  *slot = NULL;
+  if (--(*leaf)->used == 0) {
+    free(*leaf);
+    *leaf = NULL;
+  }
+}
+
+/* Copy between buf and the device, page by page. Returns -1 when a page
+ * cannot be allocated. */
+static int sparse_copy(void *buf, u_int32_t len, u_int64_t offset, int write)
+{
+  unsigned char *p = buf;
+  int ret = 0;
+
+  pthread_mutex_lock(&sparse_lock);
+  while (len > 0) {
+    u_int32_t in_page = offset % SPARSE_PAGE_SIZE;
+    u_int32_t n = SPARSE_PAGE_SIZE - in_page < len ? SPARSE_PAGE_SIZE - in_page : len;
+    unsigned char *page = sparse_page(offset / SPARSE_PAGE_SIZE, write);
+
+    if (write && !page) {
+      ret = -1;
+      break;
+    }
+    if (write)
+      memcpy(page + in_page, p, n);
+    else if (page)
+      memcpy(p, page + in_page, n);
+    else
+      memset(p, 0, n);
+    p += n;
+    offset += n;
+    len -= n;
+  }
+  pthread_mutex_unlock(&sparse_lock);
+  return ret;
+}
+
 /* BUSE callbacks */
 static void *data;
+static u_int64_t data_size;
+static int data_shared;         /* data maps a file, flushes reach it with msync */
 
 static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
   if (*(int *)userdata)
     fprintf(stderr, "R - %lu, %u\n", offset, len);
+  if (sparse)
+    return sparse_copy(buf, len, offset, 0);
   memcpy(buf, (char *)data + offset, len);
   return 0;
 }
@@ -40,20 +182,29 @@ static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *use
 {
   if (*(int *)userdata)
     fprintf(stderr, "W - %lu, %u\n", offset, len);
+  if (sparse)
+    return sparse_copy((void *)buf, len, offset, 1);
   memcpy((char *)data + offset, buf, len);
   return 0;
 }
 
 static void xmp_disc(void *userdata)
 {
-  if (*(int *)userdata)
+  if (*(int *)userdata) {
     fprintf(stderr, "Received a disconnect request.\n");
+    if (sparse)
+      fprintf(stderr, "%lu pages of %d bytes in use.\n", arena.pages, SPARSE_PAGE_SIZE);
+  }
 }
 
 static int xmp_flush(void *userdata)
 {
   if (*(int *)userdata)
     fprintf(stderr, "Received a flush request.\n");
+  if (data_shared && msync(data, data_size, MS_SYNC) != 0) {
+    warn("msync");
+    return -1;
+  }
   return 0;
 }
 
@@ -61,6 +212,15 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata)
 {
   if (*(int *)userdata)
     fprintf(stderr, "T - %lu, %u\n", from, len);
+  if (sparse) {
+    /* only whole pages can go; the rest of the range keeps its data */
+    u_int64_t first = (from + SPARSE_PAGE_SIZE - 1) / SPARSE_PAGE_SIZE;
+    u_int64_t end = (from + len) / SPARSE_PAGE_SIZE;
+    pthread_mutex_lock(&sparse_lock);
+    for (u_int64_t page = first; page < end; page++)
+      sparse_free_page(page);
+    pthread_mutex_unlock(&sparse_lock);
+  }
   return 0;
 }
 
@@ -68,6 +228,11 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata)
 
 static struct argp_option options[] = {
   {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+  {"workers", 'w', "N", 0, "Serve up to N requests concurrently", 0},
+  {"connections", 'c', "N", 0, "Hand N sockets to the nbd driver", 0},
+  {"sparse", 's', 0, 0, "Allocate memory page by page as the device is written, and free it on trim", 0},
+  {"hugepages", 'H', 0, 0, "Back the device with huge pages (MAP_HUGETLB), or transparent huge pages when none are reserved", 0},
+  {"file", 'f', "PATH", 0, "Keep the device in the file PATH, so it survives a restart; a file on hugetlbfs gives huge pages", 0},
   {0},
 };
 
@@ -75,6 +240,11 @@ struct arguments {
   unsigned long long size;
   char * device;
   int verbose;
+  unsigned workers;
+  unsigned connections;
+  int sparse;
+  int hugepages;
+  char *file;
 };
 
 static unsigned long long strtoull_with_prefix(const char * str, char * * end) {
@@ -107,6 +277,32 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       arguments->verbose = 1;
       break;
 
+    case 'w':
+      arguments->workers = strtoul(arg, &endptr, 10);
+      if (*endptr != '\0') {
+        errx(EXIT_FAILURE, "N must be an integer");
+      }
+      break;
+
+    case 'c':
+      arguments->connections = strtoul(arg, &endptr, 10);
+      if (*endptr != '\0') {
+        errx(EXIT_FAILURE, "N must be an integer");
+      }
+      break;
+
+    case 's':
+      arguments->sparse = 1;
+      break;
+
+    case 'H':
+      arguments->hugepages = 1;
+      break;
+
+    case 'f':
+      arguments->file = arg;
+      break;
+
     case ARGP_KEY_ARG:
       switch (state->arg_num) {
 
@@ -133,6 +329,8 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         warnx("not enough arguments");
         argp_usage(state);
       }
+      if (arguments->sparse + arguments->hugepages + (arguments->file != NULL) > 1)
+        argp_error(state, "--sparse, --hugepages and --file exclude each other");
       break;
 
     default:
@@ -141,6 +339,45 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   return 0;
 }
 
+/* Map the device from a file, creating it or growing it to size. */
+static void *map_file(const char *path, u_int64_t size)
+{
+  struct stat st;
+  struct statfs sfs;
+  void *p;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+  if (fd < 0 || fstat(fd, &st) != 0 || fstatfs(fd, &sfs) != 0)
+    err(EXIT_FAILURE, "%s", path);
+  if ((u_int64_t)st.st_size < size) {
+    /* hugetlbfs only takes whole huge pages */
+    u_int64_t len = (size + sfs.f_bsize - 1) / sfs.f_bsize * sfs.f_bsize;
+    if (ftruncate(fd, len) != 0)
+      err(EXIT_FAILURE, "failed to size %s", path);
+  }
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err(EXIT_FAILURE, "failed to map %s", path);
+  close(fd);
+  return p;
+}
+
+/* Anonymous memory in huge pages, so random access to a large device
+ * does not miss the TLB all the time. */
+static void *map_hugepages(u_int64_t size)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED)
+    return p;
+  warn("no huge pages for %lu bytes, using transparent huge pages", size);
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    err(EXIT_FAILURE, "failed to map space for data");
+  madvise(p, size, MADV_HUGEPAGE);
+  return p;
+}
+
 static struct argp argp = {
   .options = options,
   .parser = parse_opt,
@@ -163,10 +400,25 @@ int main(int argc, char *argv[]) {
     .flush = xmp_flush,
     .trim = xmp_trim,
     .size = arguments.size,
+    .num_workers = arguments.workers,
+    .num_connections = arguments.connections,
   };
 
-  data = malloc(aop.size);
-  if (data == NULL) err(EXIT_FAILURE, "failed to alloc space for data");
+  sparse = arguments.sparse;
+  if (sparse) {
+    u_int64_t leaf_bytes = (u_int64_t)SPARSE_LEAF_PAGES * SPARSE_PAGE_SIZE;
+    sparse_dir = calloc((aop.size + leaf_bytes - 1) / leaf_bytes, sizeof(*sparse_dir));
+    if (sparse_dir == NULL) err(EXIT_FAILURE, "failed to alloc page directory");
+  } else if (arguments.file) {
+    data = map_file(arguments.file, aop.size);
+    data_shared = 1;
+  } else if (arguments.hugepages) {
+    data = map_hugepages(aop.size);
+  } else {
+    data = malloc(aop.size);
+    if (data == NULL) err(EXIT_FAILURE, "failed to alloc space for data");
+  }
+  data_size = aop.size;
 
   return buse_main(arguments.device, &aop, (void *)&arguments.verbose);
 }
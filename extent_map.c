@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "extent_map.h"
+
+void extent_map_init(struct extent_map *m, size_t max) {
+    memset(m, 0, sizeof(*m));
+    m->max = max;
+}
+
+void extent_map_free(struct extent_map *m) {
+    free(m->ext);
+    m->ext = NULL;
+    m->n = m->cap = 0;
+}
+
+/* Index of the first run ending after x, or at x as well when touching. */
+static size_t first_after(const struct extent_map *m, uint64_t x, bool touching) {
+    size_t lo = 0, hi = m->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m->ext[mid].end > x || (touching && m->ext[mid].end == x))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* Open a slot at index i. Returns false when the map is full. */
+static bool insert_slot(struct extent_map *m, size_t i) {
+    if (m->n == m->cap) {
+        size_t cap = m->cap ? 2 * m->cap : 16;
+        struct extent *ext;
+        if (cap > m->max)
+            cap = m->max;
+        if (cap <= m->n || !(ext = realloc(m->ext, cap * sizeof(*ext))))
+            return false;
+        m->ext = ext;
+        m->cap = cap;
+    }
+    memmove(&m->ext[i + 1], &m->ext[i], (m->n - i) * sizeof(*m->ext));
+    m->n++;
+    return true;
+}
+
+void extent_map_add(struct extent_map *m, uint64_t start, uint64_t end) {
+    size_t i = first_after(m, start, true), j = i;
+
+    if (start >= end)
+        return;
+    while (j < m->n && m->ext[j].start <= end)
+        j++;
+    if (i == j) {
+        if (insert_slot(m, i))
+            m->ext[i] = (struct extent){ start, end };
+        return;
+    }
+    if (m->ext[i].start < start)
+        start = m->ext[i].start;
+    if (m->ext[j - 1].end > end)
+        end = m->ext[j - 1].end;
+    m->ext[i] = (struct extent){ start, end };
+    memmove(&m->ext[i + 1], &m->ext[j], (m->n - j) * sizeof(*m->ext));
+    m->n -= j - i - 1;
+}
+
+void extent_map_remove(struct extent_map *m, uint64_t start, uint64_t end) {
+    size_t i = first_after(m, start, false), j = i;
+    struct extent left, right;
+
+    if (start >= end || i == m->n || m->ext[i].start >= end)
+        return;
+    while (j < m->n && m->ext[j].start < end)
+        j++;
+    left = (struct extent){ m->ext[i].start, start };
+    right = (struct extent){ end, m->ext[j - 1].end };
+    memmove(&m->ext[i], &m->ext[j], (m->n - j) * sizeof(*m->ext));
+    m->n -= j - i;
+    /* when the map is full, the right piece is forgotten */
+    if (left.start < left.end && insert_slot(m, i))
+        m->ext[i++] = left;
+    if (right.start < right.end && insert_slot(m, i))
+        m->ext[i] = right;
+}
+
+bool extent_map_contains(const struct extent_map *m, uint64_t x) {
+    size_t i = first_after(m, x, false);
+    return i < m->n && m->ext[i].start <= x;
+}
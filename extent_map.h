@@ -0,0 +1,32 @@
+#ifndef EXTENT_MAP_H_INCLUDED
+#define EXTENT_MAP_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A set of numbers kept as sorted, disjoint runs [start, end). The map
+   never holds more than max runs: what does not fit is forgotten, so it
+   may only be used for facts that are safe to lose. */
+
+struct extent {
+    uint64_t start, end;
+};
+
+struct extent_map {
+    struct extent *ext;
+    size_t n, cap, max;
+};
+
+void extent_map_init(struct extent_map *m, size_t max);
+void extent_map_free(struct extent_map *m);
+
+/* Add [start, end), merging it with the runs it overlaps or touches. */
+void extent_map_add(struct extent_map *m, uint64_t start, uint64_t end);
+
+/* Take [start, end) out of the map. */
+void extent_map_remove(struct extent_map *m, uint64_t start, uint64_t end);
+
+bool extent_map_contains(const struct extent_map *m, uint64_t x);
+
+#endif /* EXTENT_MAP_H_INCLUDED */
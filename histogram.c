@@ -0,0 +1,88 @@
+/* lock-free latency histograms */
+
+/* clock_gettime() */
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+
+#include "histogram.h"
+
+static int bucket_of(u_int64_t value)
+{
+  int msb, shift;
+
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return value;
+  msb = 63 - __builtin_clzll(value);
+  shift = msb - 3;
+  return HISTOGRAM_SUB_BUCKETS * (shift + 1) + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Largest value that falls into bucket i. */
+static u_int64_t bucket_end(int i)
+{
+  int shift;
+
+  if (i < HISTOGRAM_SUB_BUCKETS)
+    return i;
+  shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+  return (((u_int64_t)(HISTOGRAM_SUB_BUCKETS + i % HISTOGRAM_SUB_BUCKETS + 1)) << shift) - 1;
+}
+
+void histogram_record(struct histogram *h, u_int64_t value)
+{
+  u_int64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&h->buckets[bucket_of(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+u_int64_t histogram_percentile(const struct histogram *h, double p)
+{
+  u_int64_t total = 0, seen = 0, target, end, max;
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+  if (total == 0)
+    return 0;
+  target = p * total;
+  if (target < 1)
+    target = 1;
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    if (seen >= target)
+      break;
+  }
+  end = bucket_end(i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1);
+  max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  return end < max ? end : max;
+}
+
+void histogram_print_ns(FILE *out, const char *name, const struct histogram *h)
+{
+  u_int64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  u_int64_t sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+
+  if (count == 0) {
+    fprintf(out, "%s: none\n", name);
+    return;
+  }
+  fprintf(out, "%s: %lu, avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f us\n",
+          name, count, sum / 1e3 / count,
+          histogram_percentile(h, 0.5) / 1e3, histogram_percentile(h, 0.9) / 1e3,
+          histogram_percentile(h, 0.99) / 1e3, histogram_percentile(h, 0.999) / 1e3,
+          __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e3);
+}
+
+u_int64_t histogram_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
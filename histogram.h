@@ -0,0 +1,41 @@
+#ifndef HISTOGRAM_H_INCLUDED
+#define HISTOGRAM_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+  // Log-linear histogram in the style of HdrHistogram: every power of two is
+  // split into 8 buckets, so any recorded value is known to within 12.5%.
+  // Recording is lock-free and may happen on any number of threads while
+  // another one reads.
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 62)
+
+  struct histogram {
+    u_int64_t count;
+    u_int64_t sum;
+    u_int64_t max;
+    u_int64_t buckets[HISTOGRAM_BUCKETS];
+  };
+
+  void histogram_record(struct histogram *h, u_int64_t value);
+
+  // smallest value that at least fraction p of the recorded ones do not
+  // exceed, rounded up to the end of its bucket
+  u_int64_t histogram_percentile(const struct histogram *h, double p);
+
+  // one line: count, mean and percentiles of nanosecond values, in us
+  void histogram_print_ns(FILE *out, const char *name, const struct histogram *h);
+
+  // monotonic clock in nanoseconds, for the values above
+  u_int64_t histogram_now_ns(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HISTOGRAM_H_INCLUDED */
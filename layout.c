@@ -0,0 +1,71 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "layout.h"
+
+static const char *names[] = {
+    [LAYOUT_LEFT_ASYMMETRIC] = "left-asymmetric",
+    [LAYOUT_RIGHT_ASYMMETRIC] = "right-asymmetric",
+    [LAYOUT_LEFT_SYMMETRIC] = "left-symmetric",
+    [LAYOUT_RIGHT_SYMMETRIC] = "right-symmetric",
+};
+
+static void div_init(struct layout_div *v, uint64_t d) {
+    v->d = d;
+    v->shift = -1;
+    if ((d & (d - 1)) == 0) {
+        v->shift = 0;
+        while ((1ULL << v->shift) < d)
+            v->shift++;
+    }
+}
+
+/* Left layouts start the parity on the last member and move it down by
+   one every row, right ones start on the first and move it up; a RAID6
+   Q follows P, wrapping around to the first member. The data of
+   asymmetric layouts fills the other members from the first on;
+   symmetric layouts start right after the parity and wrap around, so
+   consecutive chunks land on every member in turn. */
+void layout_init(struct layout *l, int ndisks, int nparity, uint32_t chunk_blocks,
+                 enum layout_algorithm algorithm) {
+    int ndata = ndisks - nparity;
+
+    memset(l, 0, sizeof(*l));
+    l->ndisks = ndisks;
+    l->nparity = nparity;
+    l->algorithm = algorithm;
+    div_init(&l->chunk_blocks, chunk_blocks);
+    div_init(&l->data_disks, ndata);
+    div_init(&l->disks, ndisks);
+    for (int row = 0; row < ndisks; row++) {
+        struct layout_rotation *r = &l->rotation[row];
+        bool left = algorithm == LAYOUT_LEFT_ASYMMETRIC || algorithm == LAYOUT_LEFT_SYMMETRIC;
+        bool symmetric = algorithm == LAYOUT_LEFT_SYMMETRIC || algorithm == LAYOUT_RIGHT_SYMMETRIC;
+
+        r->parity = left ? ndisks - 1 - row : row;
+        r->q = nparity == 2 ? (r->parity + 1) % ndisks : r->parity;
+        r->pos[r->parity] = ndata;
+        r->pos[r->q] = ndata + nparity - 1;
+        for (int pos = 0, disk = symmetric ? r->q + 1 : 0; pos < ndata; disk++) {
+            disk %= ndisks;
+            if (disk == r->parity || disk == r->q)
+                continue;
+            r->disk[pos] = disk;
+            r->pos[disk] = pos++;
+        }
+    }
+}
+
+int layout_parse(const char *name, enum layout_algorithm *algorithm) {
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *algorithm = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *layout_name(enum layout_algorithm algorithm) {
+    return names[algorithm];
+}
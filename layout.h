@@ -0,0 +1,96 @@
+#ifndef LAYOUT_H_INCLUDED
+#define LAYOUT_H_INCLUDED
+
+#include <stdint.h>
+
+/* Where the blocks of a RAID5 or RAID6 array live. Every member holds
+   one chunk of each chunk row, at the same member offset; one of them
+   (two for RAID6, P and Q) is the row's parity, the others hold
+   consecutive chunks of the array. As in md, a stripe is one block of
+   every member at the same offset, so a chunk row spans chunk_blocks
+   consecutive stripes and the parity of a stripe is computed from its
+   data blocks. Stripe s lives at member offset s * block_size whatever
+   the chunk size.
+
+   Which member holds the parity and in what order the data chunks follow
+   it repeats every n chunk rows, so it is looked up in a table built
+   once; divisions by the chunk size and the member counts become shifts
+   when they are powers of two. */
+
+#define LAYOUT_MAX_DEVICES 16
+
+/* md's RAID5 algorithms; right-asymmetric is what raid5 always used.
+   For RAID6 they place P the same way and Q on the member after it. */
+enum layout_algorithm {
+    LAYOUT_LEFT_ASYMMETRIC,
+    LAYOUT_RIGHT_ASYMMETRIC,
+    LAYOUT_LEFT_SYMMETRIC,
+    LAYOUT_RIGHT_SYMMETRIC,
+};
+
+struct layout_div {
+    uint64_t d;
+    int shift;              /* log2(d), or -1 when d is no power of two */
+};
+
+/* Member roles in one chunk row of the rotation. Roles are numbered as
+   in parity_recover_coefs(): data positions first, then P and Q. */
+struct layout_rotation {
+    uint8_t parity;
+    uint8_t q;                              /* the Q member, RAID6 only */
+    uint8_t disk[LAYOUT_MAX_DEVICES - 1];   /* member of the pos-th data chunk */
+    uint8_t pos[LAYOUT_MAX_DEVICES];        /* and back: role of every member */
+};
+
+struct layout {
+    int ndisks;
+    int nparity;            /* 1 for RAID5, 2 for RAID6 */
+    enum layout_algorithm algorithm;
+    struct layout_div chunk_blocks;
+    struct layout_div data_disks;
+    struct layout_div disks;
+    struct layout_rotation rotation[LAYOUT_MAX_DEVICES];
+};
+
+void layout_init(struct layout *l, int ndisks, int nparity, uint32_t chunk_blocks,
+                 enum layout_algorithm algorithm);
+int layout_parse(const char *name, enum layout_algorithm *algorithm);
+const char *layout_name(enum layout_algorithm algorithm);
+
+static inline uint64_t layout_div(const struct layout_div *v, uint64_t x) {
+    return v->shift >= 0 ? x >> v->shift : x / v->d;
+}
+
+static inline uint64_t layout_mod(const struct layout_div *v, uint64_t x) {
+    return v->shift >= 0 ? x & (v->d - 1) : x % v->d;
+}
+
+static inline const struct layout_rotation *layout_rotation(const struct layout *l, uint64_t stripe) {
+    return &l->rotation[layout_mod(&l->disks, layout_div(&l->chunk_blocks, stripe))];
+}
+
+static inline int layout_parity(const struct layout *l, uint64_t stripe) {
+    return layout_rotation(l, stripe)->parity;
+}
+
+/* Whether member `disk` holds data in `stripe`. */
+static inline int layout_is_data(const struct layout *l, uint64_t stripe, int disk) {
+    return layout_rotation(l, stripe)->pos[disk] < l->data_disks.d;
+}
+
+/* Array block -> its stripe and its position among the stripe's data
+   blocks. */
+static inline void layout_map(const struct layout *l, uint64_t block, uint64_t *stripe, int *pos) {
+    uint64_t chunk = layout_div(&l->chunk_blocks, block);
+    uint64_t row = layout_div(&l->data_disks, chunk);
+    *pos = layout_mod(&l->data_disks, chunk);
+    *stripe = row * l->chunk_blocks.d + layout_mod(&l->chunk_blocks, block);
+}
+
+/* The inverse of layout_map(). */
+static inline uint64_t layout_block(const struct layout *l, uint64_t stripe, int pos) {
+    uint64_t row = layout_div(&l->chunk_blocks, stripe);
+    return (row * l->data_disks.d + pos) * l->chunk_blocks.d + layout_mod(&l->chunk_blocks, stripe);
+}
+
+#endif /* LAYOUT_H_INCLUDED */
@@ -20,72 +20,295 @@
 #define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
 
+#include <argp.h>
 #include <assert.h>
+#include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "uring.h"
+
+/* Requests the io_uring engine keeps in flight. */
+#define LOOPBACK_DEPTH 64
+
+/* Most workers the sync engine may serve requests with. */
+#define MAX_WORKERS 64
 
 static int fd;
 
 static void usage(void)
 {
-    fprintf(stderr, "Usage: loopback <phyical device> <virtual device>\n");
+    fprintf(stderr, "Usage: loopback [OPTION...] <phyical device> <virtual device>\n");
+}
+
+/* Transfer all of len bytes at offset, whatever the short counts. */
+static int loopback_rw(int write, void *buf, u_int32_t len, u_int64_t offset)
+{
+    while (len > 0) {
+        ssize_t n = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+        if (n <= 0) {
+            warn(write ? "pwrite at %lu" : "pread at %lu", offset);
+            return -1;
+        }
+        len -= n;
+        offset += n;
+        buf = (char *) buf + n;
+    }
+    return 0;
 }
 
 static int loopback_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
-    int bytes_read;
     (void)(userdata);
+    return loopback_rw(0, buf, len, offset);
+}
 
-    lseek64(fd, offset, SEEK_SET);
-    while (len > 0) {
-        bytes_read = read(fd, buf, len);
-        assert(bytes_read > 0);
-        len -= bytes_read;
-        buf = (char *) buf + bytes_read;
+static int loopback_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    (void)(userdata);
+    return loopback_rw(1, (void *)buf, len, offset);
+}
+
+static int loopback_flush(void *userdata)
+{
+    (void)(userdata);
+    return fdatasync(fd);
+}
+
+/* Every read is a single extent of the backing device, so it can be
+ * spliced to the socket directly. */
+static int loopback_read_map(struct buse_extent *extents, int max_extents, u_int32_t len,
+                             u_int64_t offset, void *userdata)
+{
+    (void)(max_extents);
+    (void)(userdata);
+
+    extents[0].fd = fd;
+    extents[0].offset = offset;
+    extents[0].len = len;
+    return 1;
+}
+
+/* io_uring engine: the nbd reader submits, and a reaper thread completes
+ * the requests as the kernel finishes them. */
+struct loopback_io {
+    struct buse_request *req;
+    int write;
+    void *buf;
+    u_int32_t len;
+    u_int64_t offset;
+    struct loopback_io *next;
+};
+
+static struct uring ring;
+static struct loopback_io ios[LOOPBACK_DEPTH];
+static struct loopback_io *free_ios;
+static pthread_mutex_t ios_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void put_io(struct loopback_io *io)
+{
+    pthread_mutex_lock(&ios_lock);
+    io->next = free_ios;
+    free_ios = io;
+    pthread_mutex_unlock(&ios_lock);
+}
+
+static int loopback_submit(struct buse_request *req, int op, void *buf, u_int32_t len, u_int64_t offset)
+{
+    struct io_uring_sqe *sqe;
+    struct loopback_io *io;
+
+    /* buse keeps at most LOOPBACK_DEPTH requests in flight */
+    pthread_mutex_lock(&ios_lock);
+    io = free_ios;
+    free_ios = io->next;
+    pthread_mutex_unlock(&ios_lock);
+    *io = (struct loopback_io){ req, op == IORING_OP_WRITE, buf, len, offset, NULL };
+
+    sqe = uring_get_sqe(&ring);
+    assert(sqe);
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    if (op == IORING_OP_FSYNC)
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = (unsigned long)io;
+    /* the reaper is behind (-EBUSY) or the kernel is short of memory
+       (-EAGAIN): try again; anything else fails the request, and the
+       entry must not run later with an io that belongs to another one */
+    for (;;) {
+        int r = uring_submit_and_wait(&ring, 0);
+        if (uring_pending(&ring) == 0)
+            return 0;
+        if (r != -EAGAIN && r != -EBUSY)
+            break;
+        sched_yield();
     }
+    warnx("io_uring request at %lu not submitted", offset);
+    uring_unqueue(&ring);
+    put_io(io);
+    return -1;
+}
 
-    return 0;
+static int loopback_aread(struct buse_request *req, void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    (void)(userdata);
+    return loopback_submit(req, IORING_OP_READ, buf, len, offset);
 }
 
-static int loopback_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+static int loopback_awrite(struct buse_request *req, const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
-    int bytes_written;
     (void)(userdata);
+    return loopback_submit(req, IORING_OP_WRITE, (void *)buf, len, offset);
+}
 
-    lseek64(fd, offset, SEEK_SET);
-    while (len > 0) {
-        bytes_written = write(fd, buf, len);
-        assert(bytes_written > 0);
-        len -= bytes_written;
-        buf = (char *) buf + bytes_written;
+static int loopback_aflush(struct buse_request *req, void *userdata)
+{
+    (void)(userdata);
+    return loopback_submit(req, IORING_OP_FSYNC, NULL, 0, 0);
+}
+
+static void *reaper_main(void *arg)
+{
+    struct io_uring_cqe *cqe;
+    (void)(arg);
+
+    for (;;) {
+        if (uring_wait(&ring, 1) < 0)
+            err(EXIT_FAILURE, "io_uring_enter");
+        while ((cqe = uring_peek_cqe(&ring))) {
+            struct loopback_io *io = (struct loopback_io *)(unsigned long)cqe->user_data;
+            struct buse_request *req = io->req;
+            int res = cqe->res, error = 0;
+            uring_cqe_seen(&ring);
+
+            if (res < 0) {
+                errno = -res;
+                warn("io_uring request at %lu", io->offset);
+                error = -1;
+            } else if ((u_int32_t)res < io->len) {
+                /* rare enough to finish synchronously */
+                error = loopback_rw(io->write, (char *)io->buf + res, io->len - res, io->offset + res);
+            }
+            /* free before completing, buse may start the next one at once */
+            put_io(io);
+            buse_complete(req, error);
+        }
     }
+    return NULL;
+}
+
+static int start_uring(void)
+{
+    pthread_t reaper;
+    int r = uring_init(&ring, LOOPBACK_DEPTH);
 
+    if (r < 0) {
+        fprintf(stderr, "io_uring setup failed: %s\n", strerror(-r));
+        return -1;
+    }
+    for (int i = 0; i < LOOPBACK_DEPTH; i++)
+        put_io(&ios[i]);
+    if (pthread_create(&reaper, NULL, reaper_main, NULL) != 0) {
+        fprintf(stderr, "cannot start the io_uring reaper\n");
+        return -1;
+    }
     return 0;
 }
 
 static struct buse_operations bop = {
     .read = loopback_read,
-    .write = loopback_write
+    .write = loopback_write,
+    .flush = loopback_flush,
+};
+
+/* argument parsing using argp */
+
+static struct argp_option options[] = {
+    {"direct", 'd', 0, 0, "Open the physical device with O_DIRECT, so that data is not cached there as well as in the nbd device", 0},
+    {"io-engine", 'e', "ENGINE", 0, "sync (default) for pread/pwrite, with reads spliced to the socket unless --direct, or uring to keep many requests in flight on io_uring", 0},
+    {"workers", 'w', "N", 0, "Serve up to N requests concurrently with the sync engine", 0},
+    {0},
+};
+
+struct arguments {
+    char *physical;
+    char *device;
+    int direct;
+    int uring;
+    unsigned workers;
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+        case 'd':
+            arguments->direct = 1;
+            break;
+        case 'e':
+            if (strcmp(arg, "uring") == 0)
+                arguments->uring = 1;
+            else if (strcmp(arg, "sync") != 0)
+                argp_error(state, "unknown I/O engine '%s'", arg);
+            break;
+        case 'w': {
+            char *end;
+            unsigned long workers = strtoul(arg, &end, 10);
+            if (end == arg || *end != '\0' || workers < 1 || workers > MAX_WORKERS)
+                argp_error(state, "workers must be between 1 and %d", MAX_WORKERS);
+            arguments->workers = workers;
+            break;
+        }
+        case ARGP_KEY_ARG:
+            if (state->arg_num == 0)
+                arguments->physical = arg;
+            else if (state->arg_num == 1)
+                arguments->device = arg;
+            else
+                return ARGP_ERR_UNKNOWN;
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 2) {
+                usage();
+                argp_usage(state);
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = {
+    .options = options,
+    .parser = parse_opt,
+    .args_doc = "PHYSICAL_DEVICE VIRTUAL_DEVICE",
+    .doc = "BUSE virtual block device that passes requests through to a physical block device.",
 };
 
 int main(int argc, char *argv[])
 {
+    struct arguments arguments = { 0 };
     struct stat buf;
     int err;
     int64_t size;
 
-    if (argc != 3) {
-        usage();
-        return -1;
-    }
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
-    fd = open(argv[1], O_RDWR|O_LARGEFILE);
+    fd = open(arguments.physical, O_RDWR|O_LARGEFILE|(arguments.direct ? O_DIRECT : 0));
     assert(fd != -1);
 
     /* Let's verify that this file is actually a block device. We could support
@@ -96,11 +319,37 @@ int main(int argc, char *argv[])
     /* Figure out the size of the underlying block device. */
     err = ioctl(fd, BLKGETSIZE64, &size);
     assert(err != -1);
-    (void)err;
     fprintf(stderr, "The size of this device is %ld bytes.\n", size);
     bop.size = size;
 
-    buse_main(argv[2], &bop, NULL);
+    if (arguments.direct) {
+        /* O_DIRECT needs requests aligned to the device's sectors; buse
+         * already hands out page-aligned buffers. */
+        int sector_size;
+        err = ioctl(fd, BLKSSZGET, &sector_size);
+        assert(err != -1);
+        bop.blksize = sector_size;
+    } else {
+        bop.read_map = loopback_read_map;
+    }
+    (void)err;
+
+    if (arguments.uring) {
+        if (start_uring() != 0)
+            return 1;
+        bop.read = NULL;
+        bop.write = NULL;
+        bop.flush = NULL;
+        bop.read_map = NULL;
+        bop.aread = loopback_aread;
+        bop.awrite = loopback_awrite;
+        bop.aflush = loopback_aflush;
+        bop.max_inflight = LOOPBACK_DEPTH;
+    } else {
+        bop.num_workers = arguments.workers;
+    }
+
+    buse_main(arguments.device, &bop, NULL);
 
     return 0;
 }
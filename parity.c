@@ -0,0 +1,516 @@
+/* Parity kernels shared by the RAID read, write and rebuild paths.
+
+   Every kernel XORs all sources into the destination one vector-sized
+   window at a time, keeping the running result in registers, so the
+   destination is written once no matter how many members contribute.
+   The kernel is chosen at runtime from the CPU features.
+
+   The RAID6 kernels work the same way. The Q syndrome is evaluated
+   Horner style, q = (...(D_{n-1} * g + D_{n-2}) * g ...) + D_0, and a
+   multiplication by g = 2 is a shift plus a conditional XOR with the
+   polynomial, so P and Q come out of one pass at nearly the cost of P.
+   Multiplications by arbitrary constants, used to rebuild lost blocks,
+   look up the products of the low and the high nibble of every byte in
+   two 16-entry tables with a byte shuffle. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARITY_X86 1
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PARITY_NEON 1
+#endif
+
+#include "parity.h"
+
+typedef void (*xor_fn)(unsigned char *dst, const unsigned char *const *srcs,
+                       int nsrc, size_t len);
+
+typedef void (*pq_fn)(unsigned char *p, unsigned char *q, const unsigned char *const *srcs,
+                      int nsrc, size_t len);
+
+/* tables[s] holds coefs[s] times 0..15 and times 0x00..0xf0 */
+typedef void (*gf_sum_fn)(unsigned char *dst, const unsigned char *const *srcs, const uint8_t *coefs,
+                          const uint8_t (*tables)[32], int nsrc, size_t len);
+
+static xor_fn xor_kernel;
+static const char *xor_name = "unset";
+static pq_fn pq_kernel;
+static gf_sum_fn gf_sum_kernel;
+static const char *gf_name = "unset";
+
+static uint8_t gf_exp_table[255];
+static uint8_t gf_log_table[256];
+static uint8_t gf_mul_table[256][256];
+
+static void gf_init(void) {
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp_table[i] = x;
+        gf_log_table[x] = i;
+        x = (x << 1) ^ (x & 0x80 ? 0x11d : 0);
+    }
+    for (int a = 1; a < 256; a++) {
+        for (int b = 1; b < 256; b++)
+            gf_mul_table[a][b] = gf_exp_table[(gf_log_table[a] + gf_log_table[b]) % 255];
+    }
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return gf_mul_table[a][b];
+}
+
+/* a / b, b != 0 */
+static uint8_t gf_div(uint8_t a, uint8_t b) {
+    if (a == 0)
+        return 0;
+    return gf_exp_table[(gf_log_table[a] + 255 - gf_log_table[b]) % 255];
+}
+
+static uint8_t gf_mul2(uint8_t b) {
+    return (b << 1) ^ (b & 0x80 ? 0x1d : 0);
+}
+
+/* Bytes [i, len) one at a time; the tail of every vector kernel. */
+static void xor_tail(unsigned char *dst, const unsigned char *const *srcs,
+                     int nsrc, size_t i, size_t len) {
+    for (; i < len; i++) {
+        unsigned char c = srcs[0][i];
+        for (int s = 1; s < nsrc; s++)
+            c ^= srcs[s][i];
+        dst[i] = c;
+    }
+}
+
+static void xor_scalar(unsigned char *dst, const unsigned char *const *srcs,
+                       int nsrc, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint64_t a[4], b[4];
+        memcpy(a, srcs[0] + i, sizeof(a));
+        for (int s = 1; s < nsrc; s++) {
+            memcpy(b, srcs[s] + i, sizeof(b));
+            a[0] ^= b[0];
+            a[1] ^= b[1];
+            a[2] ^= b[2];
+            a[3] ^= b[3];
+        }
+        memcpy(dst + i, a, sizeof(a));
+    }
+    xor_tail(dst, srcs, nsrc, i, len);
+}
+
+static void pq_tail(unsigned char *p, unsigned char *q, const unsigned char *const *srcs,
+                    int nsrc, size_t i, size_t len) {
+    for (; i < len; i++) {
+        unsigned char pc = srcs[nsrc - 1][i], qc = pc;
+        for (int s = nsrc - 2; s >= 0; s--) {
+            pc ^= srcs[s][i];
+            qc = gf_mul2(qc) ^ srcs[s][i];
+        }
+        p[i] = pc;
+        q[i] = qc;
+    }
+}
+
+/* Eight multiplications by g at once. */
+__attribute__((always_inline))
+static inline uint64_t mul2_u64(uint64_t v) {
+    uint64_t hi = v & 0x8080808080808080ULL;
+    uint64_t mask = (hi << 1) - (hi >> 7);      /* 0xff in every byte with its top bit set */
+    return ((v << 1) & 0xfefefefefefefefeULL) ^ (mask & 0x1d1d1d1d1d1d1d1dULL);
+}
+
+static void pq_scalar(unsigned char *p, unsigned char *q, const unsigned char *const *srcs,
+                      int nsrc, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint64_t a[2], b[2], d[2];
+        memcpy(a, srcs[nsrc - 1] + i, sizeof(a));
+        memcpy(b, a, sizeof(b));
+        for (int s = nsrc - 2; s >= 0; s--) {
+            memcpy(d, srcs[s] + i, sizeof(d));
+            a[0] ^= d[0];
+            a[1] ^= d[1];
+            b[0] = mul2_u64(b[0]) ^ d[0];
+            b[1] = mul2_u64(b[1]) ^ d[1];
+        }
+        memcpy(p + i, a, sizeof(a));
+        memcpy(q + i, b, sizeof(b));
+    }
+    pq_tail(p, q, srcs, nsrc, i, len);
+}
+
+static void gf_sum_tail(unsigned char *dst, const unsigned char *const *srcs, const uint8_t *coefs,
+                        int nsrc, size_t i, size_t len) {
+    for (; i < len; i++) {
+        unsigned char c = 0;
+        for (int s = 0; s < nsrc; s++)
+            c ^= gf_mul(coefs[s], srcs[s][i]);
+        dst[i] = c;
+    }
+}
+
+static void gf_sum_scalar(unsigned char *dst, const unsigned char *const *srcs, const uint8_t *coefs,
+                          const uint8_t (*tables)[32], int nsrc, size_t len) {
+    (void)tables;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned char a[32] = { 0 };
+        for (int s = 0; s < nsrc; s++) {
+            const uint8_t *row = gf_mul_table[coefs[s]];
+            const unsigned char *p = srcs[s] + i;
+            for (int j = 0; j < 32; j++)
+                a[j] ^= row[p[j]];
+        }
+        memcpy(dst + i, a, sizeof(a));
+    }
+    gf_sum_tail(dst, srcs, coefs, nsrc, i, len);
+}
+
+#ifdef PARITY_X86
+__attribute__((target("avx2")))
+static void xor_avx2(unsigned char *dst, const unsigned char *const *srcs,
+                     int nsrc, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        const unsigned char *p = srcs[0] + i;
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(p));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(p + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(p + 96));
+        for (int s = 1; s < nsrc; s++) {
+            p = srcs[s] + i;
+            a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(p)));
+            a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(p + 32)));
+            a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(p + 64)));
+            a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(p + 96)));
+        }
+        _mm256_storeu_si256((__m256i *)(dst + i), a0);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), a1);
+        _mm256_storeu_si256((__m256i *)(dst + i + 64), a2);
+        _mm256_storeu_si256((__m256i *)(dst + i + 96), a3);
+    }
+    xor_tail(dst, srcs, nsrc, i, len);
+}
+
+/* The constants come from the caller, which unoptimized builds would
+   otherwise rebuild on every call. */
+__attribute__((target("avx2"), always_inline))
+static inline __m256i mul2_avx2(__m256i v, __m256i zero, __m256i poly) {
+    __m256i top = _mm256_cmpgt_epi8(zero, v);
+    return _mm256_xor_si256(_mm256_add_epi8(v, v), _mm256_and_si256(top, poly));
+}
+
+__attribute__((target("avx2")))
+static void pq_avx2(unsigned char *p, unsigned char *q, const unsigned char *const *srcs,
+                    int nsrc, size_t len) {
+    const __m256i zero = _mm256_setzero_si256(), poly = _mm256_set1_epi8(0x1d);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        const unsigned char *s = srcs[nsrc - 1] + i;
+        __m256i p0 = _mm256_loadu_si256((const __m256i *)(s));
+        __m256i p1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i q0 = p0, q1 = p1;
+        for (int k = nsrc - 2; k >= 0; k--) {
+            s = srcs[k] + i;
+            __m256i d0 = _mm256_loadu_si256((const __m256i *)(s));
+            __m256i d1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+            p0 = _mm256_xor_si256(p0, d0);
+            p1 = _mm256_xor_si256(p1, d1);
+            q0 = _mm256_xor_si256(mul2_avx2(q0, zero, poly), d0);
+            q1 = _mm256_xor_si256(mul2_avx2(q1, zero, poly), d1);
+        }
+        _mm256_storeu_si256((__m256i *)(p + i), p0);
+        _mm256_storeu_si256((__m256i *)(p + i + 32), p1);
+        _mm256_storeu_si256((__m256i *)(q + i), q0);
+        _mm256_storeu_si256((__m256i *)(q + i + 32), q1);
+    }
+    pq_tail(p, q, srcs, nsrc, i, len);
+}
+
+__attribute__((target("avx2")))
+static void gf_sum_avx2(unsigned char *dst, const unsigned char *const *srcs, const uint8_t *coefs,
+                        const uint8_t (*tables)[32], int nsrc, size_t len) {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256();
+        for (int s = 0; s < nsrc; s++) {
+            __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables[s]));
+            __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(tables[s] + 16)));
+            const unsigned char *p = srcs[s] + i;
+            __m256i d0 = _mm256_loadu_si256((const __m256i *)(p));
+            __m256i d1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+            a0 = _mm256_xor_si256(a0, _mm256_shuffle_epi8(lo, _mm256_and_si256(d0, nibble)));
+            a0 = _mm256_xor_si256(a0, _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(d0, 4), nibble)));
+            a1 = _mm256_xor_si256(a1, _mm256_shuffle_epi8(lo, _mm256_and_si256(d1, nibble)));
+            a1 = _mm256_xor_si256(a1, _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(d1, 4), nibble)));
+        }
+        _mm256_storeu_si256((__m256i *)(dst + i), a0);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), a1);
+    }
+    gf_sum_tail(dst, srcs, coefs, nsrc, i, len);
+}
+
+__attribute__((target("avx512f")))
+static void xor_avx512(unsigned char *dst, const unsigned char *const *srcs,
+                       int nsrc, size_t len) {
+    size_t i = 0;
+    for (; i + 256 <= len; i += 256) {
+        const unsigned char *p = srcs[0] + i;
+        __m512i a0 = _mm512_loadu_si512((const void *)(p));
+        __m512i a1 = _mm512_loadu_si512((const void *)(p + 64));
+        __m512i a2 = _mm512_loadu_si512((const void *)(p + 128));
+        __m512i a3 = _mm512_loadu_si512((const void *)(p + 192));
+        for (int s = 1; s < nsrc; s++) {
+            p = srcs[s] + i;
+            a0 = _mm512_xor_si512(a0, _mm512_loadu_si512((const void *)(p)));
+            a1 = _mm512_xor_si512(a1, _mm512_loadu_si512((const void *)(p + 64)));
+            a2 = _mm512_xor_si512(a2, _mm512_loadu_si512((const void *)(p + 128)));
+            a3 = _mm512_xor_si512(a3, _mm512_loadu_si512((const void *)(p + 192)));
+        }
+        _mm512_storeu_si512((void *)(dst + i), a0);
+        _mm512_storeu_si512((void *)(dst + i + 64), a1);
+        _mm512_storeu_si512((void *)(dst + i + 128), a2);
+        _mm512_storeu_si512((void *)(dst + i + 192), a3);
+    }
+    xor_tail(dst, srcs, nsrc, i, len);
+}
+#endif
+
+#ifdef PARITY_NEON
+static void xor_neon(unsigned char *dst, const unsigned char *const *srcs,
+                     int nsrc, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        const unsigned char *p = srcs[0] + i;
+        uint8x16_t a0 = vld1q_u8(p);
+        uint8x16_t a1 = vld1q_u8(p + 16);
+        uint8x16_t a2 = vld1q_u8(p + 32);
+        uint8x16_t a3 = vld1q_u8(p + 48);
+        for (int s = 1; s < nsrc; s++) {
+            p = srcs[s] + i;
+            a0 = veorq_u8(a0, vld1q_u8(p));
+            a1 = veorq_u8(a1, vld1q_u8(p + 16));
+            a2 = veorq_u8(a2, vld1q_u8(p + 32));
+            a3 = veorq_u8(a3, vld1q_u8(p + 48));
+        }
+        vst1q_u8(dst + i, a0);
+        vst1q_u8(dst + i + 16, a1);
+        vst1q_u8(dst + i + 32, a2);
+        vst1q_u8(dst + i + 48, a3);
+    }
+    xor_tail(dst, srcs, nsrc, i, len);
+}
+
+#ifdef __aarch64__
+__attribute__((always_inline))
+static inline uint8x16_t mul2_neon(uint8x16_t v, uint8x16_t poly) {
+    uint8x16_t top = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(v), 7));
+    return veorq_u8(vshlq_n_u8(v, 1), vandq_u8(top, poly));
+}
+
+static void pq_neon(unsigned char *p, unsigned char *q, const unsigned char *const *srcs,
+                    int nsrc, size_t len) {
+    const uint8x16_t poly = vdupq_n_u8(0x1d);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        const unsigned char *s = srcs[nsrc - 1] + i;
+        uint8x16_t p0 = vld1q_u8(s);
+        uint8x16_t p1 = vld1q_u8(s + 16);
+        uint8x16_t q0 = p0, q1 = p1;
+        for (int k = nsrc - 2; k >= 0; k--) {
+            s = srcs[k] + i;
+            uint8x16_t d0 = vld1q_u8(s);
+            uint8x16_t d1 = vld1q_u8(s + 16);
+            p0 = veorq_u8(p0, d0);
+            p1 = veorq_u8(p1, d1);
+            q0 = veorq_u8(mul2_neon(q0, poly), d0);
+            q1 = veorq_u8(mul2_neon(q1, poly), d1);
+        }
+        vst1q_u8(p + i, p0);
+        vst1q_u8(p + i + 16, p1);
+        vst1q_u8(q + i, q0);
+        vst1q_u8(q + i + 16, q1);
+    }
+    pq_tail(p, q, srcs, nsrc, i, len);
+}
+
+static void gf_sum_neon(unsigned char *dst, const unsigned char *const *srcs, const uint8_t *coefs,
+                        const uint8_t (*tables)[32], int nsrc, size_t len) {
+    const uint8x16_t nibble = vdupq_n_u8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint8x16_t a0 = vdupq_n_u8(0), a1 = vdupq_n_u8(0);
+        for (int s = 0; s < nsrc; s++) {
+            uint8x16_t lo = vld1q_u8(tables[s]), hi = vld1q_u8(tables[s] + 16);
+            uint8x16_t d0 = vld1q_u8(srcs[s] + i);
+            uint8x16_t d1 = vld1q_u8(srcs[s] + i + 16);
+            a0 = veorq_u8(a0, vqtbl1q_u8(lo, vandq_u8(d0, nibble)));
+            a0 = veorq_u8(a0, vqtbl1q_u8(hi, vshrq_n_u8(d0, 4)));
+            a1 = veorq_u8(a1, vqtbl1q_u8(lo, vandq_u8(d1, nibble)));
+            a1 = veorq_u8(a1, vqtbl1q_u8(hi, vshrq_n_u8(d1, 4)));
+        }
+        vst1q_u8(dst + i, a0);
+        vst1q_u8(dst + i + 16, a1);
+    }
+    gf_sum_tail(dst, srcs, coefs, nsrc, i, len);
+}
+#endif
+#endif
+
+void parity_init(void) {
+    if (!gf_log_table[2])
+        gf_init();
+    xor_kernel = xor_scalar;
+    xor_name = "scalar";
+    pq_kernel = pq_scalar;
+    gf_sum_kernel = gf_sum_scalar;
+    gf_name = "scalar";
+#ifdef PARITY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        xor_kernel = xor_avx512;
+        xor_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        xor_kernel = xor_avx2;
+        xor_name = "avx2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        pq_kernel = pq_avx2;
+        gf_sum_kernel = gf_sum_avx2;
+        gf_name = "avx2";
+    }
+#endif
+#ifdef PARITY_NEON
+    xor_kernel = xor_neon;
+    xor_name = "neon";
+#ifdef __aarch64__
+    pq_kernel = pq_neon;
+    gf_sum_kernel = gf_sum_neon;
+    gf_name = "neon";
+#endif
+#endif
+}
+
+const char *parity_impl(void) {
+    return xor_name;
+}
+
+const char *parity_gf_impl(void) {
+    return gf_name;
+}
+
+uint8_t parity_gf_exp(int i) {
+    if (!pq_kernel)
+        parity_init();
+    return gf_exp_table[(i % 255 + 255) % 255];
+}
+
+void parity_xor(void *dst, const void *const *srcs, int nsrc, size_t len) {
+    if (!xor_kernel)
+        parity_init();
+    xor_kernel(dst, (const unsigned char *const *)srcs, nsrc, len);
+}
+
+void parity_pq(void *p, void *q, const void *const *srcs, int nsrc, size_t len) {
+    if (!pq_kernel)
+        parity_init();
+    pq_kernel(p, q, (const unsigned char *const *)srcs, nsrc, len);
+}
+
+void parity_gf_sum(void *dst, const void *const *srcs, const uint8_t *coefs, int nsrc, size_t len) {
+    const unsigned char *s[nsrc > 0 ? nsrc : 1];
+    uint8_t c[nsrc > 0 ? nsrc : 1], tables[nsrc > 0 ? nsrc : 1][32];
+    bool xor_only = true;
+    int n = 0;
+
+    if (!gf_sum_kernel)
+        parity_init();
+    for (int i = 0; i < nsrc; i++) {
+        if (coefs[i] == 0)
+            continue;
+        xor_only &= coefs[i] == 1;
+        s[n] = srcs[i];
+        c[n++] = coefs[i];
+    }
+    if (n == 0) {
+        memset(dst, 0, len);
+        return;
+    }
+    if (xor_only) {
+        xor_kernel(dst, s, n, len);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int x = 0; x < 16; x++) {
+            tables[i][x] = gf_mul(c[i], x);
+            tables[i][16 + x] = gf_mul(c[i], x << 4);
+        }
+    }
+    gf_sum_kernel(dst, s, c, (const uint8_t (*)[32])tables, n, len);
+}
+
+/* Every case solves P = sum D_i and Q = sum g^i D_i for the target after
+   moving the known blocks to one side. With data block y lost as well,
+   the target's equation is combined with the one for D_y first:
+     D_x = (g^y Pxy + Qxy) / (g^x + g^y) where Pxy and Qxy are P and Q
+     plus the sums over the other data blocks,
+     P = sum D_i (i != y) + g^-y (Q + sum g^i D_i (i != y)),
+     Q = sum g^i D_i (i != y) + g^y (P + sum D_i (i != y)). */
+int parity_recover_coefs(int ndata, int nparity, int target, int lost, uint8_t *coefs) {
+    int p = ndata, q = ndata + 1;
+
+    memset(coefs, 0, ndata + nparity);
+    if (lost == target)
+        lost = -1;
+    if (nparity == 1 || lost == -1 || (target < ndata && lost == q) || (target == p && lost == q)) {
+        /* plain XOR parity: everything but Q */
+        if (target == q) {
+            for (int i = 0; i < ndata; i++)
+                coefs[i] = parity_gf_exp(i);
+            return 0;
+        }
+        if (nparity == 1 && lost != -1)
+            return -1;
+        for (int i = 0; i <= p; i++)
+            coefs[i] = i != target;
+        return 0;
+    }
+    if (target == q) {
+        if (lost == p) {
+            for (int i = 0; i < ndata; i++)
+                coefs[i] = parity_gf_exp(i);
+            return 0;
+        }
+        uint8_t gy = parity_gf_exp(lost);
+        for (int i = 0; i < ndata; i++)
+            coefs[i] = i == lost ? 0 : parity_gf_exp(i) ^ gy;
+        coefs[p] = gy;
+        return 0;
+    }
+    if (target == p) {
+        for (int i = 0; i < ndata; i++)
+            coefs[i] = i == lost ? 0 : 1 ^ parity_gf_exp(i - lost);
+        coefs[q] = parity_gf_exp(-lost);
+        return 0;
+    }
+    if (lost == p) {
+        for (int i = 0; i < ndata; i++)
+            coefs[i] = i == target ? 0 : parity_gf_exp(i - target);
+        coefs[q] = parity_gf_exp(-target);
+        return 0;
+    }
+    uint8_t denom = parity_gf_exp(target) ^ parity_gf_exp(lost);
+    uint8_t a = gf_div(parity_gf_exp(lost), denom), b = gf_div(1, denom);
+    for (int i = 0; i < ndata; i++)
+        coefs[i] = (i == target || i == lost) ? 0 : a ^ gf_mul(b, parity_gf_exp(i));
+    coefs[p] = a;
+    coefs[q] = b;
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef PARITY_H_INCLUDED
+#define PARITY_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pick the fastest XOR and GF kernels this CPU supports. Call once
+   before any other parity function; calling it again is harmless. */
+void parity_init(void);
+
+/* Name of the kernel picked by parity_init(), for log messages. */
+const char *parity_impl(void);
+
+/* dst = srcs[0] ^ srcs[1] ^ ... ^ srcs[nsrc - 1] over len bytes, in a single
+   pass over the sources. dst is only written, never read, so it may also
+   be one of the sources. nsrc must be at least 1. */
+void parity_xor(void *dst, const void *const *srcs, int nsrc, size_t len);
+
+/* RAID6 arithmetic is in GF(2^8) with the polynomial
+   x^8 + x^4 + x^3 + x^2 + 1 and generator g = 2, as in md, so that the
+   Q syndrome of blocks D_0..D_{n-1} is the sum of g^i * D_i. */
+
+/* Name of the GF kernel picked by parity_init(). */
+const char *parity_gf_impl(void);
+
+/* g^i for any i, negative ones included. */
+uint8_t parity_gf_exp(int i);
+
+/* Both RAID6 syndromes of the data blocks srcs[0..nsrc-1] in one pass:
+   p is their XOR and q the sum of g^i * srcs[i]. p and q are only
+   written. */
+void parity_pq(void *p, void *q, const void *const *srcs, int nsrc, size_t len);
+
+/* dst = coefs[0] * srcs[0] + ... + coefs[nsrc - 1] * srcs[nsrc - 1] in
+   GF(2^8), over len bytes and in a single pass as parity_xor(), which
+   is what it falls back to when every coefficient is 1. */
+void parity_gf_sum(void *dst, const void *const *srcs, const uint8_t *coefs, int nsrc, size_t len);
+
+/* How to compute one block of a stripe of ndata data blocks and nparity
+   (1 or 2) syndromes from its other blocks. Blocks are numbered by role:
+   0..ndata-1 are the data blocks in order, ndata is P and ndata+1 is Q.
+   Fills coefs[0..ndata+nparity-1] so that block `target` is the
+   parity_gf_sum() of the others with these coefficients, without using
+   block `lost` (-1 if every other block is available); unneeded blocks
+   get 0. Returns -1 when `lost` makes it impossible. */
+int parity_recover_coefs(int ndata, int nparity, int target, int lost, uint8_t *coefs);
+
+#endif /* PARITY_H_INCLUDED */
@@ -12,71 +12,420 @@
  #include <sys/stat.h>
  #include <fcntl.h>
  #include <unistd.h>
+ #include <pthread.h>
+ #include <time.h>
  
  #include "buse.h"
+ #include "parity.h"
+ #include "raid_io.h"
+ #include "stripe_cache.h"
+ #include "bitmap.h"
+ #include "extent_map.h"
+ #include "layout.h"
+ #include "superblock.h"
  
  #define MAX_DEVICES 16
+ #define BATCH_DATA_BYTES (1024 * 1024)   /* logical bytes per member I/O batch */
+ #define REBUILD_BATCH_BYTES (4 * 1024 * 1024)   /* bytes per member and rebuild batch */
+ #define MAX_REBUILD_THREADS 16
+ #define FG_IDLE_NS (50 * 1000000LL)      /* foreground counts as busy this long after a request */
+ #define FG_PRIORITY_NS (10 * 1000000LL)  /* longest a rebuild batch steps back for queued requests */
+ #define MAX_UNMAPPED_EXTENTS 65536       /* runs of discarded stripes remembered */
+ #define RECON_CACHE_BYTES (4 * 1024 * 1024)   /* default reconstruction cache of a degraded array */
+ #define CHECKPOINT_NS (2 * 1000000000LL)  /* between rebuild checkpoints in the superblock */
+ #define RESHAPE_BATCH_BYTES (4 * 1024 * 1024)  /* array bytes restriped per reshape batch */
+ #define ROW_LOCKS 64                     /* chunk row locks of concurrent requests */
+ #define MAX_WORKERS 64
+ #define CACHE_LINE 64
+ #define READ_STREAMS 8                   /* sequential read streams followed at once */
+ #define READ_STREAM_SLACK (256 * 1024)   /* how far out of order a stream's reads may arrive */
+ #define HEDGE_PROBE 16                   /* every this many hedged reads of a slow member still go to it */
  #define UNUSED(x) (void)(x)
  
  
  int dev_fd[MAX_DEVICES];         
  bool dev_missing[MAX_DEVICES];   
  int num_devices = 0;             
+ int nparity = 1;                 /* parity blocks per stripe: 1 for RAID5, 2 for RAID6 */
+ int data_disks;                  /* num_devices - nparity */
  int rebuild_dev = -1;            
  int block_size;                  
+ uint32_t chunk_size;             /* bytes of a member per chunk row */
+ struct layout layout;
+ uint64_t chunk_row_size;         /* data bytes of a chunk row */
  uint64_t raid_device_size;       
  bool verbose = false;           
+ int batch_rows;                  /* chunk rows handled per member I/O batch */
+ int batch_stripes;               /* the stripes they span */
+ unsigned char *scratch_arena;    /* the scratches, sink_block and zero_block */
+ unsigned char *sink_block;       /* target of reads that are thrown away */
+ pthread_rwlock_t array_lock;     /* shared by concurrent requests, else one request or batch at a time */
+ pthread_rwlock_t row_locks[ROW_LOCKS];   /* chunk row r is guarded by row_locks[r % ROW_LOCKS] */
+ bool concurrent_requests;        /* whether requests may hold array_lock shared */
+ bool concurrent_after_rebuild;   /* whether they may once the rebuild is complete */
+ pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;     /* the write-intent bitmap */
+ pthread_mutex_t unmapped_lock = PTHREAD_MUTEX_INITIALIZER;   /* and the unmapped stripes */
+ uint64_t rebuild_watermark;      /* stripes below it are rebuilt */
+ bool rebuild_stop;
+ pthread_t rebuild_thread;
+ int rebuild_threads;             /* threads sharing the rebuild XOR */
+ uint64_t rebuild_stripes;        /* stripes per rebuild batch */
+ unsigned char *rebuild_buf;      /* rebuild_stripes blocks of each member */
+ uint64_t rebuild_rate;           /* rebuilt bytes/s guaranteed under load, 0 for none */
+ int rebuild_share;               /* or the guaranteed percentage of time */
+ enum scrub_mode { SCRUB_NONE, SCRUB_CHECK, SCRUB_REPAIR } scrub_mode;
+ pthread_t scrub_thread;
+ uint64_t scrub_pos;              /* stripes below it are checked */
+ uint64_t scrub_mismatches;       /* stripes whose parity did not match their data */
+ unsigned char *scrub_buf;        /* nparity rebuild batches of syndromes */
+ pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+ pthread_cond_t sched_cond;       /* request ends and rebuild_stop, on CLOCK_MONOTONIC */
+ int fg_pending;                  /* requests waiting for or holding array_lock */
+ int64_t fg_last_ns;              /* when the last request ended */
+ struct stripe_cache cache;
+ struct stripe_cache recon_cache;  /* clean stripes of a degraded array, as the members have them */
+ struct intent_bitmap bitmap;
+ struct extent_map unmapped;      /* stripes discarded on every member, which read as zeros */
+ unsigned char *zero_block;
+ bool can_discard = true;         /* cleared when the members cannot punch holes */
+ struct superblock sb;            /* as last written, when have_superblock */
+ bool have_superblock;
+ uint64_t data_stripes;           /* stripes of every member that hold data */
+
+/* What changes with the member count. A reshape keeps the geometry it
+   comes from and the one it goes to, and loads the one of the data at
+   hand into the globals above while holding array_lock; otherwise they
+   hold the new one. */
+ struct geometry {
+     int num_devices;
+     int data_disks;
+     struct layout layout;
+     uint64_t chunk_row_size;
+     int batch_rows;
+     int batch_stripes;
+ };
+ struct geometry old_geometry, new_geometry;
+ bool reshaping;
+ uint64_t reshape_rows;           /* chunk rows of the array in the new geometry */
+ uint64_t reshape_safe;           /* as many as the superblock knows of */
+ bool reshape_backup;             /* the first rows are in the backup area */
+ uint64_t reshape_pos;            /* array bytes in the new geometry */
+ pthread_t reshape_thread;
+ unsigned char *reshape_buf;      /* the first rows, or a batch of them */
  
 /* RAID5 Logical Mapping Explanation:
    Given total devices n = num_devices.
-   Each stripe physically contains n blocks (one per disk), 
-   with the parity block at position P = stripe % n.
+   Each stripe physically contains n blocks (one per disk) at the same
+   offset stripe * block_size, one of them the parity of the others.
    The RAID logical device exposes only data blocks, meaning each stripe has n–1 data blocks.
-   For logical block number L (L = offset / block_size), compute:
+   Their order is that of chunks: the logical device is cut into chunks
+   of chunk_size bytes, which go to the members n-1 at a time, one chunk
+   row after the other, with the parity chunk of every row on another
+   member (see layout.h). With the default layout and chunk_size equal
+   to block_size, for logical block number L (L = offset / block_size):
       stripe = L / (n – 1)
       pos    = L % (n – 1)
-   Data disk index D = (pos >= P) ? pos + 1 : pos
-   Physical offset is stripe * block_size.
+   Data disk index D = (pos >= P) ? pos + 1 : pos, with P = stripe % n.
+   RAID6 (--level=6) has n-2 data blocks per stripe and a second
+   syndrome Q, on the member after P, computed with GF(2^8) arithmetic
+   (see parity.h); any two missing members can be rebuilt.
  */
  
+/* How write_stripes() updates the parity of a stripe. */
+ enum write_mode {
+     WRITE_FULL,
+     WRITE_RCW,
+     WRITE_RMW,
+     WRITE_RECOVER,      /* RAID6: rebuild a lost old block, then write in full */
+     WRITE_DATA_ONLY,    /* every parity member is missing */
+     WRITE_FAILED,
+ };
+
+/* One stripe of a write: the new contents of the members being written
+   and, as far as known, the unchanged contents of the others. */
+ struct stripe_write {
+     uint64_t stripe;
+     const unsigned char *new_data[MAX_DEVICES];
+     const unsigned char *cur_data[MAX_DEVICES];
+     enum write_mode mode;       /* chosen by write_stripes() */
+     int recover_disk;           /* the unknown missing block of a recover-write */
+ };
+
+ uint64_t write_mode_count[WRITE_FAILED]; /* stripes written per mode */
+
+/* What a request works in: batch_stripes * num_devices blocks of member
+   scratch, the per-stripe and per-block state of a batch and the member
+   I/O plan. Whoever holds array_lock exclusively uses scratches[0];
+   requests that share it each have one of their own. All of them are
+   carved out of one arena at startup, each starting on a page of its
+   own, so nothing that grows with the block size or the batch lives on
+   a thread's stack. */
+ struct scratch {
+     unsigned char *stripe_buf;
+     struct stripe_write *stripe_writes;      /* batch_stripes writes for write_batch */
+     struct stripe_write *cache_writes;       /* batch_stripes writes for cache writeback */
+     uint32_t *written;                       /* data positions written, per stripe of write_batch */
+     struct stripe_cache_entry **pinned;      /* cache entries write_batch holds */
+     bool *rebuild;                           /* blocks read_batch reconstructs */
+     struct raid_io_plan io_plan;
+ };
+ struct scratch scratches[MAX_WORKERS + 2];
+ int nscratches;
+ int scratches_claimed = 1;
+ __thread struct scratch *scratch;        /* of the lock the thread holds */
+ __thread struct scratch *own_scratch;    /* of the thread, for shared requests */
+ uint64_t degraded_blocks;        /* blocks read back through parity */
+ double hedge_factor;             /* how much slower than its peers a member is avoided, or 0 */
+ uint64_t hedge_min_ns = 1000000; /* expected latency below which nothing is avoided */
+ uint32_t hedge_max_len = 65536;  /* largest read that avoids a slow member */
+ uint32_t hedge_count[MAX_DEVICES];       /* reads that found each member slow */
+ uint64_t hedged_blocks;          /* blocks reconstructed around a slow member */
+ struct read_stream {
+     uint64_t next;              /* end of its furthest read */
+     uint64_t ahead;             /* end of what the members were asked to fetch */
+     uint64_t reads;
+     uint64_t used;              /* readahead_clock at its last read */
+ };
+ struct read_stream streams[READ_STREAMS];
+ pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER; /* the streams */
+ uint64_t readahead_clock;
+ uint64_t readahead_bytes;        /* how far ahead of a stream the members fetch, or 0 */
+ uint64_t readahead_streams;      /* streams detected */
+ uint64_t readahead_issued;       /* array bytes the members were asked to fetch */
 
  struct arguments {
      uint32_t block_size;
+     uint32_t chunk_size;
+     enum layout_algorithm layout;
+     int level;
      char *raid_device;
      char *devices[MAX_DEVICES];
      int num_devices;
      int verbose;
+     enum raid_io_engine io_engine;
+     size_t cache_size;
+     size_t recon_cache_size;
+     int recon_cache_set;
+     int rebuild_threads;
+     uint64_t rebuild_rate;
+     int rebuild_share;
+     int bitmap;
+     int splice;
+     char *stats_socket;
+     uint32_t stats_interval;
+     int superblock;
+     int assemble;
+     char *grow;
+     enum scrub_mode scrub;
+     int workers;
+     double hedge_factor;
+     uint64_t hedge_min_us;
+     uint64_t hedge_max_len;
+     uint64_t read_ahead;
+     char *args[MAX_DEVICES + 2];
+     int nargs;
  };
  
  static struct argp_option options[] = {
      {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+     {"io-engine", 'e', "ENGINE", 0, "Member I/O engine: sync, threads (default) to drive all members of a stripe at once, or uring", 0},
+     {"rebuild-rate", 'r', "RATE", 0, "Rebuild at least RATE bytes/s (K, M, G suffixes) or RATE percent of the time (e.g. 30%) while clients do I/O, and only use idle time beyond that (default: no limit)", 0},
+     {"rebuild-threads", 't', "N", 0, "XOR threads for a rebuild (default: number of CPUs, at most 4)", 0},
+     {"bitmap", 'b', 0, 0, "Keep a write-intent bitmap in the last blocks of every member, so that after a crash only recently written regions are resynced", 0},
+     {"splice", 's', 0, 0, "Splice reads of a healthy array from the members to the NBD socket instead of copying them through user space; pays off with large block sizes", 0},
+     {"stats-socket", 'S', "PATH", 0, "Serve request, stripe and per-device statistics to whoever connects to the unix socket PATH", 0},
+     {"stats-interval", 'i', "SECS", 0, "Print the statistics to stderr every SECS seconds", 0},
+     {"chunk-size", 'C', "SIZE", 0, "Bytes of every member per chunk row (K, M suffixes), a multiple of BLOCKSIZE (default BLOCKSIZE); larger chunks keep sequential I/O on fewer members at a time", 0},
+     {"layout", 'l', "LAYOUT", 0, "Parity rotation as in md: left-asymmetric, right-asymmetric (default), left-symmetric or right-symmetric", 0},
+     {"level", 'L', "LEVEL", 0, "5 (default) for one parity block per stripe, or 6 for P and Q, which survive two missing members", 0},
+     {"cache-size", 'c', "MIB", 0, "Keep up to MIB MiB of stripes in a write-back cache (default 0, no cache); partial writes are merged there until the stripe is full or flushed", 0},
+     {"recon-cache", 'R', "MIB", 0, "Keep up to MIB MiB of stripes reconstructed by degraded reads, so that their other blocks need no member I/O (default: two chunk rows, at least 4 MiB; 0 disables it)", 0},
+     {"superblock", 'm', 0, 0, "Record the array's geometry and the state of its members in a superblock at the end of every member, which takes the last 4 KiB-aligned 4 KiB; members that have one always keep it up to date", 0},
+     {"assemble", 'A', 0, 0, "Start the array that the superblocks of the given DEVICEs describe, in any order; the geometry options and BLOCKSIZE are not given then", 0},
+     {"workers", 'w', "N", 0, "Serve up to N requests at once (default 1); requests to different chunk rows then run in parallel, unless the stripe cache, a reconstruction cache or a reshape needs them one at a time", 0},
+     {"scrub", 'p', "MODE", 0, "Check in the background that the parity of every stripe matches its data, throttled like a rebuild: check only counts mismatches, repair also rewrites the parity from the data", 0},
+     {"hedge-reads", 'H', "FACTOR", 0, "Reconstruct small reads of a member from parity and its peers instead when its expected latency, the smoothed latency of its small reads times the operations queued on it, is FACTOR times that of every peer (e.g. 4; default off)", 0},
+     {"hedge-min", 'u', "USEC", 0, "Only avoid a member expected to take at least USEC microseconds (default 1000)", 0},
+     {"hedge-max", 'x', "SIZE", 0, "Only avoid slow members for reads of up to SIZE bytes (K, M suffixes; default 64K)", 0},
+     {"read-ahead", 'a', "SIZE", 0, "Once reads turn out to be sequential, have the members fetch the next SIZE bytes of the array (K, M suffixes) into their page cache in the background, in large contiguous extents (default 0, off)", 0},
+     {"grow", 'G', "DEVICE", 0, "Add DEVICE as one more member and restripe the array onto it in the background while it serves requests; needs a superblock, and the array has its new size once restarted", 0},
      {0},
  };
  
+/* Parse "64K" style sizes. */
+ static int parse_size(const char *arg, uint64_t *size) {
+     char *end;
+     uint64_t v = strtoull(arg, &end, 10);
+     if (end == arg || v == 0)
+         return -1;
+     switch (*end) {
+         case 'G': case 'g': v <<= 10; /* fall through */
+         case 'M': case 'm': v <<= 10; /* fall through */
+         case 'K': case 'k': v <<= 10; end++; break;
+     }
+     if (*end != '\0')
+         return -1;
+     *size = v;
+     return 0;
+ }
+
+/* Parse a whole number of MiB, 0 included, into bytes. */
+ static int parse_mib(const char *arg, size_t *bytes) {
+     char *end;
+     unsigned long long v = strtoull(arg, &end, 10);
+     if (end == arg || *end != '\0' || arg[0] == '-' || v > (SIZE_MAX >> 20))
+         return -1;
+     *bytes = (size_t)v << 20;
+     return 0;
+ }
+
+/* Parse "200M" style byte rates and "30%" style shares. */
+ static int parse_rate(const char *arg, uint64_t *rate, int *share) {
+     char *end;
+     uint64_t v = strtoull(arg, &end, 10);
+     if (end == arg || v == 0)
+         return -1;
+     if (strcmp(end, "%") == 0) {
+         if (v > 100)
+             return -1;
+         *share = v;
+         *rate = 0;
+         return 0;
+     }
+     if (parse_size(arg, rate) != 0)
+         return -1;
+     *share = 0;
+     return 0;
+ }
+
  static error_t parse_opt (int key, char *arg, struct argp_state *state) {
      struct arguments *arguments = state->input;
      switch (key) {
          case 'v':
              arguments->verbose = 1;
              break;
+         case 'e':
+             if (raid_io_parse_engine(arg, &arguments->io_engine) != 0)
+                 argp_error(state, "unknown I/O engine '%s'", arg);
+             break;
+         case 'r':
+             if (parse_rate(arg, &arguments->rebuild_rate, &arguments->rebuild_share) != 0)
+                 argp_error(state, "invalid rebuild rate '%s'", arg);
+             break;
+         case 't':
+             arguments->rebuild_threads = atoi(arg);
+             if (arguments->rebuild_threads < 1 || arguments->rebuild_threads > MAX_REBUILD_THREADS)
+                 argp_error(state, "rebuild threads must be between 1 and %d", MAX_REBUILD_THREADS);
+             break;
+         case 'b':
+             arguments->bitmap = 1;
+             break;
+         case 's':
+             arguments->splice = 1;
+             break;
+         case 'c':
+             if (parse_mib(arg, &arguments->cache_size) != 0)
+                 argp_error(state, "invalid cache size '%s'", arg);
+             break;
+         case 'R':
+             if (parse_mib(arg, &arguments->recon_cache_size) != 0)
+                 argp_error(state, "invalid reconstruction cache size '%s'", arg);
+             arguments->recon_cache_set = 1;
+             break;
+         case 'C': {
+             uint64_t size;
+             if (parse_size(arg, &size) != 0 || size > UINT32_MAX)
+                 argp_error(state, "invalid chunk size '%s'", arg);
+             arguments->chunk_size = size;
+             break;
+         }
+         case 'l':
+             if (layout_parse(arg, &arguments->layout) != 0)
+                 argp_error(state, "unknown layout '%s'", arg);
+             break;
+         case 'L':
+             arguments->level = atoi(arg);
+             if (arguments->level != 5 && arguments->level != 6)
+                 argp_error(state, "the level must be 5 or 6");
+             break;
+         case 'S':
+             arguments->stats_socket = arg;
+             break;
+         case 'i': {
+             char *end;
+             unsigned long long secs = strtoull(arg, &end, 10);
+             if (end == arg || *end != '\0' || arg[0] == '-' || secs > UINT32_MAX)
+                 argp_error(state, "invalid statistics interval '%s'", arg);
+             arguments->stats_interval = secs;
+             break;
+         }
+         case 'm':
+             arguments->superblock = 1;
+             break;
+         case 'A':
+             arguments->assemble = 1;
+             break;
+         case 'G':
+             arguments->grow = arg;
+             break;
+         case 'w':
+             arguments->workers = atoi(arg);
+             if (arguments->workers < 1 || arguments->workers > MAX_WORKERS)
+                 argp_error(state, "workers must be between 1 and %d", MAX_WORKERS);
+             break;
+         case 'H': {
+             char *end;
+             arguments->hedge_factor = strtod(arg, &end);
+             if (end == arg || *end != '\0' || !(arguments->hedge_factor > 1))
+                 argp_error(state, "the hedge factor must be a number above 1");
+             break;
+         }
+         case 'u': {
+             char *end;
+             arguments->hedge_min_us = strtoull(arg, &end, 10);
+             if (end == arg || *end != '\0')
+                 argp_error(state, "invalid hedge latency '%s'", arg);
+             break;
+         }
+         case 'x':
+             if (parse_size(arg, &arguments->hedge_max_len) != 0 || arguments->hedge_max_len > UINT32_MAX)
+                 argp_error(state, "invalid hedge size '%s'", arg);
+             break;
+         case 'a':
+             if (parse_size(arg, &arguments->read_ahead) != 0)
+                 argp_error(state, "invalid read-ahead size '%s'", arg);
+             break;
+         case 'p':
+             if (strcmp(arg, "check") == 0)
+                 arguments->scrub = SCRUB_CHECK;
+             else if (strcmp(arg, "repair") == 0)
+                 arguments->scrub = SCRUB_REPAIR;
+             else
+                 argp_error(state, "the scrub mode must be check or repair");
+             break;
          case ARGP_KEY_ARG:
-             if (state->arg_num == 0) {
-                 arguments->block_size = strtoul(arg, NULL, 10);
-             } else if (state->arg_num == 1) {
-                 arguments->raid_device = arg;
-             } else {
-                 if (arguments->num_devices >= MAX_DEVICES) {
-                     errx(EXIT_FAILURE, "At most %d devices", MAX_DEVICES);
-                 }
-                 arguments->devices[arguments->num_devices++] = arg;
+             if (arguments->nargs >= MAX_DEVICES + 2) {
+                 errx(EXIT_FAILURE, "At most %d devices", MAX_DEVICES);
              }
+             arguments->args[arguments->nargs++] = arg;
              break;
-         case ARGP_KEY_END:
-             if (state->arg_num < 3) {
+         case ARGP_KEY_END: {
+             /* --assemble goes without BLOCKSIZE */
+             int first = arguments->assemble ? 0 : 1;
+             if (arguments->nargs < first + 2) {
                  // at least：BLOCKSIZE, RAIDDEVICE, DEVICE1（at least 3）
                  argp_usage(state);
              }
+             if (!arguments->assemble)
+                 arguments->block_size = strtoul(arguments->args[0], NULL, 10);
+             arguments->raid_device = arguments->args[first];
+             for (int i = first + 1; i < arguments->nargs; i++) {
+                 if (arguments->num_devices >= MAX_DEVICES)
+                     errx(EXIT_FAILURE, "At most %d devices", MAX_DEVICES);
+                 arguments->devices[arguments->num_devices++] = arguments->args[i];
+             }
              break;
+         }
          default:
              return ARGP_ERR_UNKNOWN;
      }
@@ -86,11 +435,309 @@
  static struct argp argp = {
      .options  = options,
      .parser   = parse_opt,
-     .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 [DEVICE2 ... DEVICE16]",
+     .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 [DEVICE2 ... DEVICE16]\n--assemble RAIDDEVICE DEVICE1 [DEVICE2 ... DEVICE16]",
      .doc = "BUSE implementation of RAID5 with distributed parity. The logical device contains only data blocks, with each stripe having (n-1) data blocks,"
-            "The parity block is rotated across the n disks."
+            "The parity block is rotated across the n disks. With --level=6 every stripe has two parity blocks, P and Q, and n-2 data blocks."
  };
  
+/* Work out the geometry of an array of `ndisks` members. */
+ static void set_geometry(struct geometry *g, int ndisks, enum layout_algorithm algorithm) {
+     g->num_devices = ndisks;
+     g->data_disks = ndisks - nparity;
+     layout_init(&g->layout, ndisks, nparity, chunk_size / block_size, algorithm);
+     g->chunk_row_size = (uint64_t)g->data_disks * chunk_size;
+     g->batch_rows = BATCH_DATA_BYTES / g->chunk_row_size;
+     if (g->batch_rows < 1)
+         g->batch_rows = 1;
+     g->batch_stripes = g->batch_rows * g->layout.chunk_blocks.d;
+ }
+
+ static void use_geometry(const struct geometry *g) {
+     num_devices = g->num_devices;
+     data_disks = g->data_disks;
+     layout = g->layout;
+     chunk_row_size = g->chunk_row_size;
+     batch_rows = g->batch_rows;
+     batch_stripes = g->batch_stripes;
+ }
+
+/* During a reshape, load the geometry that the array data at `offset`
+   is in and return where it ends. */
+ static uint64_t select_geometry(uint64_t offset) {
+     if (!reshaping)
+         return UINT64_MAX;
+     if (offset < reshape_pos) {
+         use_geometry(&new_geometry);
+         return reshape_pos;
+     }
+     use_geometry(&old_geometry);
+     return UINT64_MAX;
+ }
+
+/* Map logical block L to its stripe and to the disks holding it and the
+   stripe's parity. */
+ static void map_block(uint64_t logical_block, uint64_t *stripe, int *parity_disk, int *data_disk) {
+     int pos;
+     layout_map(&layout, logical_block, stripe, &pos);
+     const struct layout_rotation *r = layout_rotation(&layout, *stripe);
+     *parity_disk = r->parity;
+     *data_disk = r->disk[pos];
+ }
+
+/* First stripe of the chunk row holding byte `offset` of the array. */
+ static uint64_t row_first_stripe(uint64_t offset) {
+     return offset / chunk_row_size * layout.chunk_blocks.d;
+ }
+
+/* Scratch block of `disk` for the k-th stripe of the current batch. */
+ static unsigned char *stripe_slot(uint64_t k, int disk) {
+     return scratch->stripe_buf + (k * num_devices + disk) * block_size;
+ }
+
+/* Print the operations of ios[0..n-1] that failed. */
+ static void report_failed(const char *what, const struct raid_io *ios, int n) {
+     for (int i = 0; i < n; i++) {
+         if (ios[i].result != (ssize_t)ios[i].len)
+             fprintf(stderr, "%s (device %d): %s\n", what, ios[i].disk,
+                     ios[i].result < 0 ? strerror(-ios[i].result) : "short transfer");
+     }
+ }
+
+/* Run the queued member operations; `what` names them in error messages. */
+ static int submit_plan(const char *what) {
+     if (raid_io_plan_submit(&scratch->io_plan, sink_block, block_size) == 0)
+         return 0;
+     report_failed(what, scratch->io_plan.ios, scratch->io_plan.nios);
+     return -1;
+ }
+
+/* Whether the block of member `disk` in `stripe` cannot be used: the
+   member is missing, or it is being rebuilt and the rebuild has not got
+   that far yet. Call with array_lock held. */
+ static bool member_missing(int disk, uint64_t stripe) {
+     return dev_missing[disk] || (disk == rebuild_dev && stripe >= rebuild_watermark);
+ }
+
+/* How one block of a stripe is computed from the others: the members
+   to read and their GF coefficients, for parity_gf_sum(). */
+ struct recovery {
+     int nsrc;
+     int disk[MAX_DEVICES];
+     uint8_t coef[MAX_DEVICES];
+ };
+
+/* Plan the reconstruction of member `target`'s block of `stripe` from
+   the members that are not missing. Returns -1 when too many are. */
+ static int plan_recovery(uint64_t stripe, int target, struct recovery *rc) {
+     const struct layout_rotation *r = layout_rotation(&layout, stripe);
+     uint8_t coefs[MAX_DEVICES];
+     int lost = -1;
+     memset(rc, 0, sizeof(*rc));     /* rebuild_main() compares plans */
+     for (int d = 0; d < num_devices; d++) {
+         if (d == target || !member_missing(d, stripe))
+             continue;
+         if (lost != -1)
+             return -1;
+         lost = r->pos[d];
+     }
+     if (parity_recover_coefs(data_disks, nparity, r->pos[target], lost, coefs) != 0)
+         return -1;
+     rc->nsrc = 0;
+     for (int d = 0; d < num_devices; d++) {
+         if (d != target && coefs[r->pos[d]]) {
+             rc->disk[rc->nsrc] = d;
+             rc->coef[rc->nsrc++] = coefs[r->pos[d]];
+         }
+     }
+     return 0;
+ }
+
+static int64_t now_ns(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+ }
+
+/* Hold array_lock exclusively, as every background batch does. */
+ static void exclusive_begin(void) {
+     pthread_rwlock_wrlock(&array_lock);
+     scratch = &scratches[0];
+ }
+
+ static void exclusive_end(void) {
+     pthread_rwlock_unlock(&array_lock);
+ }
+
+/* The chunk rows a request locks, and how. */
+ struct request_locks {
+     bool exclusive;
+     bool write;
+     uint64_t first_row, nrows;
+ };
+
+/* Take or release the row locks of rl, in the order of the lock table
+   so that requests never wait for each other in a circle. */
+ static void lock_rows(const struct request_locks *rl, bool lock) {
+     for (uint64_t i = 0; i < ROW_LOCKS; i++) {
+         if ((i + ROW_LOCKS - rl->first_row % ROW_LOCKS) % ROW_LOCKS >= rl->nrows)
+             continue;
+         if (!lock)
+             pthread_rwlock_unlock(&row_locks[i]);
+         else if (rl->write)
+             pthread_rwlock_wrlock(&row_locks[i]);
+         else
+             pthread_rwlock_rdlock(&row_locks[i]);
+     }
+ }
+
+/* Take and release array_lock for a request to [offset, offset + len),
+   keeping the rebuild scheduler informed about foreground load.
+
+   With concurrent_requests, requests hold array_lock shared, and the
+   locks of the chunk rows they touch: shared for reads, exclusive for
+   writes and discards, so that requests on different rows run at once
+   while two writes to a stripe, or a degraded read and a write, never
+   see each other's half-updated parity. Otherwise, and while a reshape
+   moves the data between geometries, a request holds array_lock
+   exclusively as background batches do. The state of the array - the
+   rebuild watermark, the reshape position, whether a reshape runs - only
+   changes under the exclusive lock, so a request sees it as it was when
+   the request started. */
+ static void request_begin(struct request_locks *rl, uint64_t offset, uint64_t len, bool write) {
+     pthread_mutex_lock(&sched_lock);
+     fg_pending++;
+     pthread_mutex_unlock(&sched_lock);
+     bool concurrent = __atomic_load_n(&concurrent_requests, __ATOMIC_RELAXED);
+     if (concurrent && !own_scratch) {
+         int i = __atomic_fetch_add(&scratches_claimed, 1, __ATOMIC_RELAXED);
+         own_scratch = i < nscratches ? &scratches[i] : &scratches[0];
+     }
+     rl->exclusive = !concurrent || own_scratch == &scratches[0] ||
+                     __atomic_load_n(&reshaping, __ATOMIC_RELAXED);
+     if (rl->exclusive) {
+         exclusive_begin();
+         return;
+     }
+     pthread_rwlock_rdlock(&array_lock);
+     scratch = own_scratch;
+     rl->write = write;
+     rl->first_row = offset / chunk_row_size;
+     rl->nrows = len ? (offset + len - 1) / chunk_row_size - rl->first_row + 1 : 0;
+     lock_rows(rl, true);
+ }
+
+ static void request_end(const struct request_locks *rl) {
+     if (!rl->exclusive)
+         lock_rows(rl, false);
+     pthread_rwlock_unlock(&array_lock);
+     pthread_mutex_lock(&sched_lock);
+     fg_pending--;
+     fg_last_ns = now_ns();
+     pthread_cond_broadcast(&sched_cond);
+     pthread_mutex_unlock(&sched_lock);
+ }
+
+/* Wait until the next rebuild batch may start. While requests keep
+   coming the rebuild only gets what it is guaranteed, and `earliest` is
+   when that allows the next batch; an idle device is rebuilt at full
+   speed. Requests that are already queued go first either way, but never
+   hold the rebuild off for more than FG_PRIORITY_NS beyond its due time,
+   so it finishes in bounded time under any load. */
+ static void rebuild_throttle(int64_t earliest) {
+     int64_t now = now_ns();
+     int64_t deadline = ((earliest > now) ? earliest : now) + FG_PRIORITY_NS;
+
+     pthread_mutex_lock(&sched_lock);
+     while (!rebuild_stop) {
+         int64_t until;
+         now = now_ns();
+         if (now < earliest && fg_pending > 0)
+             until = earliest;
+         else if (now < earliest && now < fg_last_ns + FG_IDLE_NS)
+             until = (earliest < fg_last_ns + FG_IDLE_NS) ? earliest : fg_last_ns + FG_IDLE_NS;
+         else if (fg_pending > 0 && now < deadline)
+             until = deadline;
+         else
+             break;
+         struct timespec ts = { .tv_sec = until / 1000000000LL, .tv_nsec = until % 1000000000LL };
+         pthread_cond_timedwait(&sched_cond, &sched_lock, &ts);
+     }
+     pthread_mutex_unlock(&sched_lock);
+ }
+
+/* One thread's share of a parallel XOR. */
+ struct xor_part {
+     unsigned char *dst;
+     const void *srcs[MAX_DEVICES];
+     const uint8_t *coefs;
+     int nsrc;
+     size_t len;
+ };
+
+ static void *xor_part_main(void *arg) {
+     struct xor_part *part = arg;
+     parity_gf_sum(part->dst, part->srcs, part->coefs, part->nsrc, part->len);
+     return NULL;
+ }
+
+/* parity_gf_sum() split into page-aligned slices, one per rebuild
+   thread; the caller takes the first slice. */
+ static void parallel_xor(unsigned char *dst, const void *const *srcs, const uint8_t *coefs, int nsrc,
+                          size_t len) {
+     struct xor_part parts[MAX_REBUILD_THREADS];
+     pthread_t threads[MAX_REBUILD_THREADS];
+     bool started[MAX_REBUILD_THREADS] = { false };
+     size_t slice = ((len + rebuild_threads - 1) / rebuild_threads + 4095) & ~(size_t)4095;
+     int nparts = 0;
+
+     for (size_t done = 0; done < len; done += slice) {
+         struct xor_part *part = &parts[nparts];
+         part->dst = dst + done;
+         part->coefs = coefs;
+         part->nsrc = nsrc;
+         part->len = (len - done < slice) ? len - done : slice;
+         for (int i = 0; i < nsrc; i++)
+             part->srcs[i] = (const unsigned char *)srcs[i] + done;
+         if (nparts > 0)
+             started[nparts] = pthread_create(&threads[nparts], NULL, xor_part_main, part) == 0;
+         nparts++;
+     }
+     for (int t = 0; t < nparts; t++) {
+         if (!started[t])
+             xor_part_main(&parts[t]);
+     }
+     for (int t = 1; t < nparts; t++) {
+         if (started[t])
+             pthread_join(threads[t], NULL);
+     }
+ }
+
+/* Write the superblock with the state every member is in now: missing,
+   rebuilt up to the watermark, or in sync. Moving the event counter on
+   tells members that miss this copy that they missed writes; rebuild
+   checkpoints leave it alone. */
+ static int update_superblock(bool bump, bool clean) {
+     uint64_t num_stripes = data_stripes;
+     if (!have_superblock)
+         return 0;
+     if (bump)
+         sb.events++;
+     sb.reshape_from = reshaping ? old_geometry.num_devices : 0;
+     sb.reshape_backup = reshape_backup;
+     sb.reshape_checkpoint = reshaping ? reshape_safe : 0;
+     sb.flags = (sb.flags & SUPERBLOCK_BITMAP) | (clean ? SUPERBLOCK_CLEAN : 0);
+     sb.rebuild_slot = -1;
+     sb.rebuild_checkpoint = 0;
+     for (int i = 0; i < num_devices; i++)
+         sb.state[i] = dev_missing[i] ? SUPERBLOCK_MISSING : SUPERBLOCK_ACTIVE;
+     if (rebuild_dev != -1 && rebuild_watermark < num_stripes) {
+         sb.state[rebuild_dev] = SUPERBLOCK_REBUILDING;
+         sb.rebuild_slot = rebuild_dev;
+         sb.rebuild_checkpoint = rebuild_watermark;
+     }
+     return superblock_write(&sb, dev_fd, num_devices);
+ }
+
 /* RAID5 Reconstruction Function:
    Given the number of stripes = raid_device_size / ((n–1) * block_size).
    For each stripe:
@@ -98,285 +745,1593 @@
        then new parity = XOR(all other data blocks).
      - If the rebuild disk is a data disk, 
        then new data = parity block XOR (XOR(all other data blocks)).
+   Either way the lost block is the XOR of the blocks at the same offset
+   on every other member, so whole runs of stripes are rebuilt at once:
+   each surviving member is read with one large pread per batch, the
+   kernel is asked to read ahead the next batch, and the XOR is spread
+   over rebuild_threads threads.
+
+   RAID6 rebuilds the same way, but what the rebuild disk holds, and so
+   the coefficients of the other members, changes with every chunk row,
+   and one other member may be missing. Each run of stripes with the
+   same plan_recovery() is computed in one go.
+
+   The rebuild runs in the background while the device serves requests.
+   It takes array_lock for one batch at a time and then moves
+   rebuild_watermark past it; above the watermark requests treat the
+   rebuild disk as missing. Between batches rebuild_throttle() holds it
+   back to --rebuild-rate while there is foreground traffic.
+
+   With a superblock the watermark is checkpointed every CHECKPOINT_NS,
+   once what lies below it is durable on the rebuild disk, and a
+   restarted rebuild starts over from there.
  */
- static int do_raid5_rebuild() {
-     uint64_t num_stripes = raid_device_size / ((num_devices - 1) * block_size);
-     unsigned char *temp = malloc(block_size);
-     if (!temp) {
-         perror("malloc");
-         return -1;
+ static void *rebuild_main(void *arg) {
+     UNUSED(arg);
+     uint64_t num_stripes = raid_device_size / (data_disks * block_size);
+     size_t batch_len = rebuild_stripes * block_size;
+     struct raid_io ios[MAX_DEVICES];
+     const void *srcs[MAX_DEVICES];
+     int64_t t0 = now_ns(), earliest = 0, checkpoint = t0;
+     uint64_t first = rebuild_watermark;
+
+     for (uint64_t stripe = first; stripe < num_stripes; stripe += rebuild_stripes) {
+         uint64_t count = (num_stripes - stripe < rebuild_stripes) ? num_stripes - stripe : rebuild_stripes;
+         uint64_t phys_offset = stripe * block_size;
+         size_t len = count * block_size;
+         unsigned char *rebuilt = rebuild_buf + rebuild_dev * batch_len;
+         int nios = 0;
+
+         rebuild_throttle(earliest);
+         exclusive_begin();
+         int64_t start = now_ns();
+         if (rebuild_stop) {
+             exclusive_end();
+             fprintf(stderr, "Rebuild of device %d stopped at stripe %lu of %lu.\n", rebuild_dev, stripe, num_stripes);
+             return NULL;
+         }
+         for (int i = 0; i < num_devices; i++) {
+             if (i == rebuild_dev || dev_missing[i])
+                 continue;
+             ios[nios++] = (struct raid_io){ .disk = i, .buf = rebuild_buf + i * batch_len,
+                                             .len = len, .offset = phys_offset };
+         }
+         int ret = raid_io_submit(ios, nios);
+         if (ret == 0) {
+             if (stripe + count < num_stripes) {
+                 for (int i = 0; i < num_devices; i++) {
+                     if (i != rebuild_dev && !dev_missing[i])
+                         posix_fadvise(dev_fd[i], phys_offset + len, batch_len, POSIX_FADV_WILLNEED);
+                 }
+             }
+             for (uint64_t k = 0, run; k < count; k += run) {
+                 struct recovery rc, next;
+                 plan_recovery(stripe + k, rebuild_dev, &rc);
+                 run = layout.chunk_blocks.d - layout_mod(&layout.chunk_blocks, stripe + k);
+                 while (k + run < count && plan_recovery(stripe + k + run, rebuild_dev, &next) == 0 &&
+                        memcmp(&next, &rc, sizeof(rc)) == 0)
+                     run += layout.chunk_blocks.d;
+                 if (k + run > count)
+                     run = count - k;
+                 for (int i = 0; i < rc.nsrc; i++)
+                     srcs[i] = rebuild_buf + rc.disk[i] * batch_len + k * block_size;
+                 parallel_xor(rebuilt + k * block_size, srcs, rc.coef, rc.nsrc, run * block_size);
+             }
+             ios[0] = (struct raid_io){ .disk = rebuild_dev, .write = 1, .buf = rebuilt,
+                                        .len = len, .offset = phys_offset };
+             nios = 1;
+             ret = raid_io_submit(ios, nios);
+         }
+         if (ret != 0) {
+             report_failed(ios[0].write ? "rebuild write" : "rebuild read", ios, nios);
+             exclusive_end();
+             fprintf(stderr, "Rebuild of device %d failed at stripe %lu, it stays degraded above.\n", rebuild_dev, stripe);
+             return NULL;
+         }
+         rebuild_watermark = stripe + count;
+         exclusive_end();
+
+         int64_t end = now_ns();
+         if (rebuild_rate)
+             earliest = ((earliest > start) ? earliest : start) + (int64_t)(len * 1e9 / rebuild_rate);
+         else if (rebuild_share)
+             earliest = end + (end - start) * (100 - rebuild_share) / rebuild_share;
+         if (have_superblock && end - checkpoint >= CHECKPOINT_NS) {
+             if (fdatasync(dev_fd[rebuild_dev]) == 0)
+                 update_superblock(false, false);
+             checkpoint = end;
+         }
+     }
+     double secs = (now_ns() - t0) / 1e9;
+     fprintf(stderr, "Rebuild of device %d complete in %.1f s, %.1f MB/s.\n", rebuild_dev, secs,
+             (num_stripes - first) * block_size / 1e6 / secs);
+     if (have_superblock && fdatasync(dev_fd[rebuild_dev]) == 0)
+         update_superblock(true, false);
+     /* healthy now: nothing is reconstructed any more, so the
+        reconstruction cache goes and requests may share the array */
+     if (concurrent_after_rebuild) {
+         exclusive_begin();
+         stripe_cache_free(&recon_cache);
+         __atomic_store_n(&concurrent_requests, true, __ATOMIC_RELAXED);
+         exclusive_end();
+     }
+     return NULL;
+ }
+ 
+/* The coefficients of every member in parity check `check` of `stripe`,
+   0 for P and 1 for Q: summed with them, the blocks of a consistent
+   stripe give zero. */
+ static void scrub_coefs(uint64_t stripe, int check, uint8_t *coefs) {
+     const struct layout_rotation *r = layout_rotation(&layout, stripe);
+     for (int d = 0; d < num_devices; d++) {
+         int pos = r->pos[d];
+         if (pos < data_disks)
+             coefs[d] = check ? parity_gf_exp(pos) : 1;
+         else
+             coefs[d] = pos - data_disks == check;
      }
-     for (uint64_t stripe = 0; stripe < num_stripes; stripe++) {
+ }
+
+/* Scrub: read whole stripes in rebuild batches, as rebuild_main() does,
+   and sum every member's blocks with scrub_coefs() in parallel_xor(),
+   for RAID5 over a whole batch at once since all its coefficients are
+   1. A stripe whose sums are not zero has parity that does not match
+   its data; repair computes the parity again and writes it back, with
+   the stripe marked in the write-intent bitmap first. Runs under
+   array_lock a batch at a time, throttled by rebuild_throttle(). */
+ static void *scrub_main(void *arg) {
+     UNUSED(arg);
+     uint64_t num_stripes = raid_device_size / (data_disks * block_size);
+     size_t batch_len = rebuild_stripes * block_size;
+     struct raid_io ios[MAX_DEVICES];
+     const void *srcs[MAX_DEVICES];
+     uint8_t coefs[MAX_DEVICES], next[MAX_DEVICES], used[MAX_DEVICES];
+     int64_t t0 = now_ns(), earliest = 0;
+
+     for (uint64_t stripe = 0; stripe < num_stripes; stripe += rebuild_stripes) {
+         uint64_t count = (num_stripes - stripe < rebuild_stripes) ? num_stripes - stripe : rebuild_stripes;
          uint64_t phys_offset = stripe * block_size;
-         int parity_disk = stripe % num_devices;
-         if (rebuild_dev == parity_disk) {
-             unsigned char parity_block[block_size];
-             memset(parity_block, 0, block_size);
-             for (int i = 0; i < num_devices; i++) {
-                 if (i == parity_disk) continue;
-                 if (dev_missing[i]) {
-                     fprintf(stderr, "Rebuild error: data device %d is missing, not be able to rebuild\n", i);
-                     free(temp);
-                     return -1;
+         size_t len = count * block_size;
+         int nbad = 0;
+
+         rebuild_throttle(earliest);
+         exclusive_begin();
+         int64_t start = now_ns();
+         if (rebuild_stop) {
+             exclusive_end();
+             fprintf(stderr, "Scrub stopped at stripe %lu of %lu, %lu mismatches.\n", stripe, num_stripes,
+                     scrub_mismatches);
+             return NULL;
+         }
+         for (int i = 0; i < num_devices; i++)
+             ios[i] = (struct raid_io){ .disk = i, .buf = rebuild_buf + i * batch_len,
+                                        .len = len, .offset = phys_offset };
+         int ret = raid_io_submit(ios, num_devices);
+         if (ret != 0)
+             report_failed("scrub read", ios, num_devices);
+         if (ret == 0 && stripe + count < num_stripes) {
+             for (int i = 0; i < num_devices; i++)
+                 posix_fadvise(dev_fd[i], phys_offset + len, batch_len, POSIX_FADV_WILLNEED);
+         }
+         for (int check = 0; ret == 0 && check < nparity; check++) {
+             unsigned char *sums = scrub_buf + check * batch_len;
+             for (uint64_t k = 0, run; k < count; k += run) {
+                 scrub_coefs(stripe + k, check, coefs);
+                 run = layout.chunk_blocks.d - layout_mod(&layout.chunk_blocks, stripe + k);
+                 while (k + run < count) {
+                     scrub_coefs(stripe + k + run, check, next);
+                     if (memcmp(next, coefs, num_devices) != 0)
+                         break;
+                     run += layout.chunk_blocks.d;
                  }
-                 if (pread(dev_fd[i], temp, block_size, phys_offset) != block_size) {
-                     perror("rebuild read (data)");
-                     free(temp);
-                     return -1;
+                 if (k + run > count)
+                     run = count - k;
+                 int nsrc = 0;
+                 for (int d = 0; d < num_devices; d++) {
+                     if (coefs[d]) {
+                         srcs[nsrc] = rebuild_buf + d * batch_len + k * block_size;
+                         used[nsrc++] = coefs[d];
+                     }
                  }
-                 for (int j = 0; j < block_size; j++) {
-                     parity_block[j] ^= temp[j];
+                 parallel_xor(sums + k * block_size, srcs, used, nsrc, run * block_size);
+             }
+         }
+         for (uint64_t k = 0; ret == 0 && k < count; k++) {
+             bool bad = false;
+             for (int check = 0; check < nparity; check++)
+                 bad |= memcmp(scrub_buf + check * batch_len + k * block_size, zero_block, block_size) != 0;
+             if (!bad)
+                 continue;
+             nbad++;
+             if (verbose)
+                 fprintf(stderr, "Scrub: parity mismatch in stripe %lu.\n", stripe + k);
+             if (scrub_mode != SCRUB_REPAIR)
+                 continue;
+             const struct layout_rotation *r = layout_rotation(&layout, stripe + k);
+             unsigned char *parity = rebuild_buf + r->parity * batch_len + k * block_size;
+             unsigned char *q = rebuild_buf + r->q * batch_len + k * block_size;
+             for (int pos = 0; pos < data_disks; pos++)
+                 srcs[pos] = rebuild_buf + r->disk[pos] * batch_len + k * block_size;
+             if (nparity == 2) {
+                 parity_pq(parity, q, srcs, data_disks, block_size);
+                 raid_io_plan_add(&scratch->io_plan, r->q, 1, (stripe + k) * block_size, q, block_size);
+             } else {
+                 parity_xor(parity, srcs, data_disks, block_size);
+             }
+             raid_io_plan_add(&scratch->io_plan, r->parity, 1, (stripe + k) * block_size, parity, block_size);
+             if (bitmap_enabled(&bitmap))
+                 bitmap_set(&bitmap, stripe + k);
+         }
+         if (ret == 0 && scrub_mode == SCRUB_REPAIR && nbad) {
+             ret = bitmap_enabled(&bitmap) ? bitmap_sync(&bitmap) : 0;
+             if (ret == 0)
+                 ret = submit_plan("scrub repair");
+             else
+                 raid_io_plan_reset(&scratch->io_plan);
+         }
+         if (ret != 0) {
+             exclusive_end();
+             fprintf(stderr, "Scrub failed at stripe %lu.\n", stripe);
+             return NULL;
+         }
+         __atomic_store_n(&scrub_mismatches, scrub_mismatches + nbad, __ATOMIC_RELAXED);
+         __atomic_store_n(&scrub_pos, stripe + count, __ATOMIC_RELAXED);
+         exclusive_end();
+
+         int64_t end = now_ns();
+         if (rebuild_rate)
+             earliest = ((earliest > start) ? earliest : start) + (int64_t)(len * 1e9 / rebuild_rate);
+         else if (rebuild_share)
+             earliest = end + (end - start) * (100 - rebuild_share) / rebuild_share;
+     }
+     double secs = (now_ns() - t0) / 1e9;
+     fprintf(stderr, "Scrub of %lu stripes complete in %.1f s, %.1f MB/s: %lu mismatches%s.\n", num_stripes, secs,
+             num_stripes * block_size / 1e6 / secs, scrub_mismatches,
+             scrub_mode == SCRUB_REPAIR && scrub_mismatches ? " repaired" : "");
+     return NULL;
+ }
+
+/* Recompute the parity of stripes [first, end) from their data, reading
+   each member's part of a batch with one pread. */
+ static int resync_stripes(uint64_t first, uint64_t end) {
+     size_t batch_len = rebuild_stripes * block_size;
+     struct raid_io ios[MAX_DEVICES];
+     int ret = 0;
+
+     for (uint64_t stripe = first, count; stripe < end && ret == 0; stripe += count) {
+         count = (end - stripe < rebuild_stripes) ? end - stripe : rebuild_stripes;
+         if (reshaping) {
+             /* the rows a reshape restriped are in the new geometry */
+             uint64_t boundary = reshape_rows * new_geometry.layout.chunk_blocks.d;
+             use_geometry(stripe < boundary ? &new_geometry : &old_geometry);
+             if (stripe < boundary && stripe + count > boundary)
+                 count = boundary - stripe;
+         }
+         for (int i = 0; i < num_devices; i++)
+             ios[i] = (struct raid_io){ .disk = i, .buf = rebuild_buf + i * batch_len,
+                                        .len = count * block_size, .offset = stripe * block_size };
+         if (raid_io_submit(ios, num_devices) != 0) {
+             report_failed("resync read", ios, num_devices);
+             ret = -1;
+             break;
+         }
+         for (uint64_t k = 0; k < count; k++) {
+             const struct layout_rotation *r = layout_rotation(&layout, stripe + k);
+             unsigned char *parity = rebuild_buf + r->parity * batch_len + k * block_size;
+             unsigned char *q = rebuild_buf + r->q * batch_len + k * block_size;
+             const void *srcs[MAX_DEVICES];
+             for (int pos = 0; pos < data_disks; pos++)
+                 srcs[pos] = rebuild_buf + r->disk[pos] * batch_len + k * block_size;
+             if (nparity == 2) {
+                 parity_pq(parity, q, srcs, data_disks, block_size);
+                 raid_io_plan_add(&scratch->io_plan, r->q, 1, (stripe + k) * block_size, q, block_size);
+             } else {
+                 parity_xor(parity, srcs, data_disks, block_size);
+             }
+             raid_io_plan_add(&scratch->io_plan, r->parity, 1, (stripe + k) * block_size, parity, block_size);
+         }
+         ret = submit_plan("resync write");
+     }
+     if (reshaping)
+         use_geometry(&new_geometry);
+     return ret;
+ }
+
+/* Resync after an unclean shutdown: recompute the parity of every stripe
+   in a region the write-intent bitmap marks. Regions whose bit is clear
+   were idle at the last flush and are consistent already. Runs before
+   requests are served. */
+ static int do_raid5_resync(void) {
+     uint64_t num_stripes = data_stripes;
+     uint64_t nregions = 0;
+     int64_t t0 = now_ns();
+
+     for (uint64_t region = 0; region < bitmap.nregions; region++) {
+         if (bitmap_test(&bitmap, region))
+             nregions++;
+     }
+     if (nregions == 0)
+         return 0;
+     for (int i = 0; i < num_devices; i++) {
+         if (dev_missing[i]) {
+             fprintf(stderr, "WARNING: %lu regions may have stale parity, cannot resync while device %d is missing\n",
+                     nregions, i);
+             return 0;
+         }
+     }
+     fprintf(stderr, "Resyncing %lu regions marked in the write-intent bitmap...\n", nregions);
+
+     for (uint64_t region = 0; region < bitmap.nregions; region++) {
+         uint64_t end = (region + 1) * bitmap.region_stripes;
+         if (!bitmap_test(&bitmap, region))
+             continue;
+         if (end > num_stripes)
+             end = num_stripes;
+         if (resync_stripes(region * bitmap.region_stripes, end) != 0)
+             return -1;
+     }
+     for (int i = 0; i < num_devices; i++) {
+         if (fsync(dev_fd[i]) != 0) {
+             perror("resync fsync");
+             return -1;
+         }
+     }
+     if (bitmap_clear(&bitmap) != 0)
+         return -1;
+     fprintf(stderr, "Resync complete in %.1f s.\n", (now_ns() - t0) / 1e9);
+     return 0;
+ }
+
+/* Whether `stripe` was discarded and reads as zeros. With `claim` set it
+   no longer is, as it is about to be written. Requests sharing
+   array_lock come here at once; those on one chunk row are serialized
+   by its row lock, so only the map itself needs unmapped_lock. */
+ static bool stripe_unmapped(uint64_t stripe, bool claim) {
+     bool ret;
+     if (__atomic_load_n(&unmapped.n, __ATOMIC_RELAXED) == 0)
+         return false;
+     pthread_mutex_lock(&unmapped_lock);
+     ret = extent_map_contains(&unmapped, stripe);
+     if (ret && claim)
+         extent_map_remove(&unmapped, stripe, stripe + 1);
+     pthread_mutex_unlock(&unmapped_lock);
+     return ret;
+ }
+
+/* The cached copy of logical block L, or NULL; with dirty_only set, only
+   one that the members do not have yet. */
+ static unsigned char *cached_block(uint64_t logical_block, bool dirty_only) {
+     struct stripe_cache_entry *e;
+     uint64_t stripe;
+     int pos;
+     if (!stripe_cache_enabled(&cache))
+         return NULL;
+     layout_map(&layout, logical_block, &stripe, &pos);
+     e = stripe_cache_lookup(&cache, stripe);
+     if (!e || !((dirty_only ? e->dirty : e->valid) & (1u << pos)))
+         return NULL;
+     return stripe_cache_block(&cache, e, pos);
+ }
+
+/* Where a degraded read of `stripe` finds the block of member `disk`: in
+   the caller's buffer when that block is part of the request anyway and
+   matches the members, otherwise in the batch scratch. */
+ static unsigned char *degraded_src(int disk, uint64_t stripe, uint64_t first_block,
+                                    uint64_t nblocks, unsigned char *buffer, uint64_t first_stripe) {
+     if (layout_is_data(&layout, stripe, disk)) {
+         uint64_t logical_block = layout_block(&layout, stripe, layout_rotation(&layout, stripe)->pos[disk]);
+         if (logical_block >= first_block && logical_block < first_block + nblocks &&
+             !cached_block(logical_block, true))
+             return buffer + (logical_block - first_block) * block_size;
+     }
+     return stripe_slot(stripe - first_stripe, disk);
+ }
+
+/* The copy of logical block L kept from a degraded read, or NULL. */
+ static unsigned char *recon_block(uint64_t logical_block) {
+     struct stripe_cache_entry *e;
+     uint64_t stripe;
+     int pos;
+     if (!stripe_cache_enabled(&recon_cache))
+         return NULL;
+     layout_map(&layout, logical_block, &stripe, &pos);
+     if (!(e = stripe_cache_lookup(&recon_cache, stripe)))
+         return NULL;
+     recon_cache.hits++;
+     return stripe_cache_block(&recon_cache, e, pos);
+ }
+
+/* Keep the data blocks of a stripe just reconstructed, the missing one
+   being `rebuilt`, so that reads of its neighbours need no member I/O.
+   A RAID6 stripe with a second data block missing is not kept. */
+ static void recon_insert(uint64_t stripe, int data_disk, const unsigned char *rebuilt,
+                          uint64_t first_block, uint64_t nblocks, unsigned char *buffer, uint64_t first_stripe) {
+     const struct layout_rotation *r = layout_rotation(&layout, stripe);
+     struct stripe_cache_entry *e;
+     if (!stripe_cache_enabled(&recon_cache))
+         return;
+     for (int pos = 0; pos < data_disks; pos++) {
+         if (r->disk[pos] != data_disk && member_missing(r->disk[pos], stripe))
+             return;
+     }
+     if (!(e = stripe_cache_get(&recon_cache, stripe)))
+         return;
+     for (int pos = 0; pos < data_disks; pos++) {
+         int disk = r->disk[pos];
+         const unsigned char *src = disk == data_disk ? rebuilt :
+             degraded_src(disk, stripe, first_block, nblocks, buffer, first_stripe);
+         memcpy(stripe_cache_block(&recon_cache, e, pos), src, block_size);
+     }
+     e->valid = (1u << data_disks) - 1;
+ }
+
+/* Hedged reads. A member's expected latency is the smoothed latency of
+   its small reads times one more than the operations queued on it. When
+   that is at least hedge_min_ns and hedge_factor times the expectation
+   of every other member, the member is slow, and reads of up to
+   hedge_max_len are reconstructed from its peers instead. Every
+   HEDGE_PROBE-th of them still reads it, so that its latency stays
+   known and it is used again once it recovers. Returns the slow member,
+   or -1, in particular while a member is missing, still being rebuilt
+   or has not been read. */
+ static int slow_member(u_int32_t len) {
+     uint64_t num_stripes = raid_device_size / (data_disks * block_size);
+     uint64_t first = 0, second = 0;
+     int slow = -1;
+     if (hedge_factor == 0 || len > hedge_max_len)
+         return -1;
+     for (int i = 0; i < num_devices; i++) {
+         const struct raid_io_member_stats *s = raid_io_stats(i);
+         uint64_t ewma = __atomic_load_n(&s->read_ewma_ns, __ATOMIC_RELAXED);
+         if (member_missing(i, num_stripes - 1) || ewma == 0)
+             return -1;
+         uint64_t expected = ewma * (1 + __atomic_load_n(&s->inflight, __ATOMIC_RELAXED));
+         if (expected > first) {
+             second = first;
+             first = expected;
+             slow = i;
+         } else if (expected > second) {
+             second = expected;
+         }
+     }
+     if (first < hedge_min_ns || first < hedge_factor * second)
+         return -1;
+     return slow;
+ }
+
+/* Whether this read of the slow member goes around it. */
+ static bool hedge_read(int disk) {
+     return __atomic_fetch_add(&hedge_count[disk], 1, __ATOMIC_RELAXED) % HEDGE_PROBE != 0;
+ }
+
+/* Read at most batch_rows chunk rows worth of blocks with one plan.
+   Blocks of stripes that a degraded read reconstructed before come
+   from the reconstruction cache; the other stripes are reconstructed
+   once per batch, with every block the request needs anyway read
+   straight into the buffer. Blocks of a slow member are reconstructed
+   the same way when its peers allow it. */
+ static int read_batch(unsigned char *buffer, u_int32_t len, uint64_t offset) {
+     uint64_t first_block = offset / block_size;
+     uint64_t nblocks = len / block_size;
+     uint64_t first_stripe = row_first_stripe(offset);
+     uint64_t stripe;
+     int parity_disk, data_disk;
+     bool degraded = false;
+     bool *rebuild = scratch->rebuild;
+     struct recovery rc;
+     int slow = slow_member(len);
+
+     for (uint64_t b = 0; b < nblocks; b++) {
+         unsigned char *cached = cached_block(first_block + b, false);
+         map_block(first_block + b, &stripe, &parity_disk, &data_disk);
+         uint64_t phys_offset = stripe * block_size;
+         rebuild[b] = false;
+         if (cached || (cached = recon_block(first_block + b))) {
+             memcpy(buffer + b * block_size, cached, block_size);
+             continue;
+         }
+         if (stripe_unmapped(stripe, false)) {
+             memset(buffer + b * block_size, 0, block_size);
+             continue;
+         }
+         bool missing = member_missing(data_disk, stripe);
+         if (!missing && (data_disk != slow || !hedge_read(data_disk) ||
+                          plan_recovery(stripe, data_disk, &rc) != 0)) {
+             raid_io_plan_add(&scratch->io_plan, data_disk, 0, phys_offset, buffer + b * block_size, block_size);
+             continue;
+         }
+         if (missing && plan_recovery(stripe, data_disk, &rc) != 0) {
+             fprintf(stderr, "ERROR: data device %d and %s missing, cannot rebuild\n", data_disk,
+                     nparity == 1 ? "the parity device are" : "two others are");
+             raid_io_plan_reset(&scratch->io_plan);
+             return -1;
+         }
+         for (int i = 0; i < rc.nsrc; i++) {
+             unsigned char *src = degraded_src(rc.disk[i], stripe, first_block, nblocks, buffer, first_stripe);
+             if (src == stripe_slot(stripe - first_stripe, rc.disk[i]))
+                 raid_io_plan_add(&scratch->io_plan, rc.disk[i], 0, phys_offset, src, block_size);
+         }
+         rebuild[b] = degraded = true;
+     }
+     if (submit_plan("pread") != 0)
+         return -1;
+     if (!degraded)
+         return 0;
+
+     for (uint64_t b = 0; b < nblocks; b++) {
+         if (!rebuild[b])
+             continue;
+         map_block(first_block + b, &stripe, &parity_disk, &data_disk);
+         const void *srcs[MAX_DEVICES];
+         plan_recovery(stripe, data_disk, &rc);
+         for (int i = 0; i < rc.nsrc; i++)
+             srcs[i] = degraded_src(rc.disk[i], stripe, first_block, nblocks, buffer, first_stripe);
+         parity_gf_sum(buffer + b * block_size, srcs, rc.coef, rc.nsrc, block_size);
+         recon_insert(stripe, data_disk, buffer + b * block_size, first_block, nblocks, buffer, first_stripe);
+         __atomic_fetch_add(member_missing(data_disk, stripe) ? &degraded_blocks : &hedged_blocks, 1, __ATOMIC_RELAXED);
+     }
+     return 0;
+ }
+
+/* RAID5 Read Operation:
+   For a given logical offset, first compute the logical block number.
+   Then, determine the data disk index using:
+       stripe = L / (n–1) and pos = L % (n–1),
+   where:
+       data_disk = (pos >= parity_disk) ? pos + 1 : pos, 
+       with parity_disk = stripe % n.
+   If the target data disk is available, read directly; 
+   otherwise, reconstruct the data using the parity block and other data blocks.
+   Blocks are gathered per batch of stripes, so every member is read
+   with one vectored pread covering its whole extent of the batch; the
+   parity blocks in between are read into a sink instead of splitting it.
+ */
+ static int array_read(unsigned char *buffer, u_int32_t len, uint64_t offset) {
+     int ret = 0;
+     while (len > 0) {
+         uint64_t geometry_end = select_geometry(offset);
+         uint64_t batch_end = (offset / chunk_row_size + batch_rows) * chunk_row_size;
+         if (batch_end > geometry_end)
+             batch_end = geometry_end;
+         u_int32_t blen = (offset + len < batch_end) ? len : batch_end - offset;
+         if (read_batch(buffer, blen, offset) != 0) {
+             ret = -1;
+             break;
+         }
+         offset += blen;
+         buffer += blen;
+         len -= blen;
+     }
+     if (reshaping)
+         use_geometry(&new_geometry);
+     return ret;
+ }
+
+/* Read-ahead. A read that starts within READ_STREAM_SLACK of where one
+   of the last READ_STREAMS streams got to continues it; any other read
+   starts a new stream in place of the least recent one. From a stream's
+   second read on, every member is asked with POSIX_FADV_WILLNEED to
+   fetch its part of the next readahead_bytes of the array, whole chunk
+   rows, parity included, so that each member sees one contiguous
+   extent. The kernel reads it asynchronously, and the stream's later
+   requests find it in memory. It is renewed once the stream has used
+   half of it. */
+ static void read_ahead(uint64_t offset, u_int32_t len) {
+     struct read_stream *s = NULL, *lru = &streams[0];
+     uint64_t from, to;
+
+     if (!readahead_bytes || reshaping)
+         return;
+     pthread_mutex_lock(&readahead_lock);
+     for (int i = 0; i < READ_STREAMS; i++) {
+         struct read_stream *t = &streams[i];
+         if (t->reads && offset + READ_STREAM_SLACK >= t->next && offset <= t->next + READ_STREAM_SLACK) {
+             s = t;
+             break;
+         }
+         if (t->used < lru->used)
+             lru = t;
+     }
+     if (!s) {
+         s = lru;
+         *s = (struct read_stream){ .next = offset + len, .ahead = offset + len };
+     }
+     if (offset + len > s->next)
+         s->next = offset + len;
+     s->used = ++readahead_clock;
+     if (++s->reads == 2)
+         readahead_streams++;
+     from = s->ahead > s->next ? s->ahead : s->next;
+     to = s->next + readahead_bytes < raid_device_size ? s->next + readahead_bytes : raid_device_size;
+     bool fetch = s->reads >= 2 && to > from && (to - from >= readahead_bytes / 2 || to == raid_device_size);
+     if (fetch) {
+         s->ahead = to;
+         readahead_issued += to - from;
+     }
+     pthread_mutex_unlock(&readahead_lock);
+     if (!fetch)
+         return;
+
+     uint64_t first = row_first_stripe(from);
+     uint64_t end = row_first_stripe(to + chunk_row_size - 1);
+     for (int i = 0; i < num_devices; i++) {
+         if (!dev_missing[i])
+             posix_fadvise(dev_fd[i], first * block_size, (end - first) * block_size, POSIX_FADV_WILLNEED);
+     }
+ }
+
+ static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+     UNUSED(userdata);
+     if (verbose)
+         fprintf(stderr, "R - offset: %lu, len: %u\n", offset, len);
+     struct request_locks rl;
+     request_begin(&rl, offset, len, false);
+     read_ahead(offset, len);
+     int ret = array_read(buf, len, offset);
+     request_end(&rl);
+     return ret;
+ }
+ 
+/* Zero-copy reads: on a healthy stretch of the array, with nothing of it
+   in the stripe cache, the blocks of a read are plain member extents
+   that buse can splice to the socket. Anything else is left to xmp_read. */
+ static int xmp_read_map(struct buse_extent *extents, int max_extents, u_int32_t len,
+                         u_int64_t offset, void *userdata) {
+     UNUSED(userdata);
+     uint64_t first_block = offset / block_size, nblocks = len / block_size;
+     uint64_t stripe;
+     int parity_disk, data_disk, n = 0;
+     struct request_locks rl;
+
+     if (offset % block_size || len % block_size || reshaping || slow_member(len) != -1)
+         return 0;
+     request_begin(&rl, offset, len, false);
+     for (uint64_t b = 0; b < nblocks; b++) {
+         map_block(first_block + b, &stripe, &parity_disk, &data_disk);
+         if (member_missing(data_disk, stripe) || cached_block(first_block + b, false) ||
+             stripe_unmapped(stripe, false)) {
+             n = 0;
+             break;
+         }
+         if (n > 0 && extents[n - 1].fd == dev_fd[data_disk] &&
+             extents[n - 1].offset + extents[n - 1].len == stripe * block_size) {
+             extents[n - 1].len += block_size;
+             continue;
+         }
+         if (n == max_extents) {
+             n = 0;
+             break;
+         }
+         extents[n++] = (struct buse_extent){ dev_fd[data_disk], stripe * block_size, block_size };
+     }
+     if (n > 0)
+         read_ahead(offset, len);
+     request_end(&rl);
+     return n;
+ }
+
+/* Write sw[0..n-1], at most batch_stripes of them: all pre-reads go out
+   as one plan, then all data and parity writes as another. The parity
+   of each stripe is brought up to date the cheapest way its members
+   allow:
+     - full: every data block is written or known from cur_data, parity
+       is their XOR and nothing is read;
+     - reconstruct-write: read the data blocks that are neither, and
+       XOR the whole stripe;
+     - read-modify-write: read old parity and the old data of the
+       written blocks, new_parity = old_parity ^ old_data ^ new_data.
+   A written block on a missing member reaches the array through parity
+   alone, so only reconstruct-write can handle it; with the parity
+   member missing the data is simply written. The blocks of a discarded
+   stripe are known to be zeros, so writing to it is always a full
+   write.
+
+   RAID6 keeps P and Q up to date the same ways: both come out of one
+   parity_pq() over the whole stripe, or Q is updated with
+   g^pos * (old_data ^ new_data) for every written block. A written
+   block on one missing member and an unknown block on another leave
+   neither way open; recover-write then reads the rest of the stripe,
+   rebuilds the old contents of the unknown block and writes in full. */
+ static int write_stripes(struct stripe_write *sw, int n) {
+     struct recovery rc;
+
+     if (bitmap_enabled(&bitmap)) {
+         pthread_mutex_lock(&bitmap_lock);
+         for (int k = 0; k < n; k++)
+             bitmap_set(&bitmap, sw[k].stripe);
+         int ret = bitmap_sync(&bitmap);
+         pthread_mutex_unlock(&bitmap_lock);
+         if (ret != 0)
+             return -1;
+     }
+     for (int k = 0; k < n; k++) {
+         const struct layout_rotation *r = layout_rotation(&layout, sw[k].stripe);
+         uint64_t phys_offset = sw[k].stripe * block_size;
+         int nnew = 0, nunknown = 0, nlive = 0, nmissing = 0;
+         bool new_missing = false, unknown_missing = false;
+         bool zeros = stripe_unmapped(sw[k].stripe, true);
+         struct stripe_cache_entry *e;
+         if (stripe_cache_enabled(&recon_cache) && (e = stripe_cache_lookup(&recon_cache, sw[k].stripe)))
+             stripe_cache_drop(&recon_cache, e);
+         for (int d = 0; d < num_devices; d++) {
+             bool missing = member_missing(d, sw[k].stripe);
+             nmissing += missing;
+             if (!layout_is_data(&layout, sw[k].stripe, d)) {
+                 nlive += !missing;
+                 continue;
+             }
+             if (zeros && !sw[k].new_data[d] && !sw[k].cur_data[d])
+                 sw[k].cur_data[d] = zero_block;
+             if (sw[k].new_data[d]) {
+                 nnew++;
+                 new_missing |= missing;
+             } else if (!sw[k].cur_data[d]) {
+                 nunknown++;
+                 if (missing) {
+                     unknown_missing = true;
+                     sw[k].recover_disk = d;
                  }
              }
-             if (pwrite(dev_fd[rebuild_dev], parity_block, block_size, phys_offset) != block_size) {
-                 perror("rebuild write (parity)");
-                 free(temp);
-                 return -1;
+         }
+         if (nlive == 0)
+             sw[k].mode = new_missing ? WRITE_FAILED : WRITE_DATA_ONLY;
+         else if (nunknown == 0)
+             sw[k].mode = WRITE_FULL;
+         else if (unknown_missing && new_missing)
+             sw[k].mode = nmissing > nparity ? WRITE_FAILED : WRITE_RECOVER;
+         else if (unknown_missing)
+             sw[k].mode = WRITE_RMW;
+         else
+             sw[k].mode = (new_missing || nunknown < nnew + nlive) ? WRITE_RCW : WRITE_RMW;
+         if (sw[k].mode == WRITE_RECOVER && plan_recovery(sw[k].stripe, sw[k].recover_disk, &rc) != 0)
+             sw[k].mode = WRITE_FAILED;
+         if (sw[k].mode == WRITE_FAILED) {
+             fprintf(stderr, "ERROR: multiple devices are missing, cannot write stripe %lu\n", sw[k].stripe);
+             raid_io_plan_reset(&scratch->io_plan);
+             return -1;
+         }
+
+         if (sw[k].mode == WRITE_RECOVER) {
+             for (int i = 0; i < rc.nsrc; i++) {
+                 int d = rc.disk[i];
+                 if (!layout_is_data(&layout, sw[k].stripe, d) || !sw[k].cur_data[d])
+                     raid_io_plan_add(&scratch->io_plan, d, 0, phys_offset, stripe_slot(k, d), block_size);
              }
-         } else {
+             continue;
+         }
+         for (int d = 0; d < num_devices; d++) {
+             bool read;
+             if (!layout_is_data(&layout, sw[k].stripe, d))
+                 read = sw[k].mode == WRITE_RMW && !member_missing(d, sw[k].stripe) &&
+                        (d == r->parity || nparity == 2);
+             else if (sw[k].mode == WRITE_RMW)
+                 read = sw[k].new_data[d] != NULL;
+             else
+                 read = sw[k].mode == WRITE_RCW && !sw[k].new_data[d] && !sw[k].cur_data[d];
+             if (read)
+                 raid_io_plan_add(&scratch->io_plan, d, 0, phys_offset, stripe_slot(k, d), block_size);
+         }
+     }
+     if (submit_plan("pread old parity and data") != 0)
+         return -1;
 
-             unsigned char data_block[block_size];
-             memset(data_block, 0, block_size);
+     for (int k = 0; k < n; k++) {
+         const struct layout_rotation *r = layout_rotation(&layout, sw[k].stripe);
+         uint64_t phys_offset = sw[k].stripe * block_size;
+         unsigned char *parity = stripe_slot(k, r->parity), *q = stripe_slot(k, r->q);
+         bool parity_live = !member_missing(r->parity, sw[k].stripe);
+         bool q_live = nparity == 2 && !member_missing(r->q, sw[k].stripe);
+         const void *srcs[2 * MAX_DEVICES];
+         uint8_t coefs[2 * MAX_DEVICES];
+         int nsrc = 0;
 
-             if (!dev_missing[parity_disk]) {
-                 if (pread(dev_fd[parity_disk], temp, block_size, phys_offset) != block_size) {
-                     perror("rebuild read (parity)");
-                     free(temp);
-                     return -1;
-                 }
-                 memcpy(data_block, temp, block_size);
-             } else {
-                 memset(data_block, 0, block_size);
+         if (sw[k].mode == WRITE_RECOVER) {
+             plan_recovery(sw[k].stripe, sw[k].recover_disk, &rc);
+             for (int i = 0; i < rc.nsrc; i++) {
+                 int d = rc.disk[i];
+                 srcs[i] = layout_is_data(&layout, sw[k].stripe, d) && sw[k].cur_data[d] ?
+                           sw[k].cur_data[d] : stripe_slot(k, d);
              }
-
-             for (int i = 0; i < num_devices; i++) {
-                 if (i == parity_disk || i == rebuild_dev) continue;
-                 if (dev_missing[i]) {
-                     fprintf(stderr, "Rebuild error: data device %d is missing, cannot rebuild\n", i);
-                     free(temp);
-                     return -1;
-                 }
-                 if (pread(dev_fd[i], temp, block_size, phys_offset) != block_size) {
-                     perror("rebuild read (data)");
-                     free(temp);
-                     return -1;
-                 }
-                 for (int j = 0; j < block_size; j++) {
-                     data_block[j] ^= temp[j];
+             parity_gf_sum(stripe_slot(k, sw[k].recover_disk), srcs, rc.coef, rc.nsrc, block_size);
+         }
+         if (sw[k].mode == WRITE_RMW) {
+             srcs[nsrc] = parity;
+             coefs[nsrc++] = 1;
+         }
+         for (int pos = 0; pos < data_disks; pos++) {
+             int d = r->disk[pos];
+             const unsigned char *new_data = sw[k].new_data[d];
+             if (new_data && !member_missing(d, sw[k].stripe))
+                 raid_io_plan_add(&scratch->io_plan, d, 1, phys_offset, (void *)new_data, block_size);
+             if (sw[k].mode == WRITE_RMW) {
+                 if (new_data) {
+                     srcs[nsrc] = stripe_slot(k, d);
+                     coefs[nsrc++] = parity_gf_exp(pos);
+                     srcs[nsrc] = new_data;
+                     coefs[nsrc++] = parity_gf_exp(pos);
                  }
+             } else if (new_data) {
+                 srcs[nsrc++] = new_data;
+             } else {
+                 srcs[nsrc++] = sw[k].cur_data[d] ? sw[k].cur_data[d] : stripe_slot(k, d);
              }
-             if (pwrite(dev_fd[rebuild_dev], data_block, block_size, phys_offset) != block_size) {
-                 perror("rebuild write (data)");
-                 free(temp);
-                 return -1;
+         }
+         __atomic_fetch_add(&write_mode_count[sw[k].mode], 1, __ATOMIC_RELAXED);
+         if (sw[k].mode == WRITE_DATA_ONLY)
+             continue;
+         if (sw[k].mode != WRITE_RMW) {
+             if (nparity == 2)
+                 parity_pq(parity, q, srcs, nsrc, block_size);
+             else
+                 parity_xor(parity, srcs, nsrc, block_size);
+         } else {
+             if (q_live) {
+                 srcs[0] = q;
+                 parity_gf_sum(q, srcs, coefs, nsrc, block_size);
+                 srcs[0] = parity;
              }
+             if (parity_live)
+                 parity_xor(parity, srcs, nsrc, block_size);
          }
+         if (parity_live)
+             raid_io_plan_add(&scratch->io_plan, r->parity, 1, phys_offset, parity, block_size);
+         if (q_live)
+             raid_io_plan_add(&scratch->io_plan, r->q, 1, phys_offset, q, block_size);
+     }
+     return submit_plan("pwrite data and parity");
+ }
+
+/* Describe the cached stripe e as a write of its dirty blocks. */
+ static void entry_to_write(const struct stripe_cache_entry *e, struct stripe_write *sw) {
+     const struct layout_rotation *r = layout_rotation(&layout, e->stripe);
+     memset(sw, 0, sizeof(*sw));
+     sw->stripe = e->stripe;
+     for (int pos = 0; pos < data_disks; pos++) {
+         int disk = r->disk[pos];
+         if (e->dirty & (1u << pos))
+             sw->new_data[disk] = stripe_cache_block(&cache, e, pos);
+         else if (e->valid & (1u << pos))
+             sw->cur_data[disk] = stripe_cache_block(&cache, e, pos);
+     }
+ }
+
+/* Stripe cache writeback: entries come sorted by stripe, so neighbouring
+   stripes still merge into large member I/Os. */
+ static int cache_writeback(struct stripe_cache_entry **entries, int n, void *arg) {
+     UNUSED(arg);
+     for (int i = 0; i < n; i += batch_stripes) {
+         int m = (n - i < batch_stripes) ? n - i : batch_stripes;
+         for (int k = 0; k < m; k++)
+             entry_to_write(entries[i + k], &scratch->cache_writes[k]);
+         if (write_stripes(scratch->cache_writes, m) != 0)
+             return -1;
      }
-     free(temp);
      return 0;
  }
- 
-/* RAID5 Read Operation:
-   For a given logical offset, first compute the logical block number.
-   Then, determine the data disk index using:
-       stripe = L / (n–1) and pos = L % (n–1),
-   where:
-       data_disk = (pos >= parity_disk) ? pos + 1 : pos, 
-       with parity_disk = stripe % n.
-   If the target data disk is available, read directly; 
-   otherwise, reconstruct the data using the parity block and other data blocks.
- */
- static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
-     UNUSED(userdata);
-     if (verbose)
-         fprintf(stderr, "R - offset: %lu, len: %u\n", offset, len);
-     unsigned char *buffer = buf;
-     while (len > 0) {
-         uint64_t logical_block = offset / block_size;
-         uint64_t stripe = logical_block / (num_devices - 1);
-         int pos = logical_block % (num_devices - 1);
-         int parity_disk = stripe % num_devices;
-         int data_disk = (pos >= parity_disk) ? pos + 1 : pos;
-         uint64_t phys_offset = stripe * block_size;
-         unsigned char temp_block[block_size];
-         if (!dev_missing[data_disk]) {
-             if (pread(dev_fd[data_disk], temp_block, block_size, phys_offset) != block_size) {
-                 perror("pread data");
-                 return -1;
-             }
-         } else {
 
-             if (dev_missing[parity_disk]) {
-                 fprintf(stderr, "ERROR: data device %d and parity check device %d are missing, cannot rebuild\n", data_disk, parity_disk);
-                 return -1;
-             }
-             if (pread(dev_fd[parity_disk], temp_block, block_size, phys_offset) != block_size) {
-                 perror("pread parity");
-                 return -1;
-             }
-             for (int i = 0; i < num_devices; i++) {
-                 if (i == parity_disk || i == data_disk)
-                     continue;
-                 unsigned char other_block[block_size];
-                 if (dev_missing[i]) {
-                     fprintf(stderr, "ERROR: multiple devices are missing, cannot rebuild\n");
-                     return -1;
-                 }
-                 if (pread(dev_fd[i], other_block, block_size, phys_offset) != block_size) {
-                     perror("pread other data");
-                     return -1;
+/* Write at most batch_rows chunk rows. The blocks of the request are
+   first sorted into the stripes of the batch, stripe k at
+   stripe_writes[k], and then those written or merged in stripe order,
+   packing the ones that go to the members at the front. With the stripe
+   cache enabled a partial stripe is only merged into its cache entry,
+   and goes to the members as a full-stripe write once all of its data
+   blocks are known. */
+ static int write_batch(const unsigned char *buffer, u_int32_t len, uint64_t offset) {
+     uint64_t first_block = offset / block_size;
+     uint64_t nblocks = len / block_size;
+     uint64_t first_stripe = row_first_stripe(offset);
+     uint32_t all_blocks = (1u << data_disks) - 1;
+     uint32_t *written = scratch->written;
+     struct stripe_cache_entry **pinned = scratch->pinned;
+     int npinned = 0, nsw = 0, ret;
+
+     memset(written, 0, batch_stripes * sizeof(*written));
+     for (uint64_t b = 0; b < nblocks; b++) {
+         uint64_t stripe;
+         int pos;
+         layout_map(&layout, first_block + b, &stripe, &pos);
+         struct stripe_write *sw = &scratch->stripe_writes[stripe - first_stripe];
+         if (!written[stripe - first_stripe]) {
+             memset(sw, 0, sizeof(*sw));
+             sw->stripe = stripe;
+         }
+         written[stripe - first_stripe] |= 1u << pos;
+         sw->new_data[layout_rotation(&layout, stripe)->disk[pos]] = buffer + b * block_size;
+     }
+
+     for (int k = 0; k < batch_stripes; k++) {
+         struct stripe_write *sw = &scratch->stripe_writes[k];
+         struct stripe_cache_entry *e;
+
+         if (!written[k])
+             continue;
+         if (stripe_cache_enabled(&cache)) {
+             if (written[k] == all_blocks) {
+                 /* the write supersedes whatever is cached */
+                 if ((e = stripe_cache_lookup(&cache, sw->stripe)))
+                     stripe_cache_drop(&cache, e);
+             } else if ((e = stripe_cache_get(&cache, sw->stripe))) {
+                 const struct layout_rotation *r = layout_rotation(&layout, sw->stripe);
+                 for (int pos = 0; pos < data_disks; pos++) {
+                     if (!(written[k] & (1u << pos)))
+                         continue;
+                     memcpy(stripe_cache_block(&cache, e, pos), sw->new_data[r->disk[pos]], block_size);
+                     e->valid |= 1u << pos;
+                     e->dirty |= 1u << pos;
                  }
-                 for (int j = 0; j < block_size; j++) {
-                     temp_block[j] ^= other_block[j];
+                 if (e->valid == all_blocks) {
+                     entry_to_write(e, &scratch->stripe_writes[nsw++]);
+                     e->pinned = 1;
+                     pinned[npinned++] = e;
                  }
+                 continue;
              }
          }
-         memcpy(buffer, temp_block, block_size);
-         offset += block_size;
-         buffer += block_size;
-         len -= block_size;
+         if (nsw != k)
+             scratch->stripe_writes[nsw] = *sw;
+         nsw++;
      }
-     return 0;
+
+     ret = write_stripes(scratch->stripe_writes, nsw);
+     for (int i = 0; i < npinned; i++) {
+         if (ret == 0)
+             pinned[i]->dirty = 0;
+         pinned[i]->pinned = 0;
+     }
+     return ret;
  }
- 
+
 /* RAID5 Write Operation:
-   Detect full-stripe writes: If the offset is aligned to a stripe boundary 
-   and len >= (n–1) * block_size, it is considered a full-stripe write (data portion).
+   Detect full-stripe writes: If a stripe is entirely covered by the request,
+   it is considered a full-stripe write (data portion).
    In this case:
      - For stripe `stripe`, the parity disk index P = stripe % n.
      - The (n–1) logically contiguous data blocks are sequentially written to data disks 
        (mapping: if d >= P, then physical disk = d+1; otherwise, physical disk = d).
      - The parity block is computed as the XOR of all data blocks and written to disk P.
 
-   Otherwise, perform a partial write:
-     - For each updated data block, first read the existing parity block and old data.
-     - Compute the new parity using: new_parity = old_parity XOR old_data XOR new_data.
-     - Write the updated data block and the new parity block.
+   Otherwise, perform a partial write, per stripe the cheaper of:
+     - read-modify-write: read the existing parity block and the old data of the
+       k updated blocks (k+1 reads), then new_parity = old_parity XOR old_data XOR new_data;
+     - reconstruct-write: read the n-1-k data blocks that are not updated and
+       compute the parity from the whole stripe.
+     Write the updated data blocks and the new parity block.
+
+   Stripes are handled in batches: all pre-reads of a batch go out as one
+   plan, then all writes, each member seeing one vectored I/O per
+   contiguous extent.
  */
- static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
-     UNUSED(userdata);
-     const unsigned char *buffer = buf;
+ static int array_write(const unsigned char *buffer, u_int32_t len, uint64_t offset) {
+     int ret = 0;
      while (len > 0) {
-         if ((offset % ((num_devices - 1) * block_size) == 0) &&
-             (len >= (num_devices - 1) * block_size)) {
-             uint64_t stripe = offset / ((num_devices - 1) * block_size);
-             uint64_t phys_offset = stripe * block_size;
-             int parity_disk = stripe % num_devices;
-             unsigned char parity_block[block_size];
-             memset(parity_block, 0, block_size);
-             for (int d = 0; d < num_devices - 1; d++) {
-                 int data_disk = (d >= parity_disk) ? d + 1 : d;
-                 if (!dev_missing[data_disk]) {
-                     if (pwrite(dev_fd[data_disk], buffer + d * block_size, block_size, phys_offset) != block_size) {
-                         perror("pwrite full stripe data");
-                         return -1;
-                     }
-                 }
-                 for (int j = 0; j < block_size; j++) {
-                     parity_block[j] ^= buffer[d * block_size + j];
-                 }
-             }
-             if (!dev_missing[parity_disk]) {
-                 if (pwrite(dev_fd[parity_disk], parity_block, block_size, phys_offset) != block_size) {
-                     perror("pwrite full stripe parity");
-                     return -1;
-                 }
-             } else {
-                 fprintf(stderr, "ERROR: parity device  %d is missing, cannot fully striping write\n", parity_disk);
-                 return -1;
-             }
-             offset += (num_devices - 1) * block_size;
-             buffer += (num_devices - 1) * block_size;
-             len -= (num_devices - 1) * block_size;
-             continue;
+         uint64_t geometry_end = select_geometry(offset);
+         uint64_t batch_end = (offset / chunk_row_size + batch_rows) * chunk_row_size;
+         if (batch_end > geometry_end)
+             batch_end = geometry_end;
+         u_int32_t blen = (offset + len < batch_end) ? len : batch_end - offset;
+         if (write_batch(buffer, blen, offset) != 0) {
+             ret = -1;
+             break;
          }
-         
-         uint64_t logical_block = offset / block_size;
-         uint64_t stripe = logical_block / (num_devices - 1);
-         int pos = logical_block % (num_devices - 1);
-         int parity_disk = stripe % num_devices;
-         int data_disk = (pos >= parity_disk) ? pos + 1 : pos;
-         uint64_t phys_offset = stripe * block_size;
-         
-         unsigned char old_parity[block_size];
-         if (!dev_missing[parity_disk]) {
-             if (pread(dev_fd[parity_disk], old_parity, block_size, phys_offset) != block_size) {
-                 perror("pread old parity");
-                 return -1;
-             }
-         } else {
-             memset(old_parity, 0, block_size);
+         offset += blen;
+         buffer += blen;
+         len -= blen;
+     }
+     if (reshaping)
+         use_geometry(&new_geometry);
+     return ret;
+ }
+
+/* Array bytes in the first `rows` chunk rows of the new geometry. */
+ static uint64_t reshape_offset(uint64_t rows) {
+     uint64_t offset = rows * new_geometry.chunk_row_size;
+     return offset < raid_device_size ? offset : raid_device_size;
+ }
+
+/* Member offset of the backup of the first rows of a reshape: the top
+   of the new member, which holds no data before the array is restarted
+   with its grown size. */
+ static uint64_t reshape_backup_offset(void) {
+     uint64_t len = reshape_offset(old_geometry.data_disks);
+     return (data_stripes * block_size - len) / block_size * block_size;
+ }
+
+/* Make the reshape durable as far as it got: once the members have what
+   it wrote, the superblock may say so. Call with array_lock held. */
+ static int reshape_checkpoint(void) {
+     for (int i = 0; i < num_devices; i++) {
+         if (!dev_missing[i] && fdatasync(dev_fd[i]) != 0) {
+             perror("reshape fdatasync");
+             return -1;
+         }
+     }
+     reshape_safe = reshape_rows;
+     return update_superblock(false, false);
+ }
+
+/* Restripe the first chunk rows of a reshape, or with `restore` set
+   write them again from the backup after a crash. New row r overwrites
+   old row r, and below the old number of data disks it also holds data
+   of old row r itself, which a crash in the middle would lose; so the
+   data of those rows goes to the backup area first. Call with
+   array_lock held. */
+ static int reshape_first_rows(unsigned char *buf, bool restore) {
+     int disk = new_geometry.num_devices - 1;
+     uint64_t len = reshape_offset(old_geometry.data_disks);
+     uint64_t row = new_geometry.chunk_row_size;
+
+     if (restore) {
+         fprintf(stderr, "Restoring the first %lu bytes of the reshape from its backup.\n", len);
+         if (dev_missing[disk] || pread(dev_fd[disk], buf, len, reshape_backup_offset()) != (ssize_t)len) {
+             fprintf(stderr, "ERROR: cannot read the reshape backup from device %d\n", disk);
+             return -1;
          }
-         
-         unsigned char old_data[block_size];
-         if (!dev_missing[data_disk]) {
-             if (pread(dev_fd[data_disk], old_data, block_size, phys_offset) != block_size) {
-                 perror("pread old data");
+     } else {
+         for (uint64_t off = 0; off < len; off += row) {
+             if (array_read(buf + off, (len - off < row) ? len - off : row, off) != 0)
                  return -1;
-             }
+         }
+         if (pwrite(dev_fd[disk], buf, len, reshape_backup_offset()) != (ssize_t)len ||
+             fdatasync(dev_fd[disk]) != 0) {
+             perror("reshape backup");
+             return -1;
+         }
+         reshape_backup = true;
+         if (update_superblock(false, false) != 0)
+             return -1;
+     }
+     reshape_rows = (len + row - 1) / row;
+     reshape_pos = len;
+     for (uint64_t off = 0; off < len; off += row) {
+         if (array_write(buf + off, (len - off < row) ? len - off : row, off) != 0)
+             return -1;
+     }
+     reshape_backup = false;
+     return reshape_checkpoint();
+ }
+
+/* Reshape onto one more member: move the array data, in array order,
+   from the old geometry to the new one, a batch of chunk rows at a time
+   under array_lock, much as rebuild_main() does. New chunk row r lies
+   where old row r did, and holds array data that was further up, so
+   every batch reads before it overwrites and reshape_rows tells
+   requests which geometry their data is in.
+
+   After a crash the reshape copies again from its checkpoint, reading
+   old rows the new rows written since may already have overwritten. So
+   the new rows written never reach the old row holding the data at the
+   checkpoint: that limit moves up a row for every old data disks' worth
+   of rows, and a checkpoint frees the way when it is reached. Writes of
+   requests to rows restriped since the checkpoint take one first, or
+   the copy would undo them. */
+ static void *reshape_main(void *arg) {
+     UNUSED(arg);
+     uint64_t row = new_geometry.chunk_row_size;
+     uint64_t total_rows = (raid_device_size + row - 1) / row;
+     uint64_t rows_per_batch = RESHAPE_BATCH_BYTES / row ? RESHAPE_BATCH_BYTES / row : 1;
+     uint64_t first = reshape_rows;
+     int64_t t0 = now_ns(), earliest = 0, checkpoint = t0;
+
+     while (reshape_rows < total_rows) {
+         uint64_t from = reshape_pos;
+         int ret = 0;
+
+         rebuild_throttle(earliest);
+         exclusive_begin();
+         int64_t start = now_ns();
+         if (rebuild_stop) {
+             exclusive_end();
+             fprintf(stderr, "Reshape stopped at chunk row %lu of %lu.\n", reshape_rows, total_rows);
+             return NULL;
+         }
+         if (reshape_rows == 0) {
+             ret = reshape_first_rows(reshape_buf, false);
          } else {
-             memset(old_data, 0, block_size);
-         }
-         
-         unsigned char new_parity[block_size];
-         const unsigned char *new_data = buffer;
-         for (int j = 0; j < block_size; j++) {
-             new_parity[j] = old_parity[j] ^ old_data[j] ^ new_data[j];
-         }
-         
-         if (!dev_missing[data_disk]) {
-             if (pwrite(dev_fd[data_disk], new_data, block_size, phys_offset) != block_size) {
-                 perror("pwrite new data");
-                 return -1;
+             uint64_t limit = reshape_safe * new_geometry.data_disks / old_geometry.data_disks;
+             if (reshape_rows >= limit) {
+                 ret = reshape_checkpoint();
+                 limit = reshape_safe * new_geometry.data_disks / old_geometry.data_disks;
+                 checkpoint = start;
              }
-         }
-         if (!dev_missing[parity_disk]) {
-             if (pwrite(dev_fd[parity_disk], new_parity, block_size, phys_offset) != block_size) {
-                 perror("pwrite new parity");
-                 return -1;
+             uint64_t rows = total_rows - reshape_rows;
+             if (rows > rows_per_batch)
+                 rows = rows_per_batch;
+             if (rows > limit - reshape_rows)
+                 rows = limit - reshape_rows;
+             uint64_t to = reshape_offset(reshape_rows + rows);
+             if (ret == 0)
+                 ret = array_read(reshape_buf, to - from, from);
+             if (ret == 0) {
+                 reshape_rows += rows;
+                 reshape_pos = to;
+                 ret = array_write(reshape_buf, to - from, from);
              }
-         } else {
-             fprintf(stderr, "ERROR: parity device %d is missing, write update fails\n", parity_disk);
-             return -1;
          }
-         
-         offset += block_size;
-         buffer += block_size;
-         len -= block_size;
+         int64_t end = now_ns();
+         if (ret == 0 && end - checkpoint >= CHECKPOINT_NS) {
+             ret = reshape_checkpoint();
+             checkpoint = end;
+         }
+         exclusive_end();
+         if (ret != 0) {
+             fprintf(stderr, "Reshape failed at chunk row %lu of %lu.\n", reshape_rows, total_rows);
+             return NULL;
+         }
+
+         if (rebuild_rate)
+             earliest = ((earliest > start) ? earliest : start) + (int64_t)((reshape_pos - from) * 1e9 / rebuild_rate);
+         else if (rebuild_share)
+             earliest = end + (end - start) * (100 - rebuild_share) / rebuild_share;
      }
-     return 0;
+
+     /* the rest of the new geometry still has the old rows' parity, and
+        the array is restarted with it grown over them */
+     exclusive_begin();
+     reshape_rows = (data_stripes + layout.chunk_blocks.d - 1) / layout.chunk_blocks.d;
+     exclusive_end();
+     for (uint64_t stripe = row_first_stripe(raid_device_size), end; stripe < data_stripes; stripe = end) {
+         end = (data_stripes - stripe < (uint64_t)rebuild_stripes) ? data_stripes : stripe + rebuild_stripes;
+         exclusive_begin();
+         int ret = rebuild_stop ? -1 : resync_stripes(stripe, end);
+         exclusive_end();
+         if (ret != 0) {
+             fprintf(stderr, "Reshape stopped before the parity of the grown space was written.\n");
+             return NULL;
+         }
+     }
+     exclusive_begin();
+     if (reshape_checkpoint() == 0) {
+         reshaping = false;
+         update_superblock(true, false);
+     }
+     exclusive_end();
+     double secs = (now_ns() - t0) / 1e9;
+     fprintf(stderr, "Reshape to %d members complete in %.1f s, %.1f MB/s; restart the array to use its %lu bytes.\n",
+             new_geometry.num_devices, secs, (raid_device_size - reshape_offset(first)) / 1e6 / secs,
+             new_geometry.data_disks * data_stripes * block_size);
+     return NULL;
+ }
+
+ static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+     UNUSED(userdata);
+     int ret = 0;
+     struct request_locks rl;
+     request_begin(&rl, offset, len, true);
+     /* what a restarted reshape would copy again must not change first */
+     if (reshaping && offset < reshape_pos && offset + len > reshape_offset(reshape_safe))
+         ret = reshape_checkpoint();
+     if (ret == 0)
+         ret = array_write(buf, len, offset);
+     request_end(&rl);
+     return ret;
  }
  
  static int xmp_flush(void *userdata) {
      UNUSED(userdata);
+     int ret = 0;
+     struct request_locks rl;
      if (verbose)
          fprintf(stderr, "Received a flush request.\n");
+     /* bitmap_flushed() may only forget the regions of writes that are
+        done, so with a bitmap a flush waits for all of them */
+     if (bitmap_enabled(&bitmap))
+         exclusive_begin();
+     else
+         request_begin(&rl, 0, 0, false);
+     if (stripe_cache_flush(&cache) != 0)
+         ret = -1;
      for (int i = 0; i < num_devices; i++) {
-         if (!dev_missing[i] && dev_fd[i] != -1)
-             fsync(dev_fd[i]);
+         if (!dev_missing[i] && dev_fd[i] != -1 && fsync(dev_fd[i]) != 0)
+             ret = -1;
      }
-     return 0;
+     if (ret == 0 && bitmap_enabled(&bitmap))
+         bitmap_flushed(&bitmap);
+     if (bitmap_enabled(&bitmap))
+         exclusive_end();
+     else
+         request_end(&rl);
+     return ret;
  }
  
+ /* Give the blocks of stripes [first, end) of member `disk` back to the
+    storage below it, leaving zeros. With `force` set, zeros are written
+    where holes cannot be punched. */
+ static int discard_member(int disk, uint64_t first, uint64_t end, bool force) {
+     off_t off = first * block_size, len = (end - first) * block_size;
+     if (fallocate(dev_fd[disk], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+         return 0;
+     if (!force)
+         return -1;
+     if (fallocate(dev_fd[disk], FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+         return 0;
+     for (; len > 0; off += block_size, len -= block_size) {
+         if (pwrite(dev_fd[disk], zero_block, block_size, off) != block_size) {
+             perror("discard pwrite");
+             return -1;
+         }
+     }
+     return 0;
+ }
+
+/* RAID5 Discard Operation:
+   Only chunk rows the request covers entirely are discarded, on every
+   member including parity, which stays consistent because the XOR of
+   zeros is zero. Their stripes are remembered as unmapped, so reads of
+   them are answered with zeros and writes to them need no pre-reads.
+   Partial rows at either end are left alone; a discard is only a hint. */
+ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
+     UNUSED(userdata);
+     uint64_t first, end;
+     bool discarded = false;
+     int ret = 0;
+     struct request_locks rl;
+     if (verbose)
+         fprintf(stderr, "T - offset: %lu, len: %u\n", from, len);
+     request_begin(&rl, from, len, true);
+     /* the stripes of a request may lie in either geometry */
+     if (!__atomic_load_n(&can_discard, __ATOMIC_RELAXED) || reshaping)
+         goto out;
+     first = row_first_stripe(from + chunk_row_size - 1);
+     end = row_first_stripe(from + len);
+     if (first >= end)
+         goto out;
+     stripe_cache_drop_range(&cache, first, end);
+     stripe_cache_drop_range(&recon_cache, first, end);
+     if (bitmap_enabled(&bitmap)) {
+         pthread_mutex_lock(&bitmap_lock);
+         for (uint64_t s = first; s < end; s = (s / bitmap.region_stripes + 1) * bitmap.region_stripes)
+             bitmap_set(&bitmap, s);
+         ret = bitmap_sync(&bitmap);
+         pthread_mutex_unlock(&bitmap_lock);
+         if (ret != 0)
+             goto out;
+     }
+     for (int i = 0; i < num_devices; i++) {
+         if (dev_fd[i] < 0)
+             continue;
+         /* once one member has holes the others must read as zeros too */
+         if (discard_member(i, first, end, discarded) != 0) {
+             if (!discarded) {
+                 fprintf(stderr, "WARNING: device %d cannot punch holes, ignoring discards\n", i);
+                 __atomic_store_n(&can_discard, false, __ATOMIC_RELAXED);
+                 goto out;
+             }
+             ret = -1;
+             goto out;
+         }
+         discarded = true;
+     }
+     if (discarded) {
+         pthread_mutex_lock(&unmapped_lock);
+         extent_map_add(&unmapped, first, end);
+         pthread_mutex_unlock(&unmapped_lock);
+     }
+ out:
+     request_end(&rl);
+     return ret;
+ }
+
+ /* Array counters for the statistics report. They are updated by
+    requests and batches and read here without a lock, so a report may
+    lag a little. */
+ static void xmp_stats(FILE *out, void *userdata) {
+     UNUSED(userdata);
+     if (rebuild_dev != -1)
+         fprintf(out, "Rebuild of device %d: %lu of %lu stripes.\n", rebuild_dev,
+                 __atomic_load_n(&rebuild_watermark, __ATOMIC_RELAXED),
+                 raid_device_size / (data_disks * block_size));
+     if (__atomic_load_n(&reshaping, __ATOMIC_RELAXED))
+         fprintf(out, "Reshape to %d members: %lu of %lu chunk rows.\n", new_geometry.num_devices,
+                 __atomic_load_n(&reshape_rows, __ATOMIC_RELAXED),
+                 (raid_device_size + new_geometry.chunk_row_size - 1) / new_geometry.chunk_row_size);
+     if (scrub_mode != SCRUB_NONE)
+         fprintf(out, "Scrub: %lu of %lu stripes, %lu parity mismatches%s.\n",
+                 __atomic_load_n(&scrub_pos, __ATOMIC_RELAXED), raid_device_size / (data_disks * block_size),
+                 __atomic_load_n(&scrub_mismatches, __ATOMIC_RELAXED),
+                 scrub_mode == SCRUB_REPAIR ? " repaired" : "");
+     if (stripe_cache_enabled(&cache))
+         fprintf(out, "Stripe cache: %lu hits, %lu misses, %lu stripes written back.\n",
+                 cache.hits, cache.misses, cache.writebacks);
+     fprintf(out, "Stripe writes: %lu full, %lu reconstruct-write, %lu read-modify-write, %lu recover-write, %lu without parity.\n",
+             write_mode_count[WRITE_FULL], write_mode_count[WRITE_RCW], write_mode_count[WRITE_RMW],
+             write_mode_count[WRITE_RECOVER], write_mode_count[WRITE_DATA_ONLY]);
+     fprintf(out, "Degraded reads: %lu blocks reconstructed.\n", degraded_blocks);
+     if (readahead_bytes)
+         fprintf(out, "Read-ahead: %lu sequential streams, %lu bytes fetched ahead.\n",
+                 readahead_streams, readahead_issued);
+     if (hedge_factor)
+         fprintf(out, "Hedged reads: %lu blocks reconstructed around a slow member.\n", hedged_blocks);
+     if (stripe_cache_enabled(&recon_cache))
+         fprintf(out, "Reconstruction cache: %lu blocks read from %lu stripes kept.\n",
+                 recon_cache.hits, recon_cache.misses);
+     for (int i = 0; i < num_devices; i++) {
+         const struct raid_io_member_stats *s = raid_io_stats(i);
+         if (dev_missing[i]) {
+             fprintf(out, "device %d: missing\n", i);
+             continue;
+         }
+         fprintf(out, "device %d: %lu errors, %.0f us smoothed read latency, %u in flight\n", i,
+                 __atomic_load_n(&s->errors, __ATOMIC_RELAXED),
+                 __atomic_load_n(&s->read_ewma_ns, __ATOMIC_RELAXED) / 1000.0,
+                 __atomic_load_n(&s->inflight, __ATOMIC_RELAXED));
+         histogram_print_ns(out, "  read", &s->read);
+         histogram_print_ns(out, "  write", &s->write);
+     }
+ }
+
+/* Zeroed page-aligned memory, which member I/O could also use with
+   O_DIRECT, or NULL. */
+ static void *alloc_pages(size_t len) {
+     long page = sysconf(_SC_PAGESIZE);
+     void *p;
+     int err = posix_memalign(&p, page > 0 ? page : 4096, len);
+     if (err != 0) {
+         errno = err;
+         return NULL;
+     }
+     memset(p, 0, len);
+     return p;
+ }
+
+/* Take len bytes aligned to align from an arena of *used bytes so far,
+   returning their offset. */
+ static size_t arena_take(size_t *used, size_t len, size_t align) {
+     size_t at = (*used + align - 1) / align * align;
+     *used = at + len;
+     return at;
+ }
+
+/* Lay out the scratch of nscratches requests working on up to
+   max_batch_stripes stripes, the sink block and the zero block in one
+   page-aligned arena. Member blocks start on a page and the small
+   arrays on a cache line; every scratch takes whole pages, so two
+   threads never share a line. Returns the size of the arena. */
+ static size_t scratch_arena_init(int max_batch_stripes) {
+     long page = sysconf(_SC_PAGESIZE) > 0 ? sysconf(_SC_PAGESIZE) : 4096;
+     size_t blocks = (size_t)max_batch_stripes * num_devices;
+     size_t used = 0, stripe_buf, stripe_writes, cache_writes, written, pinned, rebuild;
+
+     stripe_buf = arena_take(&used, blocks * block_size, page);
+     stripe_writes = arena_take(&used, max_batch_stripes * sizeof(struct stripe_write), CACHE_LINE);
+     cache_writes = arena_take(&used, max_batch_stripes * sizeof(struct stripe_write), CACHE_LINE);
+     written = arena_take(&used, max_batch_stripes * sizeof(uint32_t), CACHE_LINE);
+     pinned = arena_take(&used, max_batch_stripes * sizeof(struct stripe_cache_entry *), CACHE_LINE);
+     rebuild = arena_take(&used, blocks * sizeof(bool), CACHE_LINE);
+     size_t scratch_size = arena_take(&used, 0, page);
+     size_t arena_size = nscratches * scratch_size + 2 * ((block_size + page - 1) / page * page);
+
+     if (!(scratch_arena = alloc_pages(arena_size))) {
+         perror("malloc");
+         exit(1);
+     }
+     for (int i = 0; i < nscratches; i++) {
+         unsigned char *base = scratch_arena + i * scratch_size;
+         scratches[i].stripe_buf = base + stripe_buf;
+         scratches[i].stripe_writes = (struct stripe_write *)(base + stripe_writes);
+         scratches[i].cache_writes = (struct stripe_write *)(base + cache_writes);
+         scratches[i].written = (uint32_t *)(base + written);
+         scratches[i].pinned = (struct stripe_cache_entry **)(base + pinned);
+         scratches[i].rebuild = (bool *)(base + rebuild);
+     }
+     scratch = &scratches[0];
+     sink_block = scratch_arena + nscratches * scratch_size;
+     zero_block = sink_block + (block_size + page - 1) / page * page;
+     return arena_size;
+ }
+
  static void xmp_disc(void *userdata) {
      UNUSED(userdata);
      if (verbose)
          fprintf(stderr, "Received a disconnect request.\n");
+     exclusive_begin();
+     if (stripe_cache_flush(&cache) != 0)
+         fprintf(stderr, "ERROR: cannot write back the stripe cache\n");
+     exclusive_end();
+     if (verbose)
+         xmp_stats(stderr, NULL);
  }
  
+/* --assemble: turn the superblocks of the given members into the
+   command line that starts the array, with each member in its slot,
+   MISSING for absent ones and a + on the one to rebuild. That is the
+   one a rebuild was interrupted on, else a member that missed writes,
+   else a member without superblock, which stands in for an absent one. */
+ static void assemble_array(struct arguments *a) {
+     struct superblock copy[MAX_DEVICES], *ref = NULL;
+     int found[MAX_DEVICES];
+     char *paths[MAX_DEVICES], *slots[MAX_DEVICES] = { NULL };
+     bool current[MAX_DEVICES] = { false }, stale[MAX_DEVICES] = { false };
+     int rebuild = -1, navailable = 0;
+
+     for (int i = 0; i < a->num_devices; i++) {
+         paths[i] = a->devices[i] + (a->devices[i][0] == '+');
+         int fd = open(paths[i], O_RDONLY);
+         if (fd < 0) {
+             perror(paths[i]);
+             exit(1);
+         }
+         found[i] = superblock_read(fd, &copy[i]);
+         close(fd);
+         if (found[i] == -2)
+             errx(EXIT_FAILURE, "%s: damaged or unsupported superblock", paths[i]);
+         if (found[i] == 0 && (!ref || copy[i].events > ref->events))
+             ref = &copy[i];
+     }
+     if (!ref)
+         errx(EXIT_FAILURE, "none of the devices has a superblock");
+     if (ref->layout > LAYOUT_RIGHT_SYMMETRIC)
+         errx(EXIT_FAILURE, "unsupported layout %u in the superblock", ref->layout);
+     for (int i = 0; i < a->num_devices; i++) {
+         if (found[i] != 0)
+             continue;
+         int slot = copy[i].slot;
+         if (memcmp(copy[i].uuid, ref->uuid, sizeof(ref->uuid)) != 0)
+             errx(EXIT_FAILURE, "%s belongs to another array", paths[i]);
+         if (slots[slot])
+             errx(EXIT_FAILURE, "%s and %s are both member %d", slots[slot], paths[i], slot);
+         slots[slot] = paths[i];
+         if (copy[i].events != ref->events || ref->state[slot] == SUPERBLOCK_MISSING) {
+             fprintf(stderr, "Device %s missed writes to the array.\n", paths[i]);
+             stale[slot] = true;
+         } else if (ref->state[slot] == SUPERBLOCK_REBUILDING) {
+             rebuild = slot;
+         } else {
+             current[slot] = true;
+             navailable++;
+         }
+     }
+     for (int slot = 0; slot < (int)ref->ndisks && rebuild == -1; slot++) {
+         if (stale[slot])
+             rebuild = slot;
+     }
+     for (int i = 0; i < a->num_devices; i++) {
+         for (int slot = 0; found[i] == -1 && rebuild == -1 && slot < (int)ref->ndisks; slot++) {
+             if (!slots[slot]) {
+                 slots[slot] = paths[i];
+                 rebuild = slot;
+             }
+         }
+         if (found[i] == -1 && (rebuild == -1 || slots[rebuild] != paths[i]))
+             fprintf(stderr, "Device %s has no superblock and is not used.\n", paths[i]);
+     }
+     if (navailable < (int)ref->ndisks - (ref->level == 6 ? 2 : 1))
+         errx(EXIT_FAILURE, "cannot assemble array %s from %d of its %u members", superblock_uuid(ref),
+              navailable, ref->ndisks);
+
+     a->block_size = ref->block_size;
+     a->chunk_size = ref->chunk_size;
+     a->layout = ref->layout;
+     a->level = ref->level;
+     a->bitmap = (ref->flags & SUPERBLOCK_BITMAP) != 0;
+     a->num_devices = ref->ndisks;
+     for (int slot = 0; slot < a->num_devices; slot++) {
+         a->devices[slot] = "MISSING";
+         if (slot == rebuild) {
+             if (asprintf(&a->devices[slot], "+%s", slots[slot]) < 0)
+                 errx(EXIT_FAILURE, "out of memory");
+         } else if (current[slot]) {
+             a->devices[slot] = slots[slot];
+         }
+     }
+     fprintf(stderr, "Assembling RAID%u array %s from %d of its %u members.\n", ref->level,
+             superblock_uuid(ref), navailable + (rebuild != -1), ref->ndisks);
+ }
+
+/* Check the superblocks of the members against the array the command
+   line describes: the same array in the same member order and geometry,
+   and no member that missed writes except the one to rebuild. A member
+   left under rebuild is rebuilt on from its checkpoint. Without any
+   superblock there is none, unless --superblock creates one. Returns
+   the data blocks of each member that the superblock records, or 0. */
+ static uint64_t load_superblocks(const struct arguments *a) {
+     struct superblock copy[MAX_DEVICES];
+     int found[MAX_DEVICES], ref = -1;
+
+     for (int i = 0; i < num_devices; i++) {
+         found[i] = dev_missing[i] ? -1 : superblock_read(dev_fd[i], &copy[i]);
+         if (found[i] == -2 && i != rebuild_dev)
+             errx(EXIT_FAILURE, "device %d has a damaged or unsupported superblock", i);
+         if (found[i] == 0 && i != rebuild_dev && (ref == -1 || copy[i].events > copy[ref].events))
+             ref = i;
+     }
+     if (ref == -1) {
+         if (!a->superblock)
+             return 0;
+         if (superblock_create(&sb) != 0)
+             exit(1);
+         have_superblock = true;
+         fprintf(stderr, "Creating the superblock of array %s.\n", superblock_uuid(&sb));
+         return 0;
+     }
+     sb = copy[ref];
+     have_superblock = true;
+     if (sb.ndisks != (uint32_t)num_devices || sb.block_size != (uint32_t)block_size ||
+         sb.chunk_size != chunk_size || sb.level != (nparity == 2 ? 6u : 5u) ||
+         sb.layout != layout.algorithm || !(sb.flags & SUPERBLOCK_BITMAP) != !a->bitmap)
+         errx(EXIT_FAILURE, "array %s is RAID%u of %u members, with %u byte blocks, %u byte chunks, "
+              "the %s layout and %s bitmap; start it with --assemble", superblock_uuid(&sb),
+              sb.level, sb.ndisks, sb.block_size, sb.chunk_size,
+              layout_name(sb.layout <= LAYOUT_RIGHT_SYMMETRIC ? sb.layout : 0),
+              sb.flags & SUPERBLOCK_BITMAP ? "a" : "no");
+     for (int i = 0; i < num_devices; i++) {
+         if (dev_missing[i] || i == rebuild_dev)
+             continue;
+         if (found[i] != 0 || memcmp(copy[i].uuid, sb.uuid, sizeof(sb.uuid)) != 0)
+             errx(EXIT_FAILURE, "device %d is no member of array %s; give it as +DEVICE to rebuild it",
+                  i, superblock_uuid(&sb));
+         if (copy[i].slot != (uint32_t)i)
+             errx(EXIT_FAILURE, "device %d is member %u of array %s", i, copy[i].slot, superblock_uuid(&sb));
+         if (copy[i].events != sb.events || sb.state[i] == SUPERBLOCK_MISSING)
+             errx(EXIT_FAILURE, "device %d missed writes to the array; give it as +DEVICE to rebuild it", i);
+         if (sb.state[i] == SUPERBLOCK_REBUILDING) {
+             if (rebuild_dev != -1)
+                 errx(EXIT_FAILURE, "device %d is still being rebuilt, cannot rebuild device %d as well",
+                      i, rebuild_dev);
+             rebuild_dev = i;
+         }
+     }
+     if (sb.reshape_from) {
+         if (sb.reshape_from != sb.ndisks - 1 || (int)sb.reshape_from < 2 + nparity)
+             errx(EXIT_FAILURE, "unsupported reshape from %u members in the superblock", sb.reshape_from);
+         if (rebuild_dev != -1)
+             errx(EXIT_FAILURE, "cannot rebuild device %d before the reshape of array %s is done",
+                  rebuild_dev, superblock_uuid(&sb));
+         reshaping = true;
+         reshape_rows = reshape_safe = sb.reshape_checkpoint;
+         reshape_backup = sb.reshape_backup;
+     }
+     /* the rebuild disk's copy must have seen the checkpoint */
+     int r = rebuild_dev;
+     if (r != -1 && sb.rebuild_slot == r && found[r] == 0 && copy[r].events == sb.events &&
+         copy[r].slot == (uint32_t)r && memcmp(copy[r].uuid, sb.uuid, sizeof(sb.uuid)) == 0)
+         rebuild_watermark = sb.rebuild_checkpoint;
+     if (!(sb.flags & SUPERBLOCK_CLEAN) && !a->bitmap)
+         fprintf(stderr, "WARNING: array %s was not shut down cleanly and has no write-intent bitmap, "
+                 "the parity of stripes written then may be stale\n", superblock_uuid(&sb));
+     return sb.data_blocks;
+ }
 
  int main(int argc, char *argv[]) {
-     struct arguments arguments = { .num_devices = 0, .verbose = 0 };
+     struct arguments arguments = { .num_devices = 0, .verbose = 0, .io_engine = RAID_IO_THREADS,
+                                    .layout = LAYOUT_RIGHT_ASYMMETRIC, .level = 5, .workers = 1,
+                                   .hedge_min_us = 1000, .hedge_max_len = 65536 };
      argp_parse(&argp, argc, argv, 0, 0, &arguments);
+     if (arguments.assemble)
+         assemble_array(&arguments);
      
      verbose = arguments.verbose;
+     rebuild_threads = arguments.rebuild_threads;
+     rebuild_rate = arguments.rebuild_rate;
+     rebuild_share = arguments.rebuild_share;
+     pthread_condattr_t attr;
+     pthread_condattr_init(&attr);
+     pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+     pthread_cond_init(&sched_cond, &attr);
+     /* batches waiting for array_lock must not starve behind a steady
+        stream of shared requests, nor writes behind reads */
+     pthread_rwlockattr_t rwattr;
+     pthread_rwlockattr_init(&rwattr);
+     pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+     pthread_rwlock_init(&array_lock, &rwattr);
+     for (int i = 0; i < ROW_LOCKS; i++)
+         pthread_rwlock_init(&row_locks[i], &rwattr);
+     pthread_condattr_destroy(&attr);
      block_size = arguments.block_size;
+     chunk_size = arguments.chunk_size ? arguments.chunk_size : arguments.block_size;
      num_devices = arguments.num_devices;
+     nparity = arguments.level == 6 ? 2 : 1;
      if (num_devices < 3) {
          errx(EXIT_FAILURE, "RAID5 requires at least 3 devices");
      }
+     if (num_devices < 4 && nparity == 2) {
+         errx(EXIT_FAILURE, "RAID6 requires at least 4 devices");
+     }
+     if (block_size == 0 || chunk_size % block_size != 0)
+         errx(EXIT_FAILURE, "the chunk size must be a multiple of the block size");
+     set_geometry(&new_geometry, num_devices, arguments.layout);
+     use_geometry(&new_geometry);
      
-     uint64_t min_blocks = 0;
+     uint64_t dev_size[MAX_DEVICES];
      for (int i = 0; i < num_devices; i++) {
          char *dev_path = arguments.devices[i];
          if (strcmp(dev_path, "MISSING") == 0) {
@@ -398,30 +2353,256 @@
                  perror(dev_path);
                  exit(1);
              }
-             uint64_t size = lseek(dev_fd[i], 0, SEEK_END);
-             fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, size);
-             uint64_t blocks = size / block_size;
-             if (min_blocks == 0 || blocks < min_blocks) {
-                 min_blocks = blocks;
+             dev_size[i] = lseek(dev_fd[i], 0, SEEK_END);
+             fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, dev_size[i]);
+         }
+     }
+     uint64_t recorded_blocks = load_superblocks(&arguments);
+
+     if (rebuild_dev != -1) {
+         if (dev_missing[rebuild_dev]) {
+             fprintf(stderr, "ERROR: cannot rebuild missing devices, cannot specify missing and + at the same time\n");
+             exit(1);
+         }
+         int nmissing = 0;
+         for (int i = 0; i < num_devices; i++) {
+             if (dev_missing[i] && ++nmissing >= nparity) {
+                 fprintf(stderr, "Rebuild error: device %d is missing, cannot rebuild\n", i);
+                 exit(1);
              }
          }
      }
+
+     /* the superblock, if any, goes above the data and the bitmap */
+     uint64_t min_blocks = 0;
+     for (int i = 0; i < num_devices; i++) {
+         if (dev_missing[i])
+             continue;
+         uint64_t blocks = (have_superblock ? superblock_offset(dev_size[i]) : dev_size[i]) / block_size;
+         if (min_blocks == 0 || blocks < min_blocks) {
+             min_blocks = blocks;
+         }
+     }
      
      if (min_blocks == 0) {
          fprintf(stderr, "ERROR: no availavle devices, cannot rebuild RAID5\n");
          exit(1);
      }
 
-     raid_device_size = (num_devices - 1) * min_blocks * block_size;
+     uint64_t data_blocks = min_blocks;
+     if (arguments.bitmap)
+         data_blocks -= bitmap_blocks(min_blocks, block_size);
+     data_blocks -= data_blocks % layout.chunk_blocks.d;    /* whole chunk rows only */
+     if (recorded_blocks) {
+         if (data_blocks < recorded_blocks) {
+             fprintf(stderr, "ERROR: the devices are smaller than array %s\n", superblock_uuid(&sb));
+             exit(1);
+         }
+         data_blocks = recorded_blocks;
+     }
+     if (data_blocks == 0) {
+         fprintf(stderr, "ERROR: the devices are smaller than one chunk\n");
+         exit(1);
+     }
+     raid_device_size = data_disks * data_blocks * block_size;
+     if (have_superblock && !recorded_blocks) {
+         sb.data_blocks = data_blocks;
+         sb.block_size = block_size;
+         sb.chunk_size = chunk_size;
+         sb.level = nparity == 2 ? 6 : 5;
+         sb.layout = layout.algorithm;
+         sb.ndisks = num_devices;
+         sb.flags = arguments.bitmap ? SUPERBLOCK_BITMAP : 0;
+     }
+     data_stripes = data_blocks;
+
+     if (arguments.grow) {
+         if (!have_superblock)
+             errx(EXIT_FAILURE, "--grow needs an array with a superblock, see --superblock");
+         if (reshaping)
+             errx(EXIT_FAILURE, "a reshape of array %s is under way already", superblock_uuid(&sb));
+         if (num_devices >= MAX_DEVICES)
+             errx(EXIT_FAILURE, "At most %d devices", MAX_DEVICES);
+         for (int i = 0; i < num_devices; i++) {
+             if (dev_missing[i] || i == rebuild_dev)
+                 errx(EXIT_FAILURE, "cannot grow the array while device %d is %s", i,
+                      dev_missing[i] ? "missing" : "being rebuilt");
+         }
+         int fd = open(arguments.grow, O_RDWR);
+         if (fd < 0) {
+             perror(arguments.grow);
+             exit(1);
+         }
+         uint64_t blocks = superblock_offset(lseek(fd, 0, SEEK_END)) / block_size;
+         if (blocks < data_blocks + (arguments.bitmap ? bitmap_blocks(data_blocks, block_size) : 0))
+             errx(EXIT_FAILURE, "%s is smaller than the other members", arguments.grow);
+         fprintf(stderr, "Growing array %s onto '%s' as device %d.\n", superblock_uuid(&sb),
+                 arguments.grow, num_devices);
+         dev_fd[num_devices] = fd;
+         dev_missing[num_devices] = false;
+         sb.ndisks = num_devices + 1;
+         reshaping = true;
+     }
+     if (reshaping) {
+         int from = arguments.grow ? num_devices : (int)sb.reshape_from;
+         set_geometry(&old_geometry, from, layout.algorithm);
+         set_geometry(&new_geometry, from + 1, layout.algorithm);
+         use_geometry(&new_geometry);
+         raid_device_size = old_geometry.data_disks * data_blocks * block_size;
+         reshape_pos = reshape_offset(reshape_rows);
+         uint64_t used_rows = (raid_device_size + chunk_row_size - 1) / chunk_row_size;
+         if (reshape_backup_offset() < used_rows * chunk_size)
+             errx(EXIT_FAILURE, "the members are too small to hold the backup of a reshape");
+         if (verbose)
+             fprintf(stderr, "Reshaping from %d to %d members at chunk row %lu.\n", from, from + 1, reshape_rows);
+     }
+     scrub_mode = arguments.scrub;
+     hedge_factor = arguments.hedge_factor;
+     hedge_min_ns = arguments.hedge_min_us * 1000;
+     hedge_max_len = arguments.hedge_max_len;
+     readahead_bytes = arguments.read_ahead;
+     if (scrub_mode != SCRUB_NONE) {
+         if (reshaping || rebuild_dev != -1)
+             errx(EXIT_FAILURE, "cannot scrub the array while it is %s", reshaping ? "reshaped" : "rebuilt");
+         for (int i = 0; i < num_devices; i++) {
+             if (dev_missing[i])
+                 errx(EXIT_FAILURE, "cannot scrub the array while device %d is missing", i);
+         }
+     }
+
+     parity_init();
+     if (verbose && nparity == 2)
+         fprintf(stderr, "Using %s parity and %s syndrome kernels.\n", parity_impl(), parity_gf_impl());
+     else if (verbose)
+         fprintf(stderr, "Using %s parity kernel.\n", parity_impl());
+     if (verbose)
+         fprintf(stderr, "Using the %s layout with %u byte chunks.\n", layout_name(layout.algorithm), chunk_size);
+     /* the old geometry of a reshape has fewer members, but may have more stripes per batch */
+     int max_batch_stripes = batch_stripes;
+     if (reshaping && old_geometry.batch_stripes > max_batch_stripes)
+         max_batch_stripes = old_geometry.batch_stripes;
+     /* requests share array_lock only when none of them touches what
+        lives across stripes: the caches and the geometries of a reshape.
+        Every worker, and the thread that reads the socket, gets its own
+        scratch then. An array that is only degraded by a rebuild gets
+        there once the rebuild is complete */
+     bool missing = false;
+     for (int i = 0; i < num_devices; i++)
+         missing |= dev_missing[i];
+     bool degraded = missing || rebuild_dev != -1;
+     /* only a degraded array reconstructs, and its cache never gets dirty */
+     size_t recon_size = arguments.recon_cache_size;
+     if (!arguments.recon_cache_set)
+         recon_size = 2 * chunk_row_size > RECON_CACHE_BYTES ? 2 * chunk_row_size : RECON_CACHE_BYTES;
+     if (!degraded || reshaping)
+         recon_size = 0;
+     bool may_share = arguments.workers > 1 && !arguments.cache_size && !reshaping;
+     concurrent_requests = may_share && !recon_size;
+     concurrent_after_rebuild = may_share && !concurrent_requests && !missing;
+     nscratches = concurrent_requests || concurrent_after_rebuild ? arguments.workers + 2 : 1;
+     size_t arena_size = scratch_arena_init(max_batch_stripes);
+     extent_map_init(&unmapped, MAX_UNMAPPED_EXTENTS);
+     /* cached stripes would have to follow the data into the new
+        geometry, so a reshape does without the caches */
+     if (reshaping && arguments.cache_size)
+         fprintf(stderr, "The stripe cache stays off while the array is reshaped.\n");
+     if (stripe_cache_init(&cache, reshaping ? 0 : arguments.cache_size, data_disks, block_size,
+                           batch_stripes, cache_writeback, NULL) != 0) {
+         perror("malloc");
+         exit(1);
+     }
+     if (verbose && stripe_cache_enabled(&cache))
+         fprintf(stderr, "Stripe cache holds %d stripes.\n", cache.nentries);
+     if (stripe_cache_init(&recon_cache, recon_size, data_disks, block_size,
+                           1, NULL, NULL) != 0) {
+         perror("malloc");
+         exit(1);
+     }
+     if (verbose && stripe_cache_enabled(&recon_cache))
+         fprintf(stderr, "Reconstruction cache holds %d stripes.\n", recon_cache.nentries);
+     raid_io_register_buffer(scratch_arena, arena_size);
+     if (rebuild_dev != -1 || arguments.bitmap || reshaping || scrub_mode != SCRUB_NONE) {
+         long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+         if (rebuild_threads == 0)
+             rebuild_threads = (ncpu > 4) ? 4 : (ncpu > 0 ? ncpu : 1);
+         rebuild_stripes = REBUILD_BATCH_BYTES / block_size;
+         if (rebuild_stripes < 1)
+             rebuild_stripes = 1;
+         rebuild_buf = alloc_pages((size_t)num_devices * rebuild_stripes * block_size);
+         if (!rebuild_buf) {
+             perror("malloc");
+             exit(1);
+         }
+         raid_io_register_buffer(rebuild_buf, (size_t)num_devices * rebuild_stripes * block_size);
+     }
+     if (scrub_mode != SCRUB_NONE) {
+         scrub_buf = alloc_pages((size_t)nparity * rebuild_stripes * block_size);
+         if (!scrub_buf) {
+             perror("malloc");
+             exit(1);
+         }
+     }
+     if (reshaping) {
+         uint64_t rows = RESHAPE_BATCH_BYTES / chunk_row_size ? RESHAPE_BATCH_BYTES / chunk_row_size : 1;
+         size_t len = rows * chunk_row_size;
+         if (len < reshape_offset(old_geometry.data_disks))
+             len = reshape_offset(old_geometry.data_disks);
+         reshape_buf = alloc_pages(len);
+         if (!reshape_buf) {
+             perror("malloc");
+             exit(1);
+         }
+     }
+     if (raid_io_init(dev_fd, num_devices, arguments.io_engine) != 0) {
+         fprintf(stderr, "ERROR: cannot start the %s I/O engine\n", raid_io_engine_name());
+         exit(1);
+     }
+     if (verbose)
+         fprintf(stderr, "Using %s I/O engine.\n", raid_io_engine_name());
+
+     if (arguments.bitmap) {
+         if (bitmap_load(&bitmap, dev_fd, num_devices, data_blocks, block_size) != 0)
+             exit(1);
+         if (rebuild_dev == -1 && do_raid5_resync() != 0) {
+             fprintf(stderr, "Resync failed, aborting.\n");
+             exit(1);
+         }
+     }
+     if (reshaping && reshape_backup) {
+         exclusive_begin();
+         int ret = reshape_first_rows(reshape_buf, true);
+         exclusive_end();
+         if (ret != 0)
+             exit(1);
+     }
      
+     if (update_superblock(true, false) != 0)
+         exit(1);
      if (rebuild_dev != -1) {
-         if (dev_missing[rebuild_dev]) {
-             fprintf(stderr, "ERROR: cannot rebuild missing devices, cannot specify missing and + at the same time\n");
+         if (rebuild_watermark)
+             fprintf(stderr, "Resuming RAID%d rebuild on device %d at stripe %lu in the background, %d XOR threads...\n",
+                     nparity == 2 ? 6 : 5, rebuild_dev, rebuild_watermark, rebuild_threads);
+         else
+             fprintf(stderr, "Doing RAID%d rebuild on device %d in the background, %d XOR threads...\n",
+                     nparity == 2 ? 6 : 5, rebuild_dev, rebuild_threads);
+         if (pthread_create(&rebuild_thread, NULL, rebuild_main, NULL) != 0) {
+             fprintf(stderr, "ERROR: cannot start the rebuild thread\n");
+             exit(1);
+         }
+     }
+     if (reshaping) {
+         fprintf(stderr, "Reshaping array from %d to %d members in the background...\n",
+                 old_geometry.num_devices, new_geometry.num_devices);
+         if (pthread_create(&reshape_thread, NULL, reshape_main, NULL) != 0) {
+             fprintf(stderr, "ERROR: cannot start the reshape thread\n");
              exit(1);
          }
-         fprintf(stderr, "Doing RAID5 rebuild on device %d...\n", rebuild_dev);
-         if (do_raid5_rebuild() != 0) {
-             fprintf(stderr, "Rebuild failed, aborting.\n");
+     }
+     if (scrub_mode != SCRUB_NONE) {
+         fprintf(stderr, "Scrubbing the parity in the background (%s), %d XOR threads...\n",
+                 scrub_mode == SCRUB_REPAIR ? "repair" : "check", rebuild_threads);
+         if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0) {
+             fprintf(stderr, "ERROR: cannot start the scrub thread\n");
              exit(1);
          }
      }
@@ -433,8 +2614,46 @@
          .write = xmp_write,
          .disc  = xmp_disc,
          .flush = xmp_flush,
+         .trim  = xmp_trim,
+         .read_map = arguments.splice ? xmp_read_map : NULL,
+         .stats = xmp_stats,
+         .num_workers = arguments.workers,
+         .stats_socket = arguments.stats_socket,
+         .stats_interval = arguments.stats_interval,
          .size  = raid_device_size
      };
      
-     return buse_main(arguments.raid_device, &bop, NULL);
+     int ret = buse_main(arguments.raid_device, &bop, NULL);
+     bool reshape_started = reshaping;
+     if (rebuild_dev != -1 || reshape_started || scrub_mode != SCRUB_NONE) {
+         exclusive_begin();
+         pthread_mutex_lock(&sched_lock);
+         rebuild_stop = true;
+         pthread_cond_broadcast(&sched_cond);
+         pthread_mutex_unlock(&sched_lock);
+         exclusive_end();
+     }
+     if (rebuild_dev != -1)
+         pthread_join(rebuild_thread, NULL);
+     if (reshape_started)
+         pthread_join(reshape_thread, NULL);
+     if (scrub_mode != SCRUB_NONE)
+         pthread_join(scrub_thread, NULL);
+     bool clean = stripe_cache_flush(&cache) == 0;
+     if (!clean) {
+         fprintf(stderr, "ERROR: cannot write back the stripe cache\n");
+     } else if (bitmap_enabled(&bitmap) || have_superblock) {
+         /* all written back: a clean shutdown needs no resync */
+         for (int i = 0; i < num_devices; i++) {
+             if (!dev_missing[i] && fsync(dev_fd[i]) != 0)
+                 clean = false;
+         }
+         if (clean && bitmap_enabled(&bitmap))
+             bitmap_clear(&bitmap);
+         if (clean && reshaping)
+             reshape_safe = reshape_rows;
+     }
+     update_superblock(true, clean);
+     raid_io_exit();
+     return ret;
  }
\ No newline at end of file
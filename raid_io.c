@@ -0,0 +1,544 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "raid_io.h"
+#include "uring.h"
+
+#define URING_DEPTH 64
+#define MAX_REG_BUFS 16
+
+/* Completion of one raid_io_submit() call, shared by the member threads. */
+struct raid_io_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+};
+
+/* Work queue of one member, drained by its own thread. */
+struct io_queue {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct raid_io *head, *tail;
+    int fd;
+    bool started;
+    bool stop;
+};
+
+/* io_uring of one submitting thread. */
+struct ring_ctx {
+    struct uring ring;
+    struct ring_ctx *next;
+    bool fixed_files;
+    bool fixed_bufs;
+};
+
+static enum raid_io_engine engine;
+static int *dev_fds;
+static int num_fds;
+static struct raid_io_member_stats *member_stats;
+static struct io_queue *queues;
+
+static __thread struct ring_ctx *thread_ring;
+static struct ring_ctx *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iovec reg_bufs[MAX_REG_BUFS];
+static int num_reg_bufs;
+
+static void do_io(struct raid_io *io, int fd);
+
+/* Complete a vectored transfer that stopped after io->result bytes, one
+   iovec at a time. */
+static void finish_iov(struct raid_io *io, int fd) {
+    size_t skip = io->result, done = io->result;
+    for (int i = 0; i < io->iovcnt; i++) {
+        struct iovec *v = &io->iov[i];
+        if (skip >= v->iov_len) {
+            skip -= v->iov_len;
+            continue;
+        }
+        struct raid_io part = {
+            .disk = io->disk,
+            .write = io->write,
+            .buf = (char *)v->iov_base + skip,
+            .len = v->iov_len - skip,
+            .offset = io->offset + done,
+        };
+        skip = 0;
+        do_io(&part, fd);
+        if (part.result < 0) {
+            io->result = part.result;
+            return;
+        }
+        done += part.result;
+        if ((size_t)part.result < part.len)
+            break;
+    }
+    io->result = done;
+}
+
+/* Transfer the whole of io, retrying short transfers and EINTR. */
+static void do_io(struct raid_io *io, int fd) {
+    size_t done = 0;
+    if (io->iovcnt > 0) {
+        ssize_t r;
+        do {
+            r = io->write ? pwritev(fd, io->iov, io->iovcnt, io->offset)
+                          : preadv(fd, io->iov, io->iovcnt, io->offset);
+        } while (r < 0 && errno == EINTR);
+        io->result = r < 0 ? -errno : r;
+        if (r > 0 && (size_t)r < io->len)
+            finish_iov(io, fd);
+        return;
+    }
+    while (done < io->len) {
+        ssize_t r = io->write
+            ? pwrite(fd, (char *)io->buf + done, io->len - done, io->offset + done)
+            : pread(fd, (char *)io->buf + done, io->len - done, io->offset + done);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            io->result = -errno;
+            return;
+        }
+        if (r == 0)
+            break;
+        done += r;
+    }
+    io->result = done;
+}
+
+/* Account a finished operation. The smoothed read latency moves an
+   eighth of the way to every new sample; updates racing on another
+   thread may lose one, which only makes it a little less smooth. */
+static void record_io(const struct raid_io *io) {
+    struct raid_io_member_stats *s = &member_stats[io->disk];
+    uint64_t ns = histogram_now_ns() - io->start_ns;
+    histogram_record(io->write ? &s->write : &s->read, ns);
+    if (!io->write && io->len <= RAID_IO_EWMA_MAX_LEN) {
+        int64_t ewma = __atomic_load_n(&s->read_ewma_ns, __ATOMIC_RELAXED);
+        ewma = ewma ? ewma + ((int64_t)ns - ewma) / 8 : (int64_t)ns;
+        __atomic_store_n(&s->read_ewma_ns, ewma, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_sub(&s->inflight, 1, __ATOMIC_RELAXED);
+    if (io->result != (ssize_t)io->len)
+        __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+}
+
+static void complete_io(struct raid_io *io) {
+    struct raid_io_batch *batch = io->batch;
+    record_io(io);
+    pthread_mutex_lock(&batch->lock);
+    if (--batch->pending == 0)
+        pthread_cond_signal(&batch->done);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void *queue_main(void *arg) {
+    struct io_queue *q = arg;
+    struct raid_io *io;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (!q->head && !q->stop)
+            pthread_cond_wait(&q->ready, &q->lock);
+        io = q->head;
+        if (!io) {
+            pthread_mutex_unlock(&q->lock);
+            return NULL;
+        }
+        q->head = io->next;
+        if (!q->head)
+            q->tail = NULL;
+        pthread_mutex_unlock(&q->lock);
+
+        do_io(io, q->fd);
+        complete_io(io);
+    }
+}
+
+static void queue_push(struct io_queue *q, struct raid_io *io) {
+    io->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail)
+        q->tail->next = io;
+    else
+        q->head = io;
+    q->tail = io;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* The calling thread's ring, set up on first use. */
+static struct ring_ctx *get_ring(void) {
+    struct ring_ctx *ctx = thread_ring;
+    if (ctx)
+        return ctx;
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+    int r = uring_init(&ctx->ring, URING_DEPTH);
+    if (r < 0) {
+        fprintf(stderr, "io_uring setup failed: %s\n", strerror(-r));
+        free(ctx);
+        return NULL;
+    }
+    /* Both are optimizations; plain fds and buffers work without them. */
+    ctx->fixed_files = uring_register_files(&ctx->ring, dev_fds, num_fds) == 0;
+    ctx->fixed_bufs = num_reg_bufs > 0 &&
+        uring_register_buffers(&ctx->ring, reg_bufs, num_reg_bufs) == 0;
+    pthread_mutex_lock(&rings_lock);
+    ctx->next = rings;
+    rings = ctx;
+    pthread_mutex_unlock(&rings_lock);
+    thread_ring = ctx;
+    return ctx;
+}
+
+static int find_reg_buf(const void *buf, size_t len) {
+    for (int i = 0; i < num_reg_bufs; i++) {
+        const char *base = reg_bufs[i].iov_base;
+        if ((const char *)buf >= base &&
+            (const char *)buf + len <= base + reg_bufs[i].iov_len)
+            return i;
+    }
+    return -1;
+}
+
+static void prep_sqe(struct ring_ctx *ctx, struct io_uring_sqe *sqe, struct raid_io *io) {
+    int buf_index = ctx->fixed_bufs && io->iovcnt == 0 ? find_reg_buf(io->buf, io->len) : -1;
+    if (io->iovcnt > 0) {
+        sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    } else if (buf_index >= 0) {
+        sqe->opcode = io->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = buf_index;
+    } else {
+        sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    if (ctx->fixed_files) {
+        sqe->fd = io->disk;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = dev_fds[io->disk];
+    }
+    if (io->iovcnt > 0) {
+        sqe->addr = (uintptr_t)io->iov;
+        sqe->len = io->iovcnt;
+    } else {
+        sqe->addr = (uintptr_t)io->buf;
+        sqe->len = io->len;
+    }
+    sqe->off = io->offset;
+    sqe->user_data = (uintptr_t)io;
+}
+
+/* A short transfer from the ring is finished off synchronously. */
+static void finish_short(struct raid_io *io) {
+    if (io->iovcnt > 0) {
+        finish_iov(io, dev_fds[io->disk]);
+        return;
+    }
+    struct raid_io rest = *io;
+    rest.buf = (char *)io->buf + io->result;
+    rest.len = io->len - io->result;
+    rest.offset = io->offset + io->result;
+    do_io(&rest, dev_fds[io->disk]);
+    io->result = rest.result < 0 ? rest.result : io->result + rest.result;
+}
+
+static void submit_uring(struct ring_ctx *ctx, struct raid_io *ios, int nios) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int queued = 0, inflight = 0;
+
+    while (queued < nios || inflight > 0) {
+        while (queued < nios && (sqe = uring_get_sqe(&ctx->ring))) {
+            prep_sqe(ctx, sqe, &ios[queued++]);
+            inflight++;
+        }
+        /* what the kernel did not take is offered again the next time
+           round; when it takes nothing it fails without waiting */
+        int r = uring_submit_and_wait(&ctx->ring, 1);
+        if (r < 0 && r != -EAGAIN && r != -EBUSY) {
+            errno = -r;
+            err(EXIT_FAILURE, "io_uring_enter");
+        }
+        while ((cqe = uring_peek_cqe(&ctx->ring))) {
+            struct raid_io *io = (struct raid_io *)(uintptr_t)cqe->user_data;
+            io->result = cqe->res;
+            uring_cqe_seen(&ctx->ring);
+            inflight--;
+            if (io->result > 0 && (size_t)io->result < io->len)
+                finish_short(io);
+            record_io(io);
+        }
+    }
+}
+
+int raid_io_register_buffer(void *buf, size_t len) {
+    if (num_reg_bufs == MAX_REG_BUFS)
+        return -1;
+    reg_bufs[num_reg_bufs].iov_base = buf;
+    reg_bufs[num_reg_bufs].iov_len = len;
+    num_reg_bufs++;
+    return 0;
+}
+
+int raid_io_init(const int *fds, int nfds, enum raid_io_engine e) {
+    engine = e;
+    num_fds = nfds;
+    dev_fds = malloc(nfds * sizeof(*dev_fds));
+    member_stats = calloc(nfds, sizeof(*member_stats));
+    if (!dev_fds || !member_stats)
+        return -1;
+    memcpy(dev_fds, fds, nfds * sizeof(*dev_fds));
+    if (engine == RAID_IO_URING)
+        return get_ring() ? 0 : -1;
+    if (engine != RAID_IO_THREADS)
+        return 0;
+
+    queues = calloc(nfds, sizeof(*queues));
+    if (!queues)
+        return -1;
+    for (int i = 0; i < nfds; i++) {
+        struct io_queue *q = &queues[i];
+        q->fd = fds[i];
+        if (q->fd < 0)
+            continue;
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->ready, NULL);
+        if (pthread_create(&q->thread, NULL, queue_main, q) != 0) {
+            fprintf(stderr, "failed to start I/O thread for device %d\n", i);
+            raid_io_exit();
+            return -1;
+        }
+        q->started = true;
+    }
+    return 0;
+}
+
+void raid_io_exit(void) {
+    pthread_mutex_lock(&rings_lock);
+    while (rings) {
+        struct ring_ctx *ctx = rings;
+        rings = ctx->next;
+        uring_exit(&ctx->ring);
+        free(ctx);
+    }
+    thread_ring = NULL;
+    pthread_mutex_unlock(&rings_lock);
+    for (int i = 0; queues && i < num_fds; i++) {
+        struct io_queue *q = &queues[i];
+        if (!q->started)
+            continue;
+        pthread_mutex_lock(&q->lock);
+        q->stop = true;
+        pthread_cond_signal(&q->ready);
+        pthread_mutex_unlock(&q->lock);
+        pthread_join(q->thread, NULL);
+        pthread_cond_destroy(&q->ready);
+        pthread_mutex_destroy(&q->lock);
+    }
+    free(queues);
+    queues = NULL;
+    free(dev_fds);
+    dev_fds = NULL;
+    free(member_stats);
+    member_stats = NULL;
+    num_fds = 0;
+}
+
+const struct raid_io_member_stats *raid_io_stats(int disk) {
+    return &member_stats[disk];
+}
+
+int raid_io_parse_engine(const char *name, enum raid_io_engine *e) {
+    if (strcmp(name, "sync") == 0)
+        *e = RAID_IO_SYNC;
+    else if (strcmp(name, "threads") == 0)
+        *e = RAID_IO_THREADS;
+    else if (strcmp(name, "uring") == 0)
+        *e = RAID_IO_URING;
+    else
+        return -1;
+    return 0;
+}
+
+const char *raid_io_engine_name(void) {
+    switch (engine) {
+        case RAID_IO_SYNC:
+            return "sync";
+        case RAID_IO_THREADS:
+            return "threads";
+        case RAID_IO_URING:
+            return "uring";
+    }
+    return "unknown";
+}
+
+int raid_io_submit(struct raid_io *ios, int nios) {
+    uint64_t now = histogram_now_ns();
+    int failed = 0;
+
+    for (int i = 0; i < nios; i++) {
+        ios[i].start_ns = now;
+        __atomic_fetch_add(&member_stats[ios[i].disk].inflight, 1, __ATOMIC_RELAXED);
+    }
+    if (engine == RAID_IO_URING) {
+        struct ring_ctx *ctx = get_ring();
+        if (!ctx)
+            errx(EXIT_FAILURE, "no io_uring for this thread");
+        submit_uring(ctx, ios, nios);
+    } else if (engine == RAID_IO_SYNC || nios == 1) {
+        for (int i = 0; i < nios; i++) {
+            do_io(&ios[i], dev_fds[ios[i].disk]);
+            record_io(&ios[i]);
+        }
+    } else {
+        /* The first member's operations run right here, which saves a
+           thread hand-off for the common one-member-per-batch case. */
+        struct raid_io_batch batch;
+        int local = ios[0].disk;
+        pthread_mutex_init(&batch.lock, NULL);
+        pthread_cond_init(&batch.done, NULL);
+        batch.pending = 0;
+        for (int i = 0; i < nios; i++) {
+            if (ios[i].disk != local)
+                batch.pending++;
+        }
+        for (int i = 0; i < nios; i++) {
+            ios[i].batch = &batch;
+            if (ios[i].disk != local)
+                queue_push(&queues[ios[i].disk], &ios[i]);
+        }
+        for (int i = 0; i < nios; i++) {
+            if (ios[i].disk == local) {
+                do_io(&ios[i], dev_fds[local]);
+                record_io(&ios[i]);
+            }
+        }
+        pthread_mutex_lock(&batch.lock);
+        while (batch.pending > 0)
+            pthread_cond_wait(&batch.done, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+        pthread_cond_destroy(&batch.done);
+        pthread_mutex_destroy(&batch.lock);
+    }
+
+    for (int i = 0; i < nios; i++) {
+        if (ios[i].result != (ssize_t)ios[i].len)
+            failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+/* Grow *arr (of *max elements of size elem) to hold at least need. */
+static void *grow(void *arr, int *max, int need, size_t elem) {
+    if (need <= *max)
+        return arr;
+    int n = *max ? *max : 64;
+    while (n < need)
+        n *= 2;
+    arr = realloc(arr, n * elem);
+    if (!arr)
+        err(EXIT_FAILURE, "realloc");
+    *max = n;
+    return arr;
+}
+
+void raid_io_plan_add(struct raid_io_plan *plan, int disk, int write,
+                      uint64_t offset, void *buf, size_t len) {
+    plan->segs = grow(plan->segs, &plan->max_segs, plan->nsegs + 1, sizeof(*plan->segs));
+    struct raid_io_seg *seg = &plan->segs[plan->nsegs];
+    seg->disk = disk;
+    seg->write = write;
+    seg->offset = offset;
+    seg->buf = buf;
+    seg->len = len;
+    seg->seq = plan->nsegs++;
+}
+
+static int seg_cmp(const void *a, const void *b) {
+    const struct raid_io_seg *x = a, *y = b;
+    if (x->disk != y->disk)
+        return x->disk - y->disk;
+    if (x->write != y->write)
+        return x->write - y->write;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return x->seq - y->seq;
+}
+
+static void plan_add_iov(struct raid_io_plan *plan, void *buf, size_t len) {
+    struct raid_io *io = &plan->ios[plan->nios - 1];
+    struct iovec *last = io->iovcnt ? &plan->iovs[plan->niovs - 1] : NULL;
+    io->len += len;
+    if (last && (char *)last->iov_base + last->iov_len == (char *)buf) {
+        last->iov_len += len;
+        return;
+    }
+    plan->iovs = grow(plan->iovs, &plan->max_iovs, plan->niovs + 1, sizeof(*plan->iovs));
+    plan->iovs[plan->niovs].iov_base = buf;
+    plan->iovs[plan->niovs].iov_len = len;
+    plan->niovs++;
+    io->iovcnt++;
+}
+
+int raid_io_plan_submit(struct raid_io_plan *plan, void *sink, size_t max_gap) {
+    qsort(plan->segs, plan->nsegs, sizeof(*plan->segs), seg_cmp);
+    plan->nios = 0;
+    plan->niovs = 0;
+    for (int i = 0; i < plan->nsegs; i++) {
+        struct raid_io_seg *seg = &plan->segs[i];
+        struct raid_io *io = plan->nios ? &plan->ios[plan->nios - 1] : NULL;
+        uint64_t end = io ? io->offset + io->len : 0;
+        bool extend = io && io->disk == seg->disk && io->write == seg->write &&
+                      io->iovcnt < IOV_MAX - 1 && seg->offset >= end &&
+                      (seg->offset == end ||
+                       (!seg->write && sink && seg->offset - end <= max_gap));
+        if (!extend) {
+            plan->ios = grow(plan->ios, &plan->max_ios, plan->nios + 1, sizeof(*plan->ios));
+            io = &plan->ios[plan->nios++];
+            memset(io, 0, sizeof(*io));
+            io->disk = seg->disk;
+            io->write = seg->write;
+            io->offset = seg->offset;
+            /* iov is pointed at the array once it has stopped growing */
+            io->iov = (struct iovec *)(uintptr_t)plan->niovs;
+        } else if (seg->offset > end) {
+            plan_add_iov(plan, sink, seg->offset - end);
+        }
+        plan_add_iov(plan, seg->buf, seg->len);
+    }
+    for (int i = 0; i < plan->nios; i++) {
+        struct raid_io *io = &plan->ios[i];
+        io->iov = &plan->iovs[(uintptr_t)io->iov];
+        if (io->iovcnt == 1) {
+            /* plain transfers can use registered buffers */
+            io->buf = io->iov->iov_base;
+            io->iov = NULL;
+            io->iovcnt = 0;
+        }
+    }
+    plan->nsegs = 0;
+    return plan->nios ? raid_io_submit(plan->ios, plan->nios) : 0;
+}
+
+void raid_io_plan_reset(struct raid_io_plan *plan) {
+    plan->nsegs = 0;
+}
+
+void raid_io_plan_free(struct raid_io_plan *plan) {
+    free(plan->segs);
+    free(plan->ios);
+    free(plan->iovs);
+    memset(plan, 0, sizeof(*plan));
+}
@@ -0,0 +1,108 @@
+#ifndef RAID_IO_H_INCLUDED
+#define RAID_IO_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "histogram.h"
+
+/* Member I/O engines. A caller describes every member operation that one
+   stripe needs, submits them together and waits once, so the latency of a
+   stripe is that of its slowest member instead of the sum of all. */
+
+enum raid_io_engine {
+    RAID_IO_SYNC,       /* one pread/pwrite after the other, on the caller */
+    RAID_IO_THREADS,    /* one worker thread per member */
+    RAID_IO_URING,      /* one io_uring per calling thread */
+};
+
+struct raid_io_batch;
+
+struct raid_io {
+    int disk;           /* member index */
+    int write;          /* pwrite when set, pread otherwise */
+    void *buf;
+    size_t len;         /* total, also when vectored */
+    uint64_t offset;
+    struct iovec *iov;  /* when iovcnt > 0 the transfer uses iov, not buf */
+    int iovcnt;
+    ssize_t result;     /* bytes transferred, or -errno */
+
+    /* engine private */
+    struct raid_io *next;
+    struct raid_io_batch *batch;
+    uint64_t start_ns;
+};
+
+/* What the members have seen so far; latency runs from submission to
+   completion, so a member that lags behind its peers stands out. */
+struct raid_io_member_stats {
+    struct histogram read, write;
+    uint64_t errors;
+    uint64_t read_ewma_ns;      /* smoothed latency of reads up to RAID_IO_EWMA_MAX_LEN */
+    uint32_t inflight;          /* operations submitted and not completed */
+};
+
+#define RAID_IO_EWMA_MAX_LEN (128 * 1024)
+
+/* Start the engine for fds[0..nfds-1]; fds may contain -1 for members that
+   are missing, which must not be the target of any I/O. The io_uring engine
+   registers the member files with every ring it creates. */
+int raid_io_init(const int *fds, int nfds, enum raid_io_engine engine);
+
+/* Declare long-lived scratch memory that I/O will often target, so that the
+   io_uring engine can register it and skip mapping the pages on every
+   operation. Call before raid_io_init(). */
+int raid_io_register_buffer(void *buf, size_t len);
+void raid_io_exit(void);
+
+/* Statistics of member `disk`, kept from raid_io_init() on. */
+const struct raid_io_member_stats *raid_io_stats(int disk);
+
+/* Parse an engine name as given on the command line. */
+int raid_io_parse_engine(const char *name, enum raid_io_engine *engine);
+const char *raid_io_engine_name(void);
+
+/* Run ios[0..nios-1] concurrently and wait for all of them. Operations on
+   the same member run in the order given. Returns 0 when every operation
+   transferred its full length, -1 otherwise; check result to see which
+   ones failed. */
+int raid_io_submit(struct raid_io *ios, int nios);
+
+/* A plan collects the member segments of a whole request in any order.
+   On submission the segments of each member are sorted by offset, and
+   runs that are contiguous on disk become a single vectored operation.
+   Segments of one plan must not overlap on disk. */
+struct raid_io_seg {
+    int disk;
+    int write;
+    uint64_t offset;
+    void *buf;
+    size_t len;
+    int seq;
+};
+
+struct raid_io_plan {
+    struct raid_io_seg *segs;
+    int nsegs, max_segs;
+    struct raid_io *ios;        /* built by raid_io_plan_submit() */
+    int nios, max_ios;
+    struct iovec *iovs;
+    int niovs, max_iovs;
+};
+
+void raid_io_plan_add(struct raid_io_plan *plan, int disk, int write,
+                      uint64_t offset, void *buf, size_t len);
+
+/* Merge and run everything added since the last submission. Read gaps of
+   at most max_gap bytes between two segments of a member are read into
+   sink instead of splitting the operation. Returns like raid_io_submit();
+   plan->ios stays valid until the next call. */
+int raid_io_plan_submit(struct raid_io_plan *plan, void *sink, size_t max_gap);
+
+/* Drop everything added since the last submission. */
+void raid_io_plan_reset(struct raid_io_plan *plan);
+void raid_io_plan_free(struct raid_io_plan *plan);
+
+#endif /* RAID_IO_H_INCLUDED */
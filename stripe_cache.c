@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "stripe_cache.h"
+
+static uint64_t hash_stripe(const struct stripe_cache *c, uint64_t stripe) {
+    return (stripe * 0x9e3779b97f4a7c15ULL >> 32) & c->hash_mask;
+}
+
+static void lru_unlink(struct stripe_cache_entry *e) {
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push_front(struct stripe_cache *c, struct stripe_cache_entry *e) {
+    e->lru_prev = &c->lru;
+    e->lru_next = c->lru.lru_next;
+    c->lru.lru_next->lru_prev = e;
+    c->lru.lru_next = e;
+}
+
+static void hash_unlink(struct stripe_cache *c, struct stripe_cache_entry *e) {
+    struct stripe_cache_entry **p = &c->hash[hash_stripe(c, e->stripe)];
+    while (*p != e)
+        p = &(*p)->hash_next;
+    *p = e->hash_next;
+}
+
+int stripe_cache_init(struct stripe_cache *c, size_t budget, int nblocks, size_t block_size,
+                      int writeback_batch, stripe_cache_writeback_fn writeback, void *arg) {
+    size_t entry_size = (size_t)nblocks * block_size;
+    uint64_t buckets = 1;
+
+    memset(c, 0, sizeof(*c));
+    c->nblocks = nblocks;
+    c->block_size = block_size;
+    c->writeback_batch = writeback_batch > 0 ? writeback_batch : 1;
+    c->writeback = writeback;
+    c->arg = arg;
+    c->lru.lru_prev = c->lru.lru_next = &c->lru;
+    c->nentries = budget / entry_size;
+    if (c->nentries == 0)
+        return 0;
+
+    while (buckets < (uint64_t)c->nentries)
+        buckets <<= 1;
+    c->hash_mask = buckets - 1;
+    c->mem = malloc((size_t)c->nentries * entry_size);
+    c->entries = calloc(c->nentries, sizeof(*c->entries));
+    c->hash = calloc(buckets, sizeof(*c->hash));
+    c->scratch = malloc(c->nentries * sizeof(*c->scratch));
+    if (!c->mem || !c->entries || !c->hash || !c->scratch) {
+        stripe_cache_free(c);
+        return -1;
+    }
+    for (int i = c->nentries - 1; i >= 0; i--) {
+        c->entries[i].data = c->mem + i * entry_size;
+        c->entries[i].hash_next = c->free;
+        c->free = &c->entries[i];
+    }
+    return 0;
+}
+
+void stripe_cache_free(struct stripe_cache *c) {
+    free(c->mem);
+    free(c->entries);
+    free(c->hash);
+    free(c->scratch);
+    memset(c, 0, sizeof(*c));
+}
+
+struct stripe_cache_entry *stripe_cache_lookup(struct stripe_cache *c, uint64_t stripe) {
+    struct stripe_cache_entry *e;
+
+    if (c->nentries == 0)
+        return NULL;
+    for (e = c->hash[hash_stripe(c, stripe)]; e; e = e->hash_next) {
+        if (e->stripe == stripe) {
+            lru_unlink(e);
+            lru_push_front(c, e);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static int by_stripe(const void *a, const void *b) {
+    const struct stripe_cache_entry *x = *(struct stripe_cache_entry *const *)a;
+    const struct stripe_cache_entry *y = *(struct stripe_cache_entry *const *)b;
+    return x->stripe < y->stripe ? -1 : x->stripe > y->stripe;
+}
+
+/* Write back entries[0..n-1] in stripe order and mark them clean. */
+static int write_back(struct stripe_cache *c, struct stripe_cache_entry **entries, int n) {
+    if (n == 0)
+        return 0;
+    qsort(entries, n, sizeof(*entries), by_stripe);
+    if (c->writeback(entries, n, c->arg) != 0)
+        return -1;
+    for (int i = 0; i < n; i++)
+        entries[i]->dirty = 0;
+    c->writebacks += n;
+    return 0;
+}
+
+/* Take the least recent unpinned entry out of the cache. When it is
+   dirty, the dirty entries next to it in LRU order go to the members
+   with it, so that eviction writes whole batches instead of stripe by
+   stripe. */
+static struct stripe_cache_entry *evict(struct stripe_cache *c) {
+    struct stripe_cache_entry *victim = c->lru.lru_prev;
+
+    while (victim != &c->lru && victim->pinned)
+        victim = victim->lru_prev;
+    if (victim == &c->lru)
+        return NULL;
+    if (victim->dirty) {
+        int n = 0;
+        for (struct stripe_cache_entry *e = victim; e != &c->lru && n < c->writeback_batch; e = e->lru_prev) {
+            if (e->dirty && !e->pinned)
+                c->scratch[n++] = e;
+        }
+        if (write_back(c, c->scratch, n) != 0)
+            return NULL;
+    }
+    lru_unlink(victim);
+    hash_unlink(c, victim);
+    return victim;
+}
+
+struct stripe_cache_entry *stripe_cache_get(struct stripe_cache *c, uint64_t stripe) {
+    struct stripe_cache_entry *e = stripe_cache_lookup(c, stripe);
+    uint64_t h;
+
+    if (e || c->nentries == 0) {
+        if (e)
+            c->hits++;
+        return e;
+    }
+    c->misses++;
+    if (c->free) {
+        e = c->free;
+        c->free = e->hash_next;
+    } else if (!(e = evict(c))) {
+        return NULL;
+    }
+    e->stripe = stripe;
+    e->valid = e->dirty = 0;
+    e->pinned = 0;
+    h = hash_stripe(c, stripe);
+    e->hash_next = c->hash[h];
+    c->hash[h] = e;
+    lru_push_front(c, e);
+    return e;
+}
+
+void stripe_cache_drop(struct stripe_cache *c, struct stripe_cache_entry *e) {
+    lru_unlink(e);
+    hash_unlink(c, e);
+    e->hash_next = c->free;
+    c->free = e;
+}
+
+void stripe_cache_drop_range(struct stripe_cache *c, uint64_t first, uint64_t end) {
+    struct stripe_cache_entry *e, *next;
+
+    if (end - first <= (uint64_t)c->nentries) {
+        for (uint64_t stripe = first; stripe < end; stripe++) {
+            if ((e = stripe_cache_lookup(c, stripe)))
+                stripe_cache_drop(c, e);
+        }
+        return;
+    }
+    /* a range larger than the cache: walk the entries instead */
+    for (e = c->lru.lru_next; e != &c->lru; e = next) {
+        next = e->lru_next;
+        if (e->stripe >= first && e->stripe < end)
+            stripe_cache_drop(c, e);
+    }
+}
+
+int stripe_cache_flush(struct stripe_cache *c) {
+    int n = 0;
+
+    for (struct stripe_cache_entry *e = c->lru.lru_next; e != &c->lru; e = e->lru_next) {
+        if (e->dirty)
+            c->scratch[n++] = e;
+    }
+    return write_back(c, c->scratch, n);
+}
@@ -0,0 +1,80 @@
+#ifndef STRIPE_CACHE_H_INCLUDED
+#define STRIPE_CACHE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* An LRU cache of stripes within a fixed memory budget. An entry holds
+   the data blocks of one stripe; bit `pos` of valid/dirty refers to the
+   pos-th data block of the stripe, not to a member. Dirty blocks are
+   newer than the members and must reach them through the writeback
+   callback before the entry can be reused. */
+
+struct stripe_cache_entry {
+    uint64_t stripe;
+    uint32_t valid;         /* blocks whose contents are known */
+    uint32_t dirty;         /* blocks not yet written to the members */
+    int pinned;             /* never evicted while set */
+    unsigned char *data;    /* nblocks * block_size bytes */
+
+    struct stripe_cache_entry *lru_prev, *lru_next, *hash_next;
+};
+
+/* Write the dirty blocks of entries[0..n-1] to the members, in stripe
+   order. Returns 0 on success; the cache then marks them clean. */
+typedef int (*stripe_cache_writeback_fn)(struct stripe_cache_entry **entries, int n, void *arg);
+
+struct stripe_cache {
+    int nblocks;
+    size_t block_size;
+    int nentries;
+    int writeback_batch;    /* dirty entries written back per eviction */
+    stripe_cache_writeback_fn writeback;
+    void *arg;
+
+    struct stripe_cache_entry *entries;
+    unsigned char *mem;
+    struct stripe_cache_entry **hash;
+    uint64_t hash_mask;
+    struct stripe_cache_entry lru;      /* lru.lru_next is the most recent */
+    struct stripe_cache_entry *free;
+    struct stripe_cache_entry **scratch;
+
+    uint64_t hits, misses, writebacks;
+};
+
+/* Size the cache for `budget` bytes of stripes with nblocks data blocks.
+   A budget smaller than one stripe leaves the cache disabled. Returns 0,
+   or -1 when the memory cannot be allocated. */
+int stripe_cache_init(struct stripe_cache *c, size_t budget, int nblocks, size_t block_size,
+                      int writeback_batch, stripe_cache_writeback_fn writeback, void *arg);
+void stripe_cache_free(struct stripe_cache *c);
+
+static inline int stripe_cache_enabled(const struct stripe_cache *c) {
+    return c->nentries > 0;
+}
+
+static inline unsigned char *stripe_cache_block(const struct stripe_cache *c,
+                                                const struct stripe_cache_entry *e, int pos) {
+    return e->data + (size_t)pos * c->block_size;
+}
+
+/* The entry of `stripe`, made the most recent, or NULL. */
+struct stripe_cache_entry *stripe_cache_lookup(struct stripe_cache *c, uint64_t stripe);
+
+/* The entry of `stripe`, allocating an empty one when it is not cached.
+   Eviction may write back the least recent dirty entries first. Returns
+   NULL when every entry is pinned or the writeback failed. */
+struct stripe_cache_entry *stripe_cache_get(struct stripe_cache *c, uint64_t stripe);
+
+/* Forget an entry, dirty or not. */
+void stripe_cache_drop(struct stripe_cache *c, struct stripe_cache_entry *e);
+
+/* Forget the entries of stripes [first, end), dirty or not. */
+void stripe_cache_drop_range(struct stripe_cache *c, uint64_t first, uint64_t end);
+
+/* Write back every dirty entry. Returns 0, or -1 if a writeback failed;
+   entries that could not be written stay dirty. */
+int stripe_cache_flush(struct stripe_cache *c);
+
+#endif /* STRIPE_CACHE_H_INCLUDED */
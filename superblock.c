@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "superblock.h"
+
+#define SUPERBLOCK_MAGIC "BR5SUPER"
+#define SUPERBLOCK_VERSION 2
+
+static uint32_t crc32(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t crc = 0xffffffff;
+
+    while (len--) {
+        crc ^= *p++;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint32_t checksum(const struct superblock *sb) {
+    struct superblock copy = *sb;
+    copy.checksum = 0;
+    return crc32(&copy, sizeof(copy));
+}
+
+uint64_t superblock_offset(uint64_t member_size) {
+    uint64_t end = member_size & ~(uint64_t)(SUPERBLOCK_BYTES - 1);
+    return end >= 2 * SUPERBLOCK_BYTES ? end - SUPERBLOCK_BYTES : 0;
+}
+
+int superblock_create(struct superblock *sb) {
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    memset(sb, 0, sizeof(*sb));
+    memcpy(sb->magic, SUPERBLOCK_MAGIC, sizeof(sb->magic));
+    sb->version = SUPERBLOCK_VERSION;
+    sb->rebuild_slot = -1;
+    if (fd < 0 || read(fd, sb->uuid, sizeof(sb->uuid)) != sizeof(sb->uuid)) {
+        perror("/dev/urandom");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+int superblock_read(int fd, struct superblock *sb) {
+    uint64_t offset = superblock_offset(lseek(fd, 0, SEEK_END));
+
+    if (offset == 0 || pread(fd, sb, sizeof(*sb), offset) != sizeof(*sb) ||
+        memcmp(sb->magic, SUPERBLOCK_MAGIC, sizeof(sb->magic)) != 0)
+        return -1;
+    if (sb->version != SUPERBLOCK_VERSION || sb->checksum != checksum(sb) ||
+        sb->ndisks > SUPERBLOCK_MAX_DEVICES || sb->slot >= sb->ndisks)
+        return -2;
+    return 0;
+}
+
+int superblock_write(const struct superblock *sb, const int *fds, int nfds) {
+    unsigned char block[SUPERBLOCK_BYTES] = { 0 };
+    struct superblock *copy = (struct superblock *)block;
+    int ret = 0;
+
+    for (int i = 0; i < nfds; i++) {
+        if (fds[i] < 0)
+            continue;
+        *copy = *sb;
+        copy->slot = i;
+        copy->checksum = checksum(copy);
+        uint64_t offset = superblock_offset(lseek(fds[i], 0, SEEK_END));
+        if (pwrite(fds[i], block, sizeof(block), offset) != sizeof(block) || fdatasync(fds[i]) != 0) {
+            fprintf(stderr, "superblock write (device %d): %s\n", i, strerror(errno));
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+const char *superblock_uuid(const struct superblock *sb) {
+    static char text[37];
+    char *p = text;
+
+    for (int i = 0; i < 16; i++) {
+        p += sprintf(p, "%02x", sb->uuid[i]);
+        if (i == 3 || i == 5 || i == 7 || i == 9)
+            *p++ = '-';
+    }
+    return text;
+}
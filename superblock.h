@@ -0,0 +1,71 @@
+#ifndef SUPERBLOCK_H_INCLUDED
+#define SUPERBLOCK_H_INCLUDED
+
+#include <stdint.h>
+
+/* Array superblock. Every member keeps a copy in its last 4 KiB-aligned
+   4 KiB, above the data and the write-intent bitmap, so it is found
+   without knowing the block size. It records which array the member
+   belongs to, the geometry, the member's slot and the state of every
+   slot, so that the array can be assembled from its members in any
+   order. The event counter moves on whenever the array starts or a
+   member changes state; a member whose copy lags behind the others
+   missed writes and has to be rebuilt. A rebuild records how far it
+   got, and resumes there after a restart; so does a reshape onto one
+   more member. */
+
+#define SUPERBLOCK_BYTES 4096
+#define SUPERBLOCK_MAX_DEVICES 16
+
+#define SUPERBLOCK_BITMAP 1     /* the array keeps a write-intent bitmap */
+#define SUPERBLOCK_CLEAN 2      /* it was shut down cleanly */
+
+enum superblock_state {
+    SUPERBLOCK_ACTIVE,
+    SUPERBLOCK_MISSING,
+    SUPERBLOCK_REBUILDING,
+};
+
+struct superblock {
+    char magic[8];
+    uint32_t version;
+    uint32_t checksum;      /* crc32 of the superblock with this field 0 */
+    uint8_t uuid[16];
+    uint64_t events;
+    uint64_t data_blocks;   /* of each member */
+    uint32_t block_size;
+    uint32_t chunk_size;
+    uint32_t level;
+    uint32_t layout;
+    uint32_t ndisks;
+    uint32_t slot;          /* of the member holding this copy */
+    uint32_t flags;
+    int32_t rebuild_slot;   /* member being rebuilt, or -1 */
+    uint64_t rebuild_checkpoint;    /* stripes of it known to be rebuilt */
+    uint8_t state[SUPERBLOCK_MAX_DEVICES];  /* enum superblock_state of every slot */
+    uint32_t reshape_from;  /* members before the reshape under way, or 0 */
+    uint32_t reshape_backup;        /* its first chunk rows are in the backup */
+    uint64_t reshape_checkpoint;    /* chunk rows known to be restriped */
+};
+
+/* Where the superblock of a member of member_size bytes lives, or 0 when
+   the member is too small to hold one. */
+uint64_t superblock_offset(uint64_t member_size);
+
+/* Fill sb with a new array of a random UUID. */
+int superblock_create(struct superblock *sb);
+
+/* Read the superblock of the member open as fd. Returns 0, -1 when it
+   has none, or -2 when it has one that is damaged or of another
+   version. */
+int superblock_read(int fd, struct superblock *sb);
+
+/* Write sb to every member with an fd other than -1, each with its own
+   slot, and wait until it is durable. Returns 0, or -1 with a message
+   on stderr. */
+int superblock_write(const struct superblock *sb, const int *fds, int nfds);
+
+/* The UUID in the usual text form, in a static buffer. */
+const char *superblock_uuid(const struct superblock *sb);
+
+#endif /* SUPERBLOCK_H_INCLUDED */
@@ -0,0 +1,57 @@
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+/* Just enough of io_uring for BUSE backends, on top of the raw system
+   calls so that no liburing is needed. A ring must only be used by one
+   thread at a time, except that one thread may submit while another one
+   waits for and reaps completions with uring_wait(). */
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_head, sqe_tail;    /* published in the ring / handed out */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/* Returns 0, or -errno when the kernel has no (usable) io_uring. */
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+
+/* Next free submission entry, zeroed, or NULL when the queue is full. */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Submit everything queued that the kernel has not taken yet, including
+   what an earlier call failed to submit, and wait until at least wait_nr
+   completions are available. Returns the number submitted or -errno;
+   entries left over stay queued. */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+
+/* Entries queued that the kernel has not taken yet. */
+unsigned uring_pending(const struct uring *ring);
+
+/* Take back the entries the kernel has not taken yet, so that they are
+   never executed. Only the submitting thread calls io_uring_enter with
+   entries to submit, so none can be taken meanwhile. */
+void uring_unqueue(struct uring *ring);
+
+/* Wait until at least wait_nr completions are available, submitting
+   nothing. Returns 0 or -errno. */
+int uring_wait(struct uring *ring, unsigned wait_nr);
+
+/* Oldest unseen completion or NULL, and its release. */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+int uring_register_files(struct uring *ring, const int *fds, unsigned nfds);
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned niov);
+
+#endif /* URING_H_INCLUDED */